@@ -0,0 +1,293 @@
+/*
+	Microbenchmarks - Major Steps:
+	- Register clients connected to socketpair sinks and join them to channels
+	  of 1, 10 and 100 recipients, through the same calls the server uses;
+	- Run each hot path function in timed batches, draining the sinks between them;
+	- Report ns/op and allocations/op (malloc, calloc and realloc called by
+	  the server code, counted by the linker wrappers below).
+
+	Built and run with "make bench", which links every server file but
+	server.c into ./microbench.
+*/
+
+#include <time.h>
+#include <sys/socket.h>
+
+#include "string_manipulation.h"
+#include "server_operation.h"
+#include "event_loop.h"
+#include "client_pool.h"
+#include "channel_table.h"
+
+// Each benchmark runs for about this long, in nanoseconds
+#define BENCH_TIME 300000000u
+
+// A batch is timed on its own; it should take at least this long
+#define BATCH_TIME 10000000u
+
+#define FANOUT_MAX 100
+
+// === ALLOCATION COUNTING ===
+/* -Wl,--wrap=malloc sends the calls made by the server code to
+__wrap_malloc(), which counts them and calls the real malloc(). */
+
+static unsigned long allocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size) {
+	allocs++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+	allocs++;
+	return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+// === FIXTURES ===
+
+// Peer ends of the clients' sockets
+static int sinks[2 * FANOUT_MAX];
+static int nroSinks = 0;
+
+// Senders of the channels with 1, 10 and 100 recipients
+static Client* sender1;
+static Client* sender10;
+static Client* sender100;
+
+static volatile long sink;
+
+static const char line[] = "alice: uma mensagem de chat de tamanho comum, com umas sessenta letras\n";
+static const char joinMsg[] = " /join #canal-de-teste\n";
+
+// Current time of the monotonic clock, in nanoseconds
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Reads and discards everything waiting in the sinks.
+static void drain_sinks() {
+	char buf[65536];
+
+	for (int i = 0; i < nroSinks; i++)
+		while (read(sinks[i], buf, sizeof(buf)) > 0);
+}
+
+// Writes every queued message to the sinks, as the end of an event loop turn does.
+static void flush_all() {
+	while (workers[0].flushList) {
+		Client* cli = workers[0].flushList;
+
+		unschedule_flush(cli);
+		client_flush(cli);
+	}
+}
+
+// Connects a client to a socketpair sink and names it, as the event loop does.
+static Client* new_client(char* nick) {
+	struct sockaddr_in addr = {};
+	char record[NICK_LEN] = {};
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return NULL;
+
+	set_nonblocking(sv[0]);
+	set_nonblocking(sv[1]);
+
+	Client* cli = client_pool_get();
+	if (!cli || create_client(addr, sv[0], cli) < 0) return NULL;
+
+	strcpy(record, nick);
+	handle_nick(cli, record, NICK_LEN);
+
+	sinks[nroSinks++] = sv[1];
+
+	return cli;
+}
+
+// Creates a channel with a sender and some recipients; returns the sender.
+static Client* new_channel(char* name, int recipients) {
+	char nick[NICK_LEN], buffer[BUFFER_MAX];
+	Client* first = NULL;
+
+	for (int i = 0; i <= recipients; i++) {
+		sprintf(nick, "%s-%d", name + 1, i);
+
+		Client* cli = new_client(nick);
+		if (!cli) return NULL;
+
+		sprintf(buffer, "%s: /join %s\n", nick, name);
+		handle_message(cli, buffer, strlen(buffer));
+
+		if (!first) first = cli;
+	}
+
+	flush_all();
+	drain_sinks();
+
+	return first;
+}
+
+// === BENCHMARKS ===
+// Each one runs its operation n times.
+
+static void bench_str_trim(long n) {
+	char buf[sizeof(line)];
+	int len = sizeof(line) - 1;
+
+	memcpy(buf, line, sizeof(line));
+
+	for (long i = 0; i < n; i++) {
+		str_trim(buf, len);
+		buf[len - 1] = '\n';
+	}
+}
+
+static void bench_nick_trim(long n) {
+	char buf[sizeof(line)], msg[BUFFER_MAX];
+
+	memcpy(buf, line, sizeof(line));
+
+	for (long i = 0; i < n; i++) nick_trim(buf, msg);
+}
+
+static void bench_change_color(long n) {
+	char buf[sizeof(line)], nick[NICK_LEN];
+
+	memcpy(buf, line, sizeof(line));
+
+	for (long i = 0; i < n; i++) change_color(buf, nick);
+}
+
+static void bench_get_command(long n) {
+	char msg[sizeof(joinMsg)], channel[CHANNEL_LEN];
+
+	memcpy(msg, joinMsg, sizeof(joinMsg));
+
+	for (long i = 0; i < n; i++) get_command(channel, msg, 7, CHANNEL_LEN);
+}
+
+static void bench_check_channel(long n) {
+	char channel[CHANNEL_LEN] = "#canal-de-teste";
+
+	for (long i = 0; i < n; i++) sink += check_channel(channel);
+}
+
+static void bench_check_nick(long n) {
+	char nick[NICK_LEN] = "f100-50";
+
+	for (long i = 0; i < n; i++) sink += check_nick(nick, sender100->idChannel);
+}
+
+static void bench_find_client(long n) {
+	char nick[NICK_LEN] = "f100-50";
+
+	for (long i = 0; i < n; i++) sink += find_client(nick, sender100);
+}
+
+// A channel message is queued to every recipient and written to its socket.
+static void fanout(Client* sender, long n) {
+	char msg[sizeof(line)];
+
+	memcpy(msg, line, sizeof(line));
+
+	for (long i = 0; i < n; i++) {
+		send_message_to_channel(msg, sender->userID, sender->idChannel, 0);
+		flush_all();
+	}
+}
+
+static void bench_fanout1(long n) { fanout(sender1, n); }
+static void bench_fanout10(long n) { fanout(sender10, n); }
+static void bench_fanout100(long n) { fanout(sender100, n); }
+
+/* Runs a benchmark in batches of growing size until a batch takes
+BATCH_TIME (or maxBatch operations, so the sinks do not fill up), then
+for about BENCH_TIME in total, draining the sinks between batches. */
+static void measure(const char* name, void (*run)(long n), long maxBatch) {
+	long batch = 1, ops = 0;
+	uint64_t elapsed = 0;
+	unsigned long allocated = 0;
+
+	while (1) {
+		uint64_t t = now_ns();
+		run(batch);
+		t = now_ns() - t;
+
+		drain_sinks();
+
+		if (t >= BATCH_TIME || batch >= maxBatch) break;
+		batch *= 2;
+	}
+
+	if (batch > maxBatch) batch = maxBatch;
+
+	while (elapsed < BENCH_TIME) {
+		unsigned long a = allocs;
+		uint64_t t = now_ns();
+
+		run(batch);
+
+		elapsed += now_ns() - t;
+		allocated += allocs - a;
+		ops += batch;
+
+		drain_sinks();
+	}
+
+	printf("%-28s %10.1f ns/op %8.2f allocs/op\n", name, (double) elapsed / ops, (double) allocated / ops);
+}
+
+int main() {
+	// Everything runs on a single thread, which acts as worker 0
+	thisWorker = &workers[0];
+	pthread_rwlock_wrlock(&clients_lock);
+
+	if (client_pool_init() < 0) {
+		printf("\nErro: malloc.\n");
+
+		// EXIT FAILURE
+		return 1;
+	}
+
+	initialize_channel_list();
+	initialize_commands();
+
+	sender1 = new_channel("#f1", 1);
+	sender10 = new_channel("#f10", 10);
+	sender100 = new_channel("#f100", FANOUT_MAX);
+
+	if (!sender1 || !sender10 || !sender100) {
+		printf("\nErro: fixtures.\n");
+
+		// EXIT FAILURE
+		return 1;
+	}
+
+	measure("str_trim", bench_str_trim, 1L << 30);
+	measure("nick_trim", bench_nick_trim, 1L << 30);
+	measure("change_color", bench_change_color, 1L << 30);
+	measure("get_command", bench_get_command, 1L << 30);
+	measure("check_channel", bench_check_channel, 1L << 30);
+	measure("check_nick", bench_check_nick, 1L << 30);
+	measure("find_client", bench_find_client, 1L << 30);
+
+	// Each message is about 80 bytes per recipient; the sinks take a few hundred KiB
+	measure("send_message_to_channel/1", bench_fanout1, 1024);
+	measure("send_message_to_channel/10", bench_fanout10, 256);
+	measure("send_message_to_channel/100", bench_fanout100, 32);
+
+	return 0;
+}
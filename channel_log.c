@@ -0,0 +1,576 @@
+// === FUNCTIONS RELATED TO THE CHANNEL MESSAGE LOG ===
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "channel_log.h"
+#include "server_config.h"
+#include "server_operation.h"
+
+/* Guards the dirty list, the retired descriptors and the logs' fd: logs of
+different channels are appended to by several workers at once. */
+static pthread_mutex_t logsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Logs with writes not synced yet, linked through dirtyNext
+static ChannelLog* dirtyLogs = NULL;
+static int nroDirty = 0;
+
+// Descriptors of closed segments and new directories not synced yet
+static int* retired = NULL;
+static int nroRetired = 0;
+static int capRetired = 0;
+
+/* Hands a descriptor to the sync thread, which syncs and closes it. With
+-D 0, or if it cannot be kept, it is synced here. */
+static void retire_fd(int fd) {
+	pthread_mutex_lock(&logsMutex);
+
+	if (config.logSyncMs > 0 && nroRetired == capRetired) {
+		int size = capRetired ? capRetired * 2 : 16;
+
+		int* tmp = (int*) realloc(retired, size * sizeof(int));
+		if (tmp) {
+			retired = tmp;
+			capRetired = size;
+		}
+	}
+
+	if (config.logSyncMs > 0 && nroRetired < capRetired) {
+		retired[nroRetired++] = fd;
+		pthread_mutex_unlock(&logsMutex);
+		return;
+	}
+
+	pthread_mutex_unlock(&logsMutex);
+
+	fsync(fd);
+	close(fd);
+}
+
+// Syncs the dirty logs and the retired descriptors every -D milliseconds.
+static void* sync_logs(void* arg) {
+	struct timespec window = {config.logSyncMs / 1000, (config.logSyncMs % 1000) * 1000000L};
+	int* fds = NULL;
+	int capFds = 0;
+
+	while (1) {
+		nanosleep(&window, NULL);
+
+		/* Only descriptors are collected under the lock; the logs are dup()ed,
+		 so they may be written, rotated or closed while they are synced. */
+		pthread_mutex_lock(&logsMutex);
+
+		int n = 0;
+
+		if (nroDirty + nroRetired > capFds) {
+			int* tmp = (int*) realloc(fds, (nroDirty + nroRetired) * sizeof(int));
+
+			if (!tmp) {
+				pthread_mutex_unlock(&logsMutex);
+				continue;
+			}
+
+			fds = tmp;
+			capFds = nroDirty + nroRetired;
+		}
+
+		for (ChannelLog** p = &dirtyLogs; *p;) {
+			ChannelLog* log = *p;
+
+			// Out of descriptors: the log is left for the next turn
+			if ((fds[n] = dup(log->fd)) < 0) {
+				p = &log->dirtyNext;
+				continue;
+			}
+
+			n++;
+			log->dirty = 0;
+			*p = log->dirtyNext;
+			nroDirty--;
+		}
+
+		memcpy(fds + n, retired, nroRetired * sizeof(int));
+		n += nroRetired;
+		nroRetired = 0;
+
+		pthread_mutex_unlock(&logsMutex);
+
+		for (int i = 0; i < n; i++) {
+			fsync(fds[i]);
+			close(fds[i]);
+		}
+	}
+
+	return NULL;
+}
+
+// Creates the log directory and starts the sync thread.
+int channel_log_start() {
+	pthread_t tid;
+
+	if (mkdir(config.logDir, 0755) < 0 && errno != EEXIST) return -1;
+
+	if (config.logSyncMs == 0) return 0;
+
+	if (pthread_create(&tid, NULL, sync_logs, NULL) != 0) return -1;
+
+	pthread_detach(tid);
+
+	return 0;
+}
+
+// Path of a segment file.
+static void segment_path(ChannelLog* log, uint64_t base, char* path) {
+	snprintf(path, PATH_MAX, "%s/%020llu.log", log->dir, (unsigned long long) base);
+}
+
+// Adds a record offset to a segment's sparse index.
+static int index_push(LogSegment* s, uint32_t off) {
+	if (s->nroIndex == s->capIndex) {
+		uint32_t size = s->capIndex ? s->capIndex * 2 : 16;
+
+		uint32_t* tmp = (uint32_t*) realloc(s->index, size * sizeof(uint32_t));
+		if (!tmp) return -1;
+
+		s->index = tmp;
+		s->capIndex = size;
+	}
+
+	s->index[s->nroIndex++] = off;
+
+	return 0;
+}
+
+// Drops a segment's index; it is built again by the next read.
+static void index_drop(LogSegment* s) {
+	free(s->index);
+	s->index = NULL;
+	s->nroIndex = 0;
+	s->capIndex = 0;
+}
+
+/* Scans a mapped segment, counting its messages and building its index.
+It stops at the first record that is cut or does not match its crc: what
+follows was not written whole. */
+static int index_segment(LogSegment* s, const char* map, size_t size) {
+	uint32_t off = 0;
+
+	s->count = 0;
+	index_drop(s);
+
+	while (size - off >= LOG_HEADER_LEN) {
+		uint32_t recSize, crc;
+
+		memcpy(&recSize, map + off, 4);
+		memcpy(&crc, map + off + 4, 4);
+
+		if (recSize < LOG_HEADER_LEN || recSize > size - off ||
+		    (uint8_t) map[off + 12] > recSize - LOG_HEADER_LEN ||
+		    crc32(0, (const Bytef*) map + off + 8, recSize - 8) != crc) break;
+
+		if (s->count % LOG_INDEX_EVERY == 0 && index_push(s, off) < 0) {
+			index_drop(s);
+			return -1;
+		}
+
+		s->count++;
+		off += recSize;
+	}
+
+	// An empty segment still gets an (empty) index, so appends keep it up to date
+	if (!s->index) {
+		if (index_push(s, 0) < 0) return -1;
+		s->nroIndex = 0;
+	}
+
+	s->size = off;
+
+	return 0;
+}
+
+// Compares two segments by the number of their first message.
+static int compare_segments(const void* a, const void* b) {
+	uint64_t x = ((const LogSegment*) a)->base, y = ((const LogSegment*) b)->base;
+
+	return (x > y) - (x < y);
+}
+
+// Adds a segment to the log; its size and index are unknown until it is read.
+static int add_segment(ChannelLog* log, uint64_t base) {
+	if (log->nroSegs == log->capSegs) {
+		int size = log->capSegs ? log->capSegs * 2 : 8;
+
+		LogSegment* tmp = (LogSegment*) realloc(log->segs, size * sizeof(LogSegment));
+		if (!tmp) return -1;
+
+		log->segs = tmp;
+		log->capSegs = size;
+	}
+
+	memset(&log->segs[log->nroSegs], 0, sizeof(LogSegment));
+	log->segs[log->nroSegs++].base = base;
+
+	return 0;
+}
+
+// Lists the segment files of a log, oldest first.
+static int list_segments(ChannelLog* log) {
+	DIR* dir = opendir(log->dir);
+	struct dirent* entry;
+
+	if (!dir) return -1;
+
+	while ((entry = readdir(dir))) {
+		unsigned long long base;
+		char end[5] = {};
+
+		if (strlen(entry->d_name) != 24 || sscanf(entry->d_name, "%20llu%4s", &base, end) != 2 ||
+		    strcmp(end, ".log") != 0) continue;
+
+		if (add_segment(log, base) < 0) {
+			closedir(dir);
+			return -1;
+		}
+	}
+
+	closedir(dir);
+
+	if (log->nroSegs > 1) qsort(log->segs, log->nroSegs, sizeof(LogSegment), compare_segments);
+
+	return 0;
+}
+
+// Starts a new segment, whose first message will be number base.
+static int new_segment(ChannelLog* log, uint64_t base) {
+	char path[PATH_MAX];
+
+	segment_path(log, base, path);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	if (add_segment(log, base) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	// Empty index, kept up to date by the appends
+	if (index_push(&log->segs[log->nroSegs - 1], 0) < 0) {
+		log->nroSegs--;
+		close(fd);
+		return -1;
+	}
+
+	log->segs[log->nroSegs - 1].nroIndex = 0;
+
+	// The sync thread dup()s the fd of a dirty log
+	pthread_mutex_lock(&logsMutex);
+	log->fd = fd;
+	pthread_mutex_unlock(&logsMutex);
+
+	// The new file is only durable once its directory is synced
+	int dirfd = open(log->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd >= 0) retire_fd(dirfd);
+
+	return 0;
+}
+
+/* Opens the last segment for appending: it is indexed and whatever follows
+its last whole message is cut off. */
+static int open_last_segment(ChannelLog* log) {
+	LogSegment* s = &log->segs[log->nroSegs - 1];
+	char path[PATH_MAX];
+	struct stat st;
+
+	segment_path(log, s->base, path);
+
+	int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size > 0) {
+		char* map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+
+		int err = index_segment(s, map, st.st_size);
+		munmap(map, st.st_size);
+
+		if (err < 0 || (s->size < st.st_size && ftruncate(fd, s->size) < 0)) {
+			close(fd);
+			return -1;
+		}
+	} else if (index_segment(s, NULL, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	log->fd = fd;
+
+	return 0;
+}
+
+// Opens a channel's log.
+ChannelLog* channel_log_open(char* name) {
+	if (!config.logDir) return NULL;
+
+	ChannelLog* log = (ChannelLog*) calloc(1, sizeof(ChannelLog));
+	if (!log) return NULL;
+
+	log->fd = -1;
+
+	// Channel names may hold '/' and the like; the directory is named in hex
+	int n = snprintf(log->dir, sizeof(log->dir), "%s/", config.logDir);
+
+	for (char* c = name; *c; c++) {
+		if (n + 3 > (int) sizeof(log->dir)) goto fail;
+		n += sprintf(log->dir + n, "%02x", (unsigned char) *c);
+	}
+
+	if (mkdir(log->dir, 0755) < 0 && errno != EEXIST) goto fail;
+
+	if (list_segments(log) < 0) goto fail;
+
+	if (log->nroSegs == 0) {
+		if (new_segment(log, 0) < 0) goto fail;
+	} else if (open_last_segment(log) < 0) {
+		goto fail;
+	}
+
+	log->next = log->segs[log->nroSegs - 1].base + log->segs[log->nroSegs - 1].count;
+
+	return log;
+
+fail:
+	for (int i = 0; i < log->nroSegs; i++) index_drop(&log->segs[i]);
+	free(log->segs);
+	free(log);
+
+	return NULL;
+}
+
+// Closes the last segment and starts the next one.
+static int rotate(ChannelLog* log) {
+	int old = log->fd;
+
+	if (new_segment(log, log->next) < 0) return -1;
+
+	// Its writes not synced yet go with it to the sync thread
+	if (log->dirty) retire_fd(old);
+	else close(old);
+
+	return 0;
+}
+
+// Appends a chat message to the log.
+int channel_log_append(ChannelLog* log, uint32_t sender, const char* nick, int nickLen, const char* text, int len) {
+	char head[LOG_HEADER_LEN];
+	uint32_t size = LOG_HEADER_LEN + nickLen + len;
+
+	if (!log || nickLen > UINT8_MAX) return -1;
+
+	if (log->segs[log->nroSegs - 1].size > 0 &&
+	    log->segs[log->nroSegs - 1].size + size > LOG_SEGMENT_BYTES && rotate(log) < 0) return -1;
+
+	LogSegment* s = &log->segs[log->nroSegs - 1];
+
+	memcpy(head, &size, 4);
+	memcpy(head + 8, &sender, 4);
+	head[12] = (char) nickLen;
+
+	uint32_t crc = crc32(0, (const Bytef*) head + 8, LOG_HEADER_LEN - 8);
+	crc = crc32(crc, (const Bytef*) nick, nickLen);
+	crc = crc32(crc, (const Bytef*) text, len);
+	memcpy(head + 4, &crc, 4);
+
+	struct iovec iov[3] = {
+		{head, LOG_HEADER_LEN},
+		{(void*) nick, nickLen},
+		{(void*) text, len},
+	};
+
+	ssize_t n = writev(log->fd, iov, 3);
+
+	if (n != (ssize_t) size) {
+		// A partial record would hide every message written after it
+		if (n > 0) ftruncate(log->fd, s->size);
+
+		return -1;
+	}
+
+	if (s->index && s->count % LOG_INDEX_EVERY == 0 && index_push(s, s->size) < 0) index_drop(s);
+
+	s->count++;
+	s->size += size;
+	log->next++;
+
+	/* dirty is only cleared by the sync thread, after these writes if it was
+	 still set: then they are synced with the others */
+	if (config.logSyncMs == 0) {
+		fdatasync(log->fd);
+	} else if (!log->dirty) {
+		pthread_mutex_lock(&logsMutex);
+
+		log->dirty = 1;
+		log->dirtyNext = dirtyLogs;
+		dirtyLogs = log;
+		nroDirty++;
+
+		pthread_mutex_unlock(&logsMutex);
+	}
+
+	return 0;
+}
+
+// Index of the segment holding message number seq (the first one if it is older).
+static int find_segment(ChannelLog* log, uint64_t seq) {
+	int lo = 0, hi = log->nroSegs - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+
+		if (log->segs[mid].base <= seq) lo = mid;
+		else hi = mid - 1;
+	}
+
+	return lo;
+}
+
+// Reads the messages from number from on.
+int channel_log_read(ChannelLog* log, uint64_t from, LogReader fn, void* arg) {
+	int total = 0;
+
+	if (!log) return -1;
+
+	for (int i = find_segment(log, from); i < log->nroSegs; i++) {
+		LogSegment* s = &log->segs[i];
+		int fd = log->fd;
+		size_t size = s->size;
+
+		if (i < log->nroSegs - 1) {
+			char path[PATH_MAX];
+			struct stat st;
+
+			segment_path(log, s->base, path);
+
+			if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+
+			// Until the segment is indexed, its whole file is mapped
+			if (!s->index) {
+				if (fstat(fd, &st) < 0) {
+					close(fd);
+					return -1;
+				}
+
+				size = st.st_size;
+			}
+		}
+
+		if (size == 0) {
+			if (fd != log->fd) close(fd);
+			continue;
+		}
+
+		char* map = (char*) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (fd != log->fd) close(fd);
+		if (map == MAP_FAILED) return -1;
+
+		if (!s->index && index_segment(s, map, size) < 0) {
+			munmap(map, size);
+			return -1;
+		}
+
+		// The index gives the nearest message at or before from; the rest are skipped
+		uint64_t skip = from > s->base ? from - s->base : 0;
+
+		if (skip < s->count) {
+			uint64_t k = skip / LOG_INDEX_EVERY;
+			uint32_t off = s->index[k];
+
+			for (uint64_t seq = k * LOG_INDEX_EVERY; seq < s->count; seq++) {
+				uint32_t recSize, sender;
+				uint8_t nickLen;
+
+				memcpy(&recSize, map + off, 4);
+				memcpy(&sender, map + off + 8, 4);
+				nickLen = (uint8_t) map[off + 12];
+
+				if (seq >= skip) {
+					fn(sender, map + off + LOG_HEADER_LEN, nickLen, map + off + LOG_HEADER_LEN + nickLen,
+					   recSize - LOG_HEADER_LEN - nickLen, arg);
+					total++;
+				}
+
+				off += recSize;
+			}
+		}
+
+		munmap(map, size);
+	}
+
+	return total;
+}
+
+// Syncs every log now.
+void channel_log_flush() {
+	pthread_mutex_lock(&logsMutex);
+
+	for (ChannelLog* log = dirtyLogs; log; log = log->dirtyNext) {
+		fdatasync(log->fd);
+		log->dirty = 0;
+	}
+
+	dirtyLogs = NULL;
+	nroDirty = 0;
+
+	for (int i = 0; i < nroRetired; i++) {
+		fsync(retired[i]);
+		close(retired[i]);
+	}
+
+	nroRetired = 0;
+
+	pthread_mutex_unlock(&logsMutex);
+}
+
+// Closes a log.
+void channel_log_close(ChannelLog* log) {
+	if (!log) return;
+
+	pthread_mutex_lock(&logsMutex);
+
+	int dirty = log->dirty;
+
+	if (dirty) {
+		for (ChannelLog** p = &dirtyLogs; *p; p = &(*p)->dirtyNext) {
+			if (*p == log) {
+				*p = log->dirtyNext;
+				nroDirty--;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&logsMutex);
+
+	if (dirty) retire_fd(log->fd);
+	else close(log->fd);
+
+	for (int i = 0; i < log->nroSegs; i++) index_drop(&log->segs[i]);
+
+	free(log->segs);
+	free(log);
+}
@@ -0,0 +1,133 @@
+// === FUNCTIONS RELATED TO THE CHANNEL MESSAGE LOG ===
+#ifndef CHANNEL_LOG_H
+#define CHANNEL_LOG_H
+
+#include <stdint.h>
+#include <limits.h>
+
+/* With -L <dir>, the chat messages of every channel are appended to
+<dir>/<channel name in hex>/, in segment files named after the number of
+their first message (%020llu.log). A segment is closed once it reaches
+LOG_SEGMENT_BYTES and a new one is started. Writes go to the page cache;
+a background thread makes them durable every -D milliseconds (with -D 0,
+every message is synced before the next one is handled).
+
+Record layout, native byte order:
+	uint32 size    - size of the whole record
+	uint32 crc     - crc32 of everything after this field
+	uint32 sender  - userID of the sender
+	uint8  nickLen - nickname length
+	nickname and text */
+#define LOG_HEADER_LEN 13
+
+#define LOG_SEGMENT_BYTES (1 << 20)
+
+// The offset of every LOG_INDEX_EVERY-th record of a segment is kept in memory
+#define LOG_INDEX_EVERY 64
+
+// Room left in a path after the log's directory, for "/<segment>.log"
+#define LOG_FILE_LEN 32
+
+/*  LogSegment structure:
+a segment file: number of its first message (base), how many messages
+and bytes it has and its sparse index (the offsets of messages 0,
+LOG_INDEX_EVERY, 2 * LOG_INDEX_EVERY, ...). Only the last segment's
+index is built when the log is opened; the others are indexed the first
+time they are read, so opening a log never reads its older segments. */
+
+typedef struct {
+	uint64_t base;
+	uint32_t count;
+	uint32_t size;
+	uint32_t* index;
+	uint32_t nroIndex;
+	uint32_t capIndex;
+} LogSegment;
+
+/*  ChannelLog structure:
+a channel's open log: its directory, its segments (oldest first; the last
+one is written through fd) and the number the next message will get.
+dirty is set while the last writes were not synced yet; it only changes
+under the logs' lock, but appends read it without it. dirtyNext links the
+logs waiting for the sync thread. */
+
+typedef struct ChannelLog {
+	char dir[PATH_MAX - LOG_FILE_LEN];
+	LogSegment* segs;
+	int nroSegs;
+	int capSegs;
+	int fd;
+	uint64_t next;
+	_Atomic int dirty;
+	struct ChannelLog* dirtyNext;
+} ChannelLog;
+
+/* Called for each message read from a log.
+
+	PARAMETERS
+	uint32_t sender  - userID of the sender, when the message was written
+	const char* nick - nickname (nickLen bytes)
+	const char* text - message (len bytes)
+	void* arg 		 - given to channel_log_read() */
+typedef void (*LogReader)(uint32_t sender, const char* nick, int nickLen, const char* text, int len, void* arg);
+
+/* Creates the log directory (-L) and starts the thread that syncs the logs.
+
+	RETURN
+	int - 0 on success, -1 on error */
+int channel_log_start();
+
+/* Opens (or creates) a channel's log. The last segment is checked: a
+message cut by a crash is removed, so appends start after the last whole
+message.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	char* name - channel name
+
+	RETURN
+	ChannelLog* - log, NULL if logs are off (no -L) or on error */
+ChannelLog* channel_log_open(char* name);
+
+/* Appends a chat message to the log.
+Must be called with the channel locked (lock_channel()).
+
+	PARAMETERS
+	ChannelLog* log  - log
+	uint32_t sender  - userID of the sender
+	const char* nick - sender's nickname
+	int nickLen 	 - nickname length
+	const char* text - message
+	int len 		 - message length
+
+	RETURN
+	int - 0 on success, -1 on error */
+int channel_log_append(ChannelLog* log, uint32_t sender, const char* nick, int nickLen, const char* text, int len);
+
+/* Reads the messages from number from on, oldest first, through mmap; the
+sparse index finds the first one without reading the messages before it.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	ChannelLog* log - log
+	uint64_t from 	- number of the first message
+	LogReader fn 	- called for each message
+	void* arg 		- passed on to fn
+
+	RETURN
+	int - number of messages read, -1 on error */
+int channel_log_read(ChannelLog* log, uint64_t from, LogReader fn, void* arg);
+
+/* Syncs every log and every retired descriptor now, as the sync thread
+would at the end of the -D window.
+Must be called with clients_lock held exclusively. */
+void channel_log_flush();
+
+/* Closes a log; what was not synced yet is handed to the sync thread.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	ChannelLog* log - log */
+void channel_log_close(ChannelLog* log);
+
+#endif
@@ -0,0 +1,151 @@
+// === FUNCTIONS RELATED TO THE CHANNEL TABLE ===
+#include "channel_table.h"
+#include "server_config.h"
+
+Channel* channel_list = NULL;
+int nroChannels = 0;
+unsigned int channelVersion = 0;
+
+static int capChannels = 0;
+static int nroLive = 0;
+
+// Stack of ids released by deleted channels
+static int* freeIDs = NULL;
+static int nroFree = 0;
+
+// Name index: chained hash table of ids, chains linked through Channel.hashNext
+static int* buckets = NULL;
+static int nroBuckets = 0;
+
+// Links a channel into its name chain.
+static void index_channel(int idChannel) {
+	uint32_t b = fnv1a(channel_list[idChannel].chName, -1) & (nroBuckets - 1);
+
+	channel_list[idChannel].hashNext = buckets[b];
+	buckets[b] = idChannel;
+}
+
+// Unlinks a channel from its name chain.
+static void unindex_channel(int idChannel) {
+	int* p = &buckets[fnv1a(channel_list[idChannel].chName, -1) & (nroBuckets - 1)];
+
+	while (*p != -1 && *p != idChannel) p = &channel_list[*p].hashNext;
+
+	if (*p != -1) *p = channel_list[idChannel].hashNext;
+}
+
+// Doubles the name index, rehashing every live channel.
+static int grow_buckets() {
+	int size = nroBuckets ? nroBuckets * 2 : TABLE_INIT_BUCKETS;
+
+	int* tmp = (int*) malloc(size * sizeof(int));
+	if (!tmp) return -1;
+
+	free(buckets);
+	buckets = tmp;
+	nroBuckets = size;
+
+	for (int i = 0; i < size; i++) buckets[i] = -1;
+
+	for (int i = 0; i < nroChannels; i++)
+		if (channel_list[i].chName[0] != '\0') index_channel(i);
+
+	return 0;
+}
+
+// Finds a channel by name.
+int channel_lookup(char* name) {
+	if (!nroBuckets) return -1;
+
+	int id = buckets[fnv1a(name, -1) & (nroBuckets - 1)];
+
+	for (; id != -1; id = channel_list[id].hashNext)
+		if (strcmp(channel_list[id].chName, name) == 0) return id;
+
+	return -1;
+}
+
+// Adds a message read from a channel's log to its history.
+static void load_history(uint32_t sender, const char* nick, int nickLen, const char* text, int len, void* arg) {
+	history_append((History*) arg, sender, nick, nickLen, text, len);
+}
+
+// Creates a channel.
+int channel_create(char* name) {
+	int id;
+
+	if (nroLive >= config.maxChannels) return -1;
+
+	// Keeps the load factor of the name index at most 1
+	if (nroLive + 1 > nroBuckets && grow_buckets() < 0) return -1;
+
+	if (nroFree > 0) {
+		id = freeIDs[--nroFree];
+	} else {
+		if (nroChannels == capChannels) {
+			int size = capChannels ? capChannels * 2 : TABLE_INIT_CHANNELS;
+
+			Channel* tmp = (Channel*) realloc(channel_list, size * sizeof(Channel));
+			if (!tmp) return -1;
+			channel_list = tmp;
+
+			int* tmpIDs = (int*) realloc(freeIDs, size * sizeof(int));
+			if (!tmpIDs) return -1;
+			freeIDs = tmpIDs;
+
+			capChannels = size;
+		}
+
+		id = nroChannels++;
+	}
+
+	Channel* ch = &channel_list[id];
+
+	memset(ch->chName, '\0', CHANNEL_LEN);
+	strncpy(ch->chName, name, CHANNEL_LEN - 1);
+	strcpy(ch->chMode, "-i");
+	memset(ch->inviteUser, '\0', sizeof(ch->inviteUser));
+	ch->nroInvUser = 0;
+	ch->members = NULL;
+	ch->nroMembers = 0;
+	history_init(&ch->history);
+
+	// The history starts with the last messages logged before, by this run or a previous one
+	ch->log = channel_log_open(name);
+	if (ch->log && config.historyLines > 0)
+		channel_log_read(ch->log, ch->log->next > (uint64_t) config.historyLines ? ch->log->next - config.historyLines : 0,
+		                 load_history, &ch->history);
+
+	index_channel(id);
+	nroLive++;
+	channelVersion++;
+
+	return id;
+}
+
+// Deletes a channel.
+void channel_destroy(int idChannel) {
+	Channel* ch = &channel_list[idChannel];
+
+	if (ch->chName[0] == '\0') return;
+
+	unindex_channel(idChannel);
+
+	memset(ch->chName, '\0', CHANNEL_LEN);
+	strcpy(ch->chMode, "-i");
+	memset(ch->inviteUser, '\0', sizeof(ch->inviteUser));
+	ch->nroInvUser = 0;
+	history_clear(&ch->history);
+	channel_log_close(ch->log);
+	ch->log = NULL;
+
+	freeIDs[nroFree++] = idChannel;
+	nroLive--;
+	channelVersion++;
+}
+
+// Changes a channel's mode.
+void channel_set_mode(int idChannel, char* mode) {
+	strcpy(channel_list[idChannel].chMode, mode);
+	channelVersion++;
+}
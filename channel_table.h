@@ -0,0 +1,59 @@
+// === FUNCTIONS RELATED TO THE CHANNEL TABLE ===
+#ifndef CHANNEL_TABLE_H
+#define CHANNEL_TABLE_H
+
+#include <stdint.h>
+
+#include "server_operation.h"
+
+// Initial sizes; both tables double when they fill up
+#define TABLE_INIT_CHANNELS 16
+#define TABLE_INIT_BUCKETS 16
+
+// #all is always the first channel created
+#define ALL_CHANNEL 0
+
+/* Growable array of channels indexed by channel id. Names are interned:
+ each one is stored once, here, and everything else refers to the channel
+ by its id. Deleted channels have an empty chName and their ids are reused.
+ Pointers into channel_list must not be kept across channel_create(). */
+extern Channel* channel_list;
+extern int nroChannels;
+
+/* Goes up whenever the channel menu would change: a channel is created or
+ deleted, or its mode is changed. */
+extern unsigned int channelVersion;
+
+/* Finds a channel by name.
+
+	PARAMETERS
+	char* name - channel name
+
+	RETURN
+	int - channel id, -1 if there is no such channel */
+int channel_lookup(char* name);
+
+/* Creates a channel, unless the maximum number of channels (-C) was reached.
+
+	PARAMETERS
+	char* name - channel name
+
+	RETURN
+	int - new channel id, -1 if there is no room for it */
+int channel_create(char* name);
+
+/* Deletes a channel; its id may be given to a new channel afterwards.
+The channel must have no members.
+
+	PARAMETERS
+	int idChannel - channel id */
+void channel_destroy(int idChannel);
+
+/* Changes a channel's mode.
+
+	PARAMETERS
+	int idChannel - channel id
+	char* mode 	  - "+i" or "-i" */
+void channel_set_mode(int idChannel, char* mode);
+
+#endif
@@ -0,0 +1,511 @@
+/*
+	Behavior checks - Major Steps:
+	- Drive the server's data structures through the same calls the server
+	  uses, with inputs chosen to reach their edge cases;
+	- Compare what comes out of them with a simple model of what should;
+	- Report each failed check and exit with 1 if there was any.
+
+	Built and run with "make test", which links every server file but
+	server.c into ./checks.
+*/
+
+#include <stdio.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "server_operation.h"
+#include "server_config.h"
+#include "history.h"
+#include "client_pool.h"
+#include "client_registry.h"
+#include "uring_loop.h"
+
+static int failures = 0;
+
+// Reports a failed check and goes on with the next ones
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FALHOU %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// Small deterministic generator, so a failure can be reproduced
+static uint32_t seed = 12345;
+
+static uint32_t next_rand() {
+	seed = seed * 1103515245u + 12345u;
+	return seed >> 8;
+}
+
+// === HISTORY ===
+// Messages accepted by history_append(), as the model remembers them
+
+#define MODEL_MAX 32768
+#define MODEL_MSG 160
+
+static char model[MODEL_MAX][MODEL_MSG];
+static int modelLen[MODEL_MAX];
+static int nroModel = 0;
+
+/* Checks that the history holds the newest accepted messages, in order,
+within both limits, back to back without overlapping. */
+static void check_history_state(History* h) {
+	uint32_t total = 0;
+
+	CHECK(h->count <= config.historyLines);
+	CHECK(h->bytes <= (uint32_t) config.historyBytes);
+	CHECK(h->count <= nroModel);
+
+	// The newest message is always kept
+	if (nroModel > 0) CHECK(h->count > 0);
+
+	for (int i = 0; i < h->count; i++) {
+		const char* data;
+		const HistEntry* e = history_get(h, i, &data);
+		int m = nroModel - h->count + i;
+
+		CHECK(e->off + e->len <= (uint32_t) config.historyBytes);
+		CHECK(e->sender == (uint32_t) m);
+		CHECK(e->len == modelLen[m] && memcmp(data, model[m], e->len) == 0);
+
+		// Each message starts where the one before ended, or wraps to 0
+		if (i > 0) {
+			const char* prevData;
+			const HistEntry* prev = history_get(h, i - 1, &prevData);
+
+			CHECK(e->off == prev->off + prev->len || e->off == 0);
+		}
+
+		total += e->len;
+	}
+
+	CHECK(h->bytes == total);
+
+	// Once wrapped, no message may run into another one
+	for (int i = 0; i < h->count; i++) {
+		for (int j = i + 1; j < h->count; j++) {
+			const char* data;
+			const HistEntry* a = history_get(h, i, &data);
+			const HistEntry* b = history_get(h, j, &data);
+
+			CHECK(a->off >= b->off + b->len || a->off + a->len <= b->off);
+		}
+	}
+}
+
+// Appends random messages, some larger than the whole history, and checks each step.
+static void check_history() {
+	History h;
+	char nick[NICK_LEN], text[MODEL_MSG];
+	int wrapped = 0, evictedByBytes = 0;
+
+	config.historyLines = 7;
+	config.historyBytes = 300;
+
+	history_init(&h);
+
+	for (int round = 0; round < 2; round++) {
+		nroModel = 0;
+
+		for (int i = 0; i < MODEL_MAX; i++) {
+			int nickLen = 1 + next_rand() % 10;
+			int len = next_rand() % 121;
+
+			// One in fifty does not fit even in an empty history
+			if (next_rand() % 50 == 0) len = config.historyBytes;
+
+			for (int j = 0; j < nickLen; j++) nick[j] = 'a' + next_rand() % 26;
+			for (int j = 0; j < len && j < MODEL_MSG; j++) text[j] = ' ' + next_rand() % 95;
+
+			int before = h.count;
+			uint32_t beforeBytes = h.bytes;
+
+			if (nickLen + len > config.historyBytes) {
+				CHECK(history_append(&h, nroModel, nick, nickLen, text, len) == -1);
+				CHECK(h.count == before && h.bytes == beforeBytes);
+				continue;
+			}
+
+			uint32_t oldTail = h.tail;
+
+			CHECK(history_append(&h, nroModel, nick, nickLen, text, len) == 0);
+
+			memcpy(model[nroModel], nick, nickLen);
+			memcpy(model[nroModel] + nickLen, text, len);
+			modelLen[nroModel++] = nickLen + len;
+
+			if (h.tail < oldTail) wrapped++;
+			if (before < config.historyLines && h.count <= before) evictedByBytes++;
+
+			check_history_state(&h);
+		}
+
+		// Both ways of dropping the oldest messages were reached
+		CHECK(wrapped > 0);
+		CHECK(evictedByBytes > 0);
+
+		// A cleared history starts over empty and can be used again
+		history_clear(&h);
+
+		CHECK(h.count == 0 && h.bytes == 0 && h.entries == NULL);
+	}
+}
+
+// === OUTBOUND QUEUE ===
+
+/* Queues a message split across one payload per part, the later parts
+chained to the first one as client_queue() does for a frame. */
+static void push_message(OutQueue* q, const char** parts, int nroParts) {
+	int first = q->count;
+
+	for (int i = 0; i < nroParts; i++) {
+		Payload* p = payload_create(parts[i], strlen(parts[i]));
+
+		CHECK(p && queue_push_payload(q, p) == 0);
+		payload_unref(p);
+	}
+
+	if (nroParts > 1) queue_join(q, first + 1);
+}
+
+// Writes the whole queue to a socketpair and checks the bytes that come out.
+static void check_queue_output(OutQueue* q, const char* expected) {
+	char buf[256];
+	int sv[2];
+	size_t len = strlen(expected);
+
+	CHECK(q->bytes == len);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	CHECK(queue_write(q, sv[0]) == 0 && q->count == 0 && q->bytes == 0);
+
+	ssize_t got = read(sv[1], buf, sizeof(buf));
+
+	CHECK(got == (ssize_t) len && memcmp(buf, expected, len) == 0);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* Drops from queues holding chained slots and a partially written head,
+with the ring wrapped around its end, and checks that only whole messages
+are dropped. */
+static void check_queue_drop() {
+	const char* a[] = {"AAAA", "aaaa"};
+	const char* b[] = {"BBBB"};
+	const char* c[] = {"CCCC", "cccc", "cc"};
+	const char* d[] = {"DDDD"};
+	OutQueue q;
+
+	queue_init(&q);
+
+	// Fill and write 12 slots, so the next ones wrap around the end of the ring
+	for (int i = 0; i < 12; i++) {
+		const char* filler[] = {"x"};
+		push_message(&q, filler, 1);
+	}
+
+	queue_consume(&q, 12);
+	CHECK(q.count == 0 && q.cap == 16 && q.head == 12);
+
+	push_message(&q, a, 2);
+	push_message(&q, b, 1);
+	push_message(&q, c, 3);
+	push_message(&q, d, 1);
+
+	// Half of A's head went out: A stays whole, B and then all of C go
+	queue_consume(&q, 2);
+	CHECK(queue_drop(&q, 0, 5) == 14);
+	CHECK(q.count == 3);
+	check_queue_output(&q, "AAaaaaDDDD");
+
+	// Nothing was written: the oldest chain goes whole even if one byte is needed
+	push_message(&q, c, 3);
+	push_message(&q, a, 2);
+	CHECK(queue_drop(&q, 0, 1) == 10);
+	check_queue_output(&q, "AAAAaaaa");
+
+	// keep stops in the middle of a chain: the rest of that message stays
+	push_message(&q, c, 3);
+	push_message(&q, b, 1);
+	CHECK(queue_drop(&q, 1, 100) == 4);
+	check_queue_output(&q, "CCCCcccccc");
+
+	// A payload shared with another queue outlives the drop
+	OutQueue other;
+	Payload* shared = payload_create("SSSS", 4);
+
+	queue_init(&other);
+	CHECK(shared && queue_push_payload(&q, shared) == 0 && queue_push_payload(&other, shared) == 0);
+	payload_unref(shared);
+
+	CHECK(queue_drop(&q, 0, 1) == 4 && q.count == 0 && q.bytes == 0);
+	CHECK(shared->refs == 1);
+	check_queue_output(&other, "SSSS");
+
+	queue_clear(&q);
+	queue_clear(&other);
+}
+
+// === INBOUND FRAMING ===
+
+// Feeds and takes filler lines until the ring's head is at off.
+static void framer_move_head(LineFramer* f, int off) {
+	char line[64], out[sizeof(line) + 1];
+
+	memset(line, 'x', sizeof(line));
+	line[sizeof(line) - 1] = '\n';
+
+	while (f->head != off) {
+		int len = (off - f->head) & (FRAMER_CAP - 1);
+		if (len > (int) sizeof(line)) len = sizeof(line);
+
+		framer_feed(f, line + sizeof(line) - len, len);
+		CHECK(framer_next_line(f, out, sizeof(line)) == len);
+	}
+}
+
+/* Lines and frames wrapping past the end of the ring, a line arriving in
+pieces and an over-long line filling the whole ring. */
+static void check_framer() {
+	static LineFramer f;
+	char out[FRAMER_CAP + 1], data[FRAMER_CAP];
+	int maxLen = NICK_LEN + MSG_LEN, sv[2];
+
+	framer_init(&f);
+
+	// A line that starts 5 bytes before the end of the ring comes out whole
+	framer_move_head(&f, FRAMER_CAP - 5);
+	framer_feed(&f, "alice: passa da borda\n", 22);
+	CHECK(framer_next_line(&f, out, maxLen) == 22 && strcmp(out, "alice: passa da borda\n") == 0);
+	CHECK(f.head == 17 && f.count == 0);
+
+	// A line in pieces: what was searched is not searched again
+	framer_move_head(&f, FRAMER_CAP - 3);
+	framer_feed(&f, "bob", 3);
+	CHECK(framer_next_line(&f, out, maxLen) == 0 && f.scanned == 3);
+
+	// A '\n' slipped behind scanned is not seen, so those bytes were skipped
+	f.data[(f.head + 1) & (FRAMER_CAP - 1)] = '\n';
+	CHECK(framer_next_line(&f, out, maxLen) == 0);
+	f.data[(f.head + 1) & (FRAMER_CAP - 1)] = 'o';
+
+	framer_feed(&f, ": oi", 4);
+	CHECK(framer_next_line(&f, out, maxLen) == 0 && f.scanned == 7);
+	framer_feed(&f, "\ncarol", 6);
+	CHECK(framer_next_line(&f, out, maxLen) == 8 && strcmp(out, "bob: oi\n") == 0);
+	CHECK(f.scanned == 0 && f.count == 5);
+	CHECK(framer_next_line(&f, out, maxLen) == 0 && f.scanned == 5);
+	framer_feed(&f, "\n", 1);
+	CHECK(framer_next_line(&f, out, maxLen) == 6 && strcmp(out, "carol\n") == 0);
+
+	// A length-prefixed frame wrapping past the end
+	framer_move_head(&f, FRAMER_CAP - 2);
+	framer_feed(&f, "\0\0\0\5frame", 9);
+	CHECK(framer_next_frame(&f, out, FRAME_MAX) == 9 && memcmp(out + 4, "frame", 5) == 0);
+
+	// A frame announcing more than maxLen is refused before it arrives
+	framer_feed(&f, "\0\0\x10\0", 4);
+	CHECK(framer_next_frame(&f, out, FRAME_MAX) == -1);
+	framer_init(&f);
+
+	// An over-long line fills the ring: reads stop and the line is cut at maxLen
+	memset(data, 'y', sizeof(data));
+	framer_move_head(&f, FRAMER_CAP / 2);
+	CHECK(framer_feed(&f, data, sizeof(data)) == FRAMER_CAP && f.count == FRAMER_CAP);
+	CHECK(framer_feed(&f, data, 1) == 0);
+
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	CHECK(write(sv[1], "z\n", 2) == 2);
+
+	errno = 0;
+	CHECK(framer_read(&f, sv[0]) == -1 && errno == ENOBUFS);
+
+	CHECK(framer_next_line(&f, out, maxLen) == maxLen && out[maxLen - 1] == 'y');
+	CHECK(framer_next_line(&f, out, maxLen) == 0 && f.count == FRAMER_CAP - maxLen);
+
+	// Once there is room, the rest of the line is read across the end of the ring
+	CHECK(framer_read(&f, sv[0]) == 2);
+	CHECK(framer_next_line(&f, out, maxLen) == FRAMER_CAP - maxLen + 2);
+	CHECK(out[FRAMER_CAP - maxLen] == 'z' && f.count == 0);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+// === NICKNAME SPLIT ===
+
+/* A line without ':' read into a buffer that held a longer line: what lies
+past its '\0' is not searched. */
+static void check_nick_trim() {
+	char buffer[BUFFER_MAX] = {}, msg[BUFFER_MAX] = {};
+
+	strcpy(buffer, "zzzzz: /kick bob\n");
+	nick_trim(buffer, msg);
+	CHECK(strcmp(msg, " /kick bob\n") == 0);
+
+	strcpy(buffer, "ab\n");
+	memset(msg, 0, sizeof(msg));
+	nick_trim(buffer, msg);
+	CHECK(nick_end(buffer) == NULL && msg[0] == '\0');
+}
+
+// === NICKNAME INDEX ===
+
+/* Clients are only indexed once they have a nickname: one still waiting to
+send it is never found, and naming it makes it findable. */
+static void check_registry_nick() {
+	static Client c[3];
+
+	for (int i = 0; i < 3; i++) CHECK(registry_add(&c[i]) >= 0);
+	CHECK(registry_find_nick("", -1) == NULL);
+
+	registry_set_nick(&c[1], "bob");
+	CHECK(registry_find_nick("bob", -1) == &c[1]);
+
+	registry_set_nick(&c[1], "carol");
+	CHECK(registry_find_nick("bob", -1) == NULL && registry_find_nick("carol", -1) == &c[1]);
+
+	for (int i = 0; i < 3; i++) registry_remove(&c[i]);
+	CHECK(registry_find_nick("carol", -1) == NULL);
+}
+
+// === SLOW CONSUMER UNDER IO_URING ===
+
+/* Connects to the listener on port as nick, with a receive buffer of rcvBuf
+bytes unless it is 0, and reads the welcome. */
+static int connect_as(int port, const char* nick, int rcvBuf) {
+	struct sockaddr_in addr;
+	char name[NICK_LEN] = {}, welcome[BUFFER_MAX];
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (rcvBuf) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	// The nickname goes as a record of NICK_LEN bytes, as client.c sends it
+	strcpy(name, nick);
+	CHECK(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+	CHECK(write(fd, name, sizeof(name)) == sizeof(name));
+
+	struct pollfd p = {fd, POLLIN, 0};
+	CHECK(poll(&p, 1, 2000) == 1 && read(fd, welcome, sizeof(welcome)) > 0);
+
+	return fd;
+}
+
+/* A client that never reads, behind a burst handled in a single turn, must
+be disconnected while the others still get every message: the worker does
+not wait on its socket. */
+static void check_uring_slow_consumer() {
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	int sndBuf = 4096, nroLines = 500;
+
+	config.workers = 1;
+	config.useUring = 1;
+	config.maxQueueBytes = 16384;
+
+	signal(SIGPIPE, SIG_IGN);
+	CHECK(client_pool_init() == 0);
+	initialize_channel_list();
+	initialize_commands();
+
+	// A listener on any free port, set up as server.c does it
+	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	CHECK(bind(listenfd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+	CHECK(listen(listenfd, SOMAXCONN) == 0 && set_nonblocking(listenfd) == 0);
+	CHECK(getsockname(listenfd, (struct sockaddr*) &addr, &addrLen) == 0);
+	CHECK(worker_init(&workers[0], 0) == 0);
+
+	workers[0].listenfd = listenfd;
+	CHECK(pthread_create(&workers[0].tid, NULL, run_uring_loop, &workers[0]) == 0);
+
+	int port = ntohs(addr.sin_port);
+	int author = connect_as(port, "autor", 0);
+	int fast = connect_as(port, "rapido", 0);
+	int slow = connect_as(port, "lento", 4096);
+
+	// Both ends of the slow connection hold a few KB at most
+	pthread_rwlock_rdlock(&clients_lock);
+	Client* cli = registry_find_nick("lento", -1);
+	CHECK(cli && setsockopt(cli->sockfd, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) == 0);
+	pthread_rwlock_unlock(&clients_lock);
+
+	// The burst goes in one write, so the worker takes it in one turn
+	char* burst = malloc(nroLines * 100 + 16);
+	int burstLen = 0;
+
+	for (int i = 0; i < nroLines; i++)
+		burstLen += sprintf(burst + burstLen, "autor: mensagem %05d %072d\n", i, 0);
+	burstLen += sprintf(burst + burstLen, "autor: fim\n");
+
+	CHECK(write(author, burst, burstLen) == burstLen);
+
+	// The fast client gets everything, the last line included
+	size_t cap = burstLen * 2, got = 0;
+	char* data = malloc(cap + 1);
+	struct pollfd p = {fast, POLLIN, 0};
+
+	while (got < cap && poll(&p, 1, 3000) == 1) {
+		ssize_t n = read(fast, data + got, cap - got);
+		if (n <= 0) break;
+
+		got += n;
+		data[got] = '\0';
+
+		if (strstr(data, "fim")) break;
+	}
+
+	data[got] = '\0';
+	CHECK(strstr(data, "fim") != NULL);
+
+	int nroGot = 0;
+	for (char* m = data; (m = strstr(m, "mensagem")); m++) nroGot++;
+	CHECK(nroGot == nroLines);
+
+	// ... and the slow one was disconnected
+	p.fd = slow;
+	int closed = 0;
+
+	while (poll(&p, 1, 3000) == 1) {
+		if (read(slow, data, cap) <= 0) {
+			closed = 1;
+			break;
+		}
+	}
+
+	CHECK(closed);
+
+	close(author);
+	close(fast);
+	close(slow);
+	free(burst);
+	free(data);
+}
+
+int main() {
+	check_history();
+	check_queue_drop();
+	check_framer();
+	check_nick_trim();
+	check_registry_nick();
+	check_uring_slow_consumer();
+
+	if (failures) {
+		printf("%d verificações falharam\n", failures);
+		return 1;
+	}
+
+	printf("Todas as verificações passaram\n");
+
+	return 0;
+}
@@ -12,15 +12,29 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <zlib.h>
+
+#include "wire_protocol.h"
 
 #define BUFFER_LEN 2049	//	Define where the split will occur
 #define BUFFER_MAX 4097
 #define NICK_LEN 50
 #define SIZE_COLORS 19
 
+// Longest line the server reads, "nick: " and '\n' included (NICK_LEN+MSG_LEN there)
+#define SERVER_LINE_MAX (NICK_LEN+BUFFER_LEN)
+
+// Typed or pasted text read at once; its lines are written together
+#define INPUT_MAX 65536
+
+// Pieces of lines gathered for a single writev(), below IOV_MAX
+#define SEND_IOV 1024
+
 /* The value of a volative variable may change at any time,
  without any action being taken by the code the compiler finds nearby. */
 volatile sig_atomic_t leaveFlag = 0;
@@ -28,6 +42,23 @@ volatile sig_atomic_t leaveFlag = 0;
 int sockfd = 0;
 char nick[NICK_LEN];
 
+// Set by "-b": messages are exchanged as frames (wire_protocol.h) instead of text lines
+int binary = 0;
+
+// Set by "-z": everything after the nickname goes through zlib streams
+int compressed = 0;
+z_stream zout, zin;
+
+// Lines waiting to be written: iovecs point into the input and to the prefixes below
+struct iovec sendIov[SEND_IOV];
+int nroSendIov = 0;
+char sendHeads[SEND_IOV/2][PROTO_HEADER_LEN];
+int nroSendHeads = 0;
+
+// "nick: ", in front of every text line
+char linePrefix[NICK_LEN+3];
+int prefixLen = 0;
+
 // Responsible for overwriting and flushing the stdout
 void str_overwrite_stdout() {
 	printf("\r%s", "> ");
@@ -55,100 +86,296 @@ void catch_ctrl_d_and_exit(int sig) {
 	leaveFlag = 1;
 }
 
-// Deals with receiving messages
-void receive_message_handler() {
-	char msg[NICK_LEN+BUFFER_LEN+SIZE_COLORS] = {};
+// Sends len bytes, however many send() calls it takes
+void send_all(char* data, int len) {
+	while (len > 0) {
+		int sent = send(sockfd, data, len, 0);
 
-	// While there are messages to be received
-	while(1) {
-		int rcv = recv(sockfd, msg, NICK_LEN+BUFFER_LEN+SIZE_COLORS, 0);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
 
-		// If something was written
-		if (strcmp(msg, "/kicked") == 0) {
-			leaveFlag = 1;
-		} else if(rcv > 0) {
-			printf("%s", msg);
-			str_overwrite_stdout();
-		} else if(rcv == 0) {	// An error occurred
-			break;
+		data += sent;
+		len -= sent;
+	}
+}
+
+/* Sends pieces of data to the server with a single writev() or, if the
+connection is compressed, through zlib with a single sync flush at the end. */
+void stream_send(struct iovec* iov, int n) {
+	if (!compressed) {
+		while (n > 0) {
+			ssize_t sent = writev(sockfd, iov, n);
+
+			if (sent < 0) {
+				if (errno == EINTR) continue;
+				return;
+			}
+
+			// What was written is skipped, a piece may be left in the middle
+			while (n > 0 && (size_t) sent >= iov->iov_len) {
+				sent -= iov->iov_len;
+				iov++;
+				n--;
+			}
+
+			if (n > 0) {
+				iov->iov_base = (char*) iov->iov_base + sent;
+				iov->iov_len -= sent;
+			}
 		}
 
-		memset(msg, '\0', BUFFER_LEN+SIZE_COLORS+NICK_LEN);
+		return;
+	}
+
+	char out[BUFFER_MAX+NICK_LEN+PROTO_HEADER_LEN+64];
+
+	zout.next_out = (Bytef*) out;
+	zout.avail_out = sizeof(out);
+
+	for (int i = 0; i < n; i++) {
+		zout.next_in = (Bytef*) iov[i].iov_base;
+		zout.avail_in = iov[i].iov_len;
+
+		// The sync flush lets the server decompress the lines right away
+		int flush = i == n - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+		// With room left in out, deflate() took all the input (and finished the flush)
+		while (deflate(&zout, flush), zout.avail_out == 0) {
+			send_all(out, sizeof(out));
 
-		sleep(0.7);
+			zout.next_out = (Bytef*) out;
+			zout.avail_out = sizeof(out);
+		}
 	}
+
+	send_all(out, sizeof(out) - zout.avail_out);
+}
+
+// Writes the queued lines and empties the queue
+void flush_lines() {
+	if (nroSendIov > 0) stream_send(sendIov, nroSendIov);
+
+	nroSendIov = 0;
+	nroSendHeads = 0;
+}
+
+// Queues a piece of a line
+void queue_iov(char* data, int len) {
+	sendIov[nroSendIov].iov_base = data;
+	sendIov[nroSendIov++].iov_len = len;
 }
 
-/* If message is longer than the maximum length permitted,
- it is split in multiple messages. */
-void split_message(char *buffer, char *msg) {
-	int j = 0;
-	char sub[BUFFER_MAX] = {};
+/* Queues a line typed by the user ('\n' removed): "nick: line\n", or a frame
+in binary mode. A line longer than the server takes goes in chunks of up
+to BUFFER_LEN bytes, each one framed once; the line itself is not copied,
+so it must stay in place until flush_lines(). */
+void queue_line(char* line, int len) {
+	int op = len > 0 && line[0] == '/' ? PROTO_OP_COMMAND : PROTO_OP_CHAT;
+	int max = binary ? BUFFER_LEN : SERVER_LINE_MAX - prefixLen - 1;
+	int off = 0;
 
-	while(j < strlen(buffer)) {
-    	int c = 0;
-        while(c < BUFFER_LEN && j < strlen(buffer)) {
-        	sub[c] = buffer[j];
-      		c++; j++;
-    	}
+	if (max > BUFFER_LEN) max = BUFFER_LEN;
 
-	    str_trim(sub, BUFFER_MAX);
+	do {
+		int n = len - off < max ? len - off : max;
 
-	  	sprintf(msg, "%s: %s\n", nick, sub);
-	  	send(sockfd, msg, strlen(msg), 0);
+		// A UTF-8 character is not cut in two
+		if (off + n < len)
+			while (n > 1 && ((unsigned char) line[off + n] & 0xC0) == 0x80) n--;
 
-	  	sleep(0.7);
+		if (nroSendIov + 3 > SEND_IOV) flush_lines();
 
-	    memset(sub, '\0', BUFFER_LEN);
-	    memset(msg, '\0', BUFFER_LEN+NICK_LEN);
+		if (binary) {
+			char* head = sendHeads[nroSendHeads++];
+
+			proto_put_header(head, op, 0, 0, n);
+			queue_iov(head, PROTO_HEADER_LEN);
+			queue_iov(line + off, n);
+		} else {
+			queue_iov(linePrefix, prefixLen);
+			queue_iov(line + off, n);
+			queue_iov("\n", 1);
+		}
+
+		off += n;
+	} while (off < len);
+}
+
+// Sets the prefix of text lines after the nickname changed
+void set_line_prefix() {
+	prefixLen = sprintf(linePrefix, "%s: ", nick);
+}
+
+// Shows a frame received in binary mode
+void show_frame(ProtoHeader* h, char* body) {
+	// Chat frames carry the sender's nickname before the text
+	if (h->opcode == PROTO_OP_CHAT && h->bodyLen > 0 && (unsigned char) body[0] < h->bodyLen) {
+		int nickLen = (unsigned char) body[0];
+		printf("%.*s: %.*s\n", nickLen, body + 1, (int) h->bodyLen - 1 - nickLen, body + 1 + nickLen);
+	} else {
+		printf("%.*s", (int) h->bodyLen, body);
 	}
 }
 
-// Dealing with sending messages
-void send_message_handler() {
-	char buffer[BUFFER_MAX] = {};
-	char msg[BUFFER_MAX+NICK_LEN+5] = {};
+// Deals with receiving frames, in binary mode: data may end in the middle of one
+void receive_frame_handler(char* data, int len) {
+	static char* pending = NULL;
+	static size_t pendLen = 0;
+	static size_t pendCap = 0;
+	ProtoHeader h;
+
+	if (pendLen + len > pendCap) {
+		size_t cap = pendCap ? pendCap : BUFFER_MAX;
+		while (cap < pendLen + len) cap *= 2;
+
+		char* tmp = (char*) realloc(pending, cap);
+		if (!tmp) {
+			leaveFlag = 1;
+			return;
+		}
+
+		pending = tmp;
+		pendCap = cap;
+	}
 
-	// While there's no errors and the chat is running
-	while (1) {
-		str_overwrite_stdout();
+	memcpy(pending + pendLen, data, len);
+	pendLen += len;
 
-		fgets(buffer, BUFFER_MAX, stdin); // Receives the message
+	size_t off = 0;
+	int shown = 0;
 
-		if (strcmp(buffer, "/quit\n") == 0 || feof(stdin)) {
+	// Every complete frame is shown; the rest waits for the next data
+	while (pendLen - off >= PROTO_HEADER_LEN) {
+		if (proto_get_header(pending + off, &h) < 0) {
 			leaveFlag = 1;
-			break;
-		} else if(strncmp(buffer, "/nickname", 9) == 0) {
-			char newNick[NICK_LEN];
+			return;
+		}
 
-			memset(newNick, '\0', NICK_LEN);
+		if (pendLen - off - PROTO_HEADER_LEN < h.bodyLen) break;
 
-			get_substring(newNick, buffer, 10, NICK_LEN);
-		  	str_trim(newNick, NICK_LEN);
+		show_frame(&h, pending + off + PROTO_HEADER_LEN);
+		off += PROTO_HEADER_LEN + h.bodyLen;
+		shown = 1;
+	}
 
-			if(strlen(newNick) < 2 || strlen(newNick) > NICK_LEN - 1) {
-				printf("\nErro: nick inválido.\n");
-			} else {
-				strcpy(nick, newNick);
+	memmove(pending, pending + off, pendLen - off);
+	pendLen -= off;
 
-		  		str_trim(buffer, BUFFER_MAX);
-		    	sprintf(msg, "%s: %s\n", nick, buffer);
-				send(sockfd, msg, strlen(msg), 0);
-			}
+	if (shown) str_overwrite_stdout();
+}
 
-		} else if (strlen(buffer) > BUFFER_LEN) {
-			split_message(buffer, msg);
+// Deals with receiving messages, in text mode
+void receive_message_handler(char* data, int len) {
+	if (len == 7 && memcmp(data, "/kicked", 7) == 0) {
+		leaveFlag = 1;
+		return;
+	}
+
+	fwrite(data, 1, len, stdout);
+	str_overwrite_stdout();
+}
+
+/* Reads what the server sent, inflating it if the connection is compressed,
+and hands it to the receive handler. Only reads once, so it never blocks
+after poll() said the socket was readable.
+Returns 0 once the connection ended. */
+int read_from_server() {
+	char raw[BUFFER_MAX];
+	char out[BUFFER_MAX];
+
+	void (*handler)(char*, int) = binary ? receive_frame_handler : receive_message_handler;
+
+	int rcv = recv(sockfd, raw, sizeof(raw), 0);
+	if (rcv <= 0) return 0;
+
+	if (!compressed) {
+		handler(raw, rcv);
+		return 1;
+	}
+
+	zin.next_in = (Bytef*) raw;
+	zin.avail_in = rcv;
+
+	// Until the input is used up and the stream has no output left
+	do {
+		zin.next_out = (Bytef*) out;
+		zin.avail_out = sizeof(out);
+
+		int ret = inflate(&zin, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) return 0;
+
+		if (zin.avail_out < sizeof(out)) handler(out, sizeof(out) - zin.avail_out);
+	} while (zin.avail_in > 0 || zin.avail_out == 0);
+
+	return 1;
+}
+
+// Dealing with sending messages: buffer holds a line typed by the user, without the '\n'
+void send_message_handler(char* buffer, int len) {
+	if (len == 5 && memcmp(buffer, "/quit", 5) == 0) {
+		leaveFlag = 1;
+	} else if(len >= 9 && strncmp(buffer, "/nickname", 9) == 0) {
+		char cmd[BUFFER_MAX] = {};
+		char newNick[NICK_LEN];
+
+		memcpy(cmd, buffer, len < BUFFER_MAX ? len : BUFFER_MAX - 1);
+		memset(newNick, '\0', NICK_LEN);
+
+		get_substring(newNick, cmd, 10, NICK_LEN);
+	  	str_trim(newNick, NICK_LEN);
+
+		if(strlen(newNick) < 2 || strlen(newNick) > NICK_LEN - 1) {
+			printf("\nErro: nick inválido.\n");
 		} else {
-		  	str_trim(buffer, BUFFER_MAX);
-		    sprintf(msg, "%s: %s\n", nick, buffer);
-		    send(sockfd, msg, strlen(msg), 0);
+			// Lines already queued keep the old nickname
+			flush_lines();
+
+			strcpy(nick, newNick);
+			set_line_prefix();
+
+			queue_line(buffer, len);
 		}
+	} else {
+		queue_line(buffer, len);
+	}
+}
+
+/* Reads what the user typed (or pasted) and sends every complete line; the
+lines of a read go out together. Returns 0 once stdin ended. */
+int read_from_user() {
+	static char input[INPUT_MAX];
+	static int used = 0;
+
+	int n = read(STDIN_FILENO, input + used, INPUT_MAX - used);
+	if (n <= 0) return 0;
+
+	used += n;
+
+	int start = 0;
+
+	while (start < used && !leaveFlag) {
+		char* nl = memchr(input + start, '\n', used - start);
+
+		// A line without '\n' only goes if it fills the whole buffer
+		if (!nl && (start > 0 || used < INPUT_MAX)) break;
 
-		bzero(buffer, BUFFER_MAX);
-		bzero(msg, BUFFER_MAX+NICK_LEN);
+		int len = nl ? nl - (input + start) : used - start;
+
+		send_message_handler(input + start, len);
+		start += nl ? len + 1 : len;
 	}
 
-	catch_ctrl_d_and_exit(2);
+	// The queued lines point into input, so they are written before it moves
+	flush_lines();
+
+	memmove(input, input + start, used - start);
+	used -= start;
+
+	str_overwrite_stdout();
+
+	return 1;
 }
 
 void input_nickname() {
@@ -156,9 +383,11 @@ void input_nickname() {
 	fgets(nick, NICK_LEN+2, stdin);
 	str_trim(nick, NICK_LEN);
 
-	// Checks if the given nickname is valid
-	if(strlen(nick) > NICK_LEN - 1 || strlen(nick) < 2) {
-		printf("\nDigite um nick válido.\nO nick deve possuir de 2 a 49 caracteres.\n");
+	// Checks if the given nickname is valid; the options byte, if any, takes one byte of it
+	int maxNick = NICK_LEN - 1 - (binary || compressed);
+
+	if(strlen(nick) > maxNick || strlen(nick) < 2) {
+		printf("\nDigite um nick válido.\nO nick deve possuir de 2 a %d caracteres.\n", maxNick);
 
 		// EXIT FAILURE
 		exit(1);
@@ -176,8 +405,14 @@ void input_nickname() {
 
 int main(int argc, char* const argv[]) {
 
-	if(argc != 2) {
-    	printf("Erro. Tente: %s <IP>\n", argv[0]);
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0) binary = 1;
+		else if (strcmp(argv[i], "-z") == 0) compressed = 1;
+		else argc = 0;
+	}
+
+	if(argc < 2) {
+    	printf("Erro. Tente: %s <IP> [-b] [-z]\n", argv[0]);
     	// EXIT FAILURE
     	return 1;
   	}
@@ -190,7 +425,12 @@ int main(int argc, char* const argv[]) {
 	// Sets CTRL+D to /quit
 	signal(EOF, catch_ctrl_d_and_exit);
 
+	/* The nickname and "/connect" are read with fgets(): unbuffered, it takes
+	 no more than their lines, so the rest is left for read() in the chat. */
+	setvbuf(stdin, NULL, _IONBF, 0);
+
 	input_nickname();
+	set_line_prefix();
 
 	struct sockaddr_in server_addr;
 
@@ -231,8 +471,22 @@ int main(int argc, char* const argv[]) {
 		exit(1);
 	}
 
-	// Sending the nickname to the server
-	send(sockfd, nick, NICK_LEN, 0);
+	// Sending the nickname to the server, after the options byte if there are options
+	char record[NICK_LEN] = {};
+	int options = (binary ? PROTO_OPT_BINARY : 0) | (compressed ? PROTO_OPT_DEFLATE : 0);
+
+	record[0] = options;
+	strcpy(record + (options != 0), nick);
+
+	send(sockfd, record, NICK_LEN, 0);
+
+	if (compressed &&
+	    (deflateInit2(&zout, PROTO_DEFLATE_LEVEL, Z_DEFLATED, PROTO_DEFLATE_WINDOW, PROTO_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK ||
+	     inflateInit(&zin) != Z_OK)) {
+		printf("\nErro: zlib.\n");
+		// EXIT FAILURE
+		exit(1);
+	}
 
 	// --------------------------------------- The Chatroom --------------------------------------
 	//  If there has been no error so far, the client is now connected to the chat
@@ -255,30 +509,20 @@ int main(int argc, char* const argv[]) {
 	printf("\n ______________________________________________________________________________ \n\n\n");
 	printf("\033[0m");
 
-	// Defining two threads: one to receive messages and another to send messages
-	pthread_t sendMsgThread;
-
-	if(pthread_create(&sendMsgThread, NULL, (void*) send_message_handler, NULL) != 0) {
-		printf("\nErro: pthread.\n");
-
-		// EXIT FAILURE
-		exit(1);
-	}
-
-	pthread_t receiveMsgThread;
+	/* A single thread waits on both the keyboard and the server: nothing
+	 runs while neither of them has something to say. */
+	struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {sockfd, POLLIN, 0}};
 
-	if(pthread_create(&receiveMsgThread, NULL, (void*) receive_message_handler, NULL) != 0) {
-		printf("\nErro: pthread.\n");
+	str_overwrite_stdout();
 
-		// EXIT FAILURE
-		exit(1);
-	}
-
-	// Making the chat active and finalizing when it's the proper moment
-	while(1) {
-		if(leaveFlag) {
+	while (!leaveFlag) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
 			break;
 		}
+
+		if (fds[1].revents && !read_from_server()) break;
+		if (fds[0].revents && !read_from_user()) break;
 	}
 
 	// When client has left the chat
@@ -0,0 +1,55 @@
+// === FUNCTIONS RELATED TO THE CLIENT POOL ===
+#include "client_pool.h"
+
+// Free clients, linked through Client.poolNext; the last one released is reused first
+static Client* freeList = NULL;
+
+// Clients allocated so far, in every slab
+static int nroAllocated = 0;
+
+// Allocates a slab of clients and puts them all in the free list.
+static int add_slab() {
+	int size = config.poolClients;
+
+	if (size > config.maxClients - nroAllocated) size = config.maxClients - nroAllocated;
+	if (size <= 0) return -1;
+
+	Client* slab = (Client*) calloc(size, sizeof(Client));
+	if (!slab) return -1;
+
+	for (int i = size - 1; i >= 0; i--) {
+		queue_init(&slab[i].out);
+		slab[i].poolNext = freeList;
+		freeList = &slab[i];
+	}
+
+	nroAllocated += size;
+
+	return 0;
+}
+
+// Allocates the first slab of clients.
+int client_pool_init() {
+	return add_slab();
+}
+
+// Takes a client from the pool.
+Client* client_pool_get() {
+	if (!freeList && add_slab() < 0) return NULL;
+
+	Client* cli = freeList;
+
+	freeList = cli->poolNext;
+	cli->poolNext = NULL;
+
+	return cli;
+}
+
+// Gives a client back to the pool.
+void client_pool_put(Client* cli) {
+	// Queued messages are dropped, but the slots stay for the next connection
+	queue_reset(&cli->out);
+
+	cli->poolNext = freeList;
+	freeList = cli;
+}
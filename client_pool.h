@@ -0,0 +1,36 @@
+// === FUNCTIONS RELATED TO THE CLIENT POOL ===
+#ifndef CLIENT_POOL_H
+#define CLIENT_POOL_H
+
+#include "server_operation.h"
+#include "server_config.h"
+
+/* Client objects come from slabs of config.poolClients clients (-P). The
+first slab is allocated at startup; more are added, up to config.maxClients
+clients in total, only if it runs out. Slabs are never freed: a client that
+leaves goes back to a free list and is handed to the next connection,
+together with its inbound ring buffer and its outbound queue slots. */
+
+/* Allocates the first slab of clients.
+
+	RETURN
+	int - 0 on success, -1 on allocation failure */
+int client_pool_init();
+
+/* Takes a client from the pool. Its outbound queue is empty; every other
+field must be set by the caller (see create_client()).
+Must be called with clients_lock held exclusively.
+
+	RETURN
+	Client* - client, NULL if the pool is exhausted */
+Client* client_pool_get();
+
+/* Gives a client back to the pool. It must no longer be registered, in a
+channel or in a flushList.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	Client* cli - client to be released */
+void client_pool_put(Client* cli);
+
+#endif
@@ -0,0 +1,183 @@
+// === FUNCTIONS RELATED TO THE CLIENT REGISTRY ===
+#include "client_registry.h"
+
+Client** clients = NULL;
+int cliSlots = 0;
+
+static int capSlots = 0;
+
+// Stack of userIDs released by clients that left
+static int* freeIDs = NULL;
+static int nroFree = 0;
+
+/* Nickname index: chained hash table, chains linked through Client.nickNext.
+ A client is only indexed once it has a nickname. */
+static Client** nickBuckets = NULL;
+static int nroBuckets = 0;
+static int nroIndexed = 0;
+
+// Links a client into its nickname chain.
+static void index_nick(Client* cli) {
+	uint32_t b = fnv1a(cli->nick, -1) & (nroBuckets - 1);
+
+	cli->nickNext = nickBuckets[b];
+	nickBuckets[b] = cli;
+	nroIndexed++;
+}
+
+// Unlinks a client from its nickname chain.
+static void unindex_nick(Client* cli) {
+	if (cli->nick[0] == '\0' || !nroBuckets) return;
+
+	Client** p = &nickBuckets[fnv1a(cli->nick, -1) & (nroBuckets - 1)];
+
+	while (*p && *p != cli) p = &(*p)->nickNext;
+
+	if (*p) {
+		*p = cli->nickNext;
+		nroIndexed--;
+	}
+
+	cli->nickNext = NULL;
+}
+
+// Doubles the nickname index, rehashing every chain.
+static int grow_buckets() {
+	int oldBuckets = nroBuckets;
+	Client** old = nickBuckets;
+
+	int size = oldBuckets ? oldBuckets * 2 : REGISTRY_INIT_BUCKETS;
+	Client** tmp = (Client**) calloc(size, sizeof(Client*));
+	if (!tmp) return -1;
+
+	nickBuckets = tmp;
+	nroBuckets = size;
+	nroIndexed = 0;
+
+	for (int i = 0; i < oldBuckets; i++) {
+		Client* cli = old[i];
+
+		while (cli) {
+			Client* next = cli->nickNext;
+			index_nick(cli);
+			cli = next;
+		}
+	}
+
+	free(old);
+
+	return 0;
+}
+
+// Indexes a client under its nickname, if it has one yet.
+static void index_named(Client* cli) {
+	if (cli->nick[0] == '\0') return;
+
+	// Keeps the load factor at most 1; a failed growth only makes chains longer
+	if (nroIndexed + 1 > nroBuckets && grow_buckets() < 0 && !nroBuckets) return;
+
+	index_nick(cli);
+}
+
+// Doubles the array of clients.
+static int grow_slots() {
+	int size = capSlots ? capSlots * 2 : REGISTRY_INIT_SLOTS;
+
+	Client** tmp = (Client**) realloc(clients, size * sizeof(Client*));
+	if (!tmp) return -1;
+	clients = tmp;
+
+	int* tmpIDs = (int*) realloc(freeIDs, size * sizeof(int));
+	if (!tmpIDs) return -1;
+	freeIDs = tmpIDs;
+
+	for (int i = capSlots; i < size; i++) clients[i] = NULL;
+	capSlots = size;
+
+	return 0;
+}
+
+// Links a client in under a userID.
+static void insert_client(Client* cli, int id) {
+	cli->userID = id;
+	cli->nickNext = NULL;
+	clients[id] = cli;
+
+	index_named(cli);
+}
+
+// Adds a client to the registry and gives it a userID.
+int registry_add(Client* cli) {
+	int id;
+
+	if (nroFree > 0) {
+		id = freeIDs[--nroFree];
+	} else {
+		if (cliSlots == capSlots && grow_slots() < 0) return -1;
+
+		id = cliSlots++;
+	}
+
+	insert_client(cli, id);
+
+	return id;
+}
+
+// Adds a client to the registry under a given userID.
+int registry_add_at(Client* cli, int id) {
+	if (id < 0 || (id < cliSlots && clients[id])) return -1;
+
+	// The userIDs skipped on the way are free
+	while (cliSlots <= id) {
+		if (cliSlots == capSlots && grow_slots() < 0) return -1;
+
+		freeIDs[nroFree++] = cliSlots++;
+	}
+
+	for (int i = 0; i < nroFree; i++) {
+		if (freeIDs[i] == id) {
+			freeIDs[i] = freeIDs[--nroFree];
+			break;
+		}
+	}
+
+	insert_client(cli, id);
+
+	return id;
+}
+
+// Removes a client from the registry.
+void registry_remove(Client* cli) {
+	int id = cli->userID;
+
+	if (id < 0 || id >= cliSlots || clients[id] != cli) return;
+
+	unindex_nick(cli);
+
+	clients[id] = NULL;
+	freeIDs[nroFree++] = id;
+}
+
+// Changes a client's nickname, keeping the nickname index up to date.
+void registry_set_nick(Client* cli, char* nick) {
+	unindex_nick(cli);
+
+	memset(cli->nick, '\0', NICK_LEN);
+	strncpy(cli->nick, nick, NICK_LEN - 1);
+
+	index_named(cli);
+}
+
+// Finds a client by nickname.
+Client* registry_find_nick(char* nick, int idChannel) {
+	if (!nroBuckets) return NULL;
+
+	Client* cli = nickBuckets[fnv1a(nick, -1) & (nroBuckets - 1)];
+
+	for (; cli; cli = cli->nickNext) {
+		if (strcmp(cli->nick, nick) == 0 && (idChannel < 0 || cli->idChannel == idChannel))
+			return cli;
+	}
+
+	return NULL;
+}
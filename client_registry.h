@@ -0,0 +1,64 @@
+// === FUNCTIONS RELATED TO THE CLIENT REGISTRY ===
+#ifndef CLIENT_REGISTRY_H
+#define CLIENT_REGISTRY_H
+
+#include <stdint.h>
+
+#include "server_operation.h"
+
+// Initial sizes; both tables double when they fill up
+#define REGISTRY_INIT_SLOTS 64
+#define REGISTRY_INIT_BUCKETS 64
+
+/* Array of clients indexed by userID: clients[userID] is the client or NULL.
+ userIDs are reused after a client leaves, so cliSlots (the highest userID
+ ever handed out + 1) stays close to the number of connected clients. */
+extern Client** clients;
+extern int cliSlots;
+
+/* Adds a client to the registry and gives it a userID.
+
+	PARAMETERS
+	Client* cli - client to be added
+
+	RETURN
+	int - new userID, -1 on allocation failure */
+int registry_add(Client* cli);
+
+/* Adds a client to the registry under a userID it already had, such as
+one handed over by the previous server (handoff.h).
+
+	PARAMETERS
+	Client* cli - client to be added
+	int id 		- its userID
+
+	RETURN
+	int - id, -1 if it is taken or on allocation failure */
+int registry_add_at(Client* cli, int id);
+
+/* Removes a client from the registry; its userID becomes free again.
+
+	PARAMETERS
+	Client* cli - client to be removed */
+void registry_remove(Client* cli);
+
+/* Changes a client's nickname, keeping the nickname index up to date.
+
+	PARAMETERS
+	Client* cli - current client
+	char* nick  - new nickname */
+void registry_set_nick(Client* cli, char* nick);
+
+/* Finds a client by nickname. Nicknames are unique per channel only, so
+a channel may be given to narrow the search. Clients still waiting to
+send their nickname are never found.
+
+	PARAMETERS
+	char* nick    - nickname
+	int idChannel - channel id, or -1 for any channel
+
+	RETURN
+	Client* - client found, NULL otherwise */
+Client* registry_find_nick(char* nick, int idChannel);
+
+#endif
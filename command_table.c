@@ -0,0 +1,69 @@
+// === FUNCTIONS RELATED TO THE COMMAND TABLE ===
+#include "command_table.h"
+
+/* Open addressing table: a command goes to the bucket of its hash or to
+the next free one. An empty name marks a free bucket. */
+static struct {
+	char name[COMMAND_LEN + 1];
+	int len;
+	CommandHandler handler;
+	unsigned long calls;
+} commands[COMMAND_BUCKETS];
+
+static int nroCommands = 0;
+
+// Length of the first token of a string.
+static int token_len(char* token) {
+	int len = 0;
+
+	while (token[len] != '\0' && token[len] != ' ' && token[len] != '\n' && token[len] != '\r')
+		len++;
+
+	return len;
+}
+
+// Registers a command.
+int command_register(char* name, CommandHandler handler) {
+	int len = strlen(name);
+
+	// At most half full, so a lookup ends after a few probes
+	if (len == 0 || len > COMMAND_LEN || nroCommands >= COMMAND_BUCKETS / 2) return -1;
+
+	uint32_t b = fnv1a(name, len) & (COMMAND_BUCKETS - 1);
+
+	while (commands[b].len != 0 && strcmp(commands[b].name, name) != 0)
+		b = (b + 1) & (COMMAND_BUCKETS - 1);
+
+	if (commands[b].len == 0) nroCommands++;
+
+	strcpy(commands[b].name, name);
+	commands[b].len = len;
+	commands[b].handler = handler;
+
+	return 0;
+}
+
+// Finds the command named by the first token of a string.
+CommandHandler command_lookup(char* token) {
+	int len = token_len(token);
+
+	if (len == 0 || len > COMMAND_LEN) return NULL;
+
+	uint32_t b = fnv1a(token, len) & (COMMAND_BUCKETS - 1);
+
+	for (; commands[b].len != 0; b = (b + 1) & (COMMAND_BUCKETS - 1)) {
+		if (commands[b].len == len && strncmp(commands[b].name, token, len) == 0) {
+			commands[b].calls++;
+			return commands[b].handler;
+		}
+	}
+
+	return NULL;
+}
+
+// Calls fn for every registered command.
+void command_foreach(void (*fn)(const char* name, unsigned long calls, void* arg), void* arg) {
+	for (int b = 0; b < COMMAND_BUCKETS; b++) {
+		if (commands[b].len != 0) fn(commands[b].name, commands[b].calls, arg);
+	}
+}
@@ -0,0 +1,53 @@
+// === FUNCTIONS RELATED TO THE COMMAND TABLE ===
+#ifndef COMMAND_TABLE_H
+#define COMMAND_TABLE_H
+
+#include <stdint.h>
+
+#include "server_operation.h"
+
+// Longest command name, without the '/'
+#define COMMAND_LEN 16
+
+// Size of the table; must be a power of two well above the number of commands
+#define COMMAND_BUCKETS 64
+
+/* Runs a command typed by a client. msg is the text after "nick:" (it
+starts with " /"), buffer is the whole line and may be reused to build
+the replies.
+Returns the leaveFlag: 1 if the client must be disconnected. */
+typedef int (*CommandHandler)(Client* cli, char* msg, char* buffer);
+
+/* Registers a command. Commands are registered once, before the workers
+start; after that the table is only read, so lookups take no lock.
+
+	PARAMETERS
+	char* name 			   - command name, without the '/'
+	CommandHandler handler - function that runs the command
+
+	RETURN
+	int - 0 on success, -1 if the name is too long or the table is full */
+int command_register(char* name, CommandHandler handler);
+
+/* Finds the command named by the first token of a string, counting one
+call to it.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	char* token - text right after the '/'; the token ends at a space,
+	a newline or the end of the string
+
+	RETURN
+	CommandHandler - handler registered for the token, NULL if none */
+CommandHandler command_lookup(char* token);
+
+/* Calls fn for every registered command, with its name and the number of
+times it was looked up.
+Must be called with clients_lock held, shared or exclusively.
+
+	PARAMETERS
+	void (*fn)(...) - function called for each command
+	void* arg 		- passed on to fn */
+void command_foreach(void (*fn)(const char* name, unsigned long calls, void* arg), void* arg);
+
+#endif
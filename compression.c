@@ -0,0 +1,42 @@
+// === FUNCTIONS RELATED TO STREAM COMPRESSION ===
+#include "compression.h"
+
+// Creates the client's zlib streams.
+int compression_start(Client* cli) {
+	cli->zout = (z_stream*) calloc(1, sizeof(z_stream));
+	cli->zin = (z_stream*) calloc(1, sizeof(z_stream));
+
+	if (!cli->zout || !cli->zin ||
+	    deflateInit2(cli->zout, PROTO_DEFLATE_LEVEL, Z_DEFLATED, PROTO_DEFLATE_WINDOW, PROTO_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(cli->zout);
+		free(cli->zin);
+		cli->zout = cli->zin = NULL;
+		return -1;
+	}
+
+	// The window size comes in the stream header
+	if (inflateInit(cli->zin) != Z_OK) {
+		deflateEnd(cli->zout);
+		free(cli->zout);
+		free(cli->zin);
+		cli->zout = cli->zin = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Releases the client's zlib streams.
+void compression_stop(Client* cli) {
+	if (cli->zout) {
+		deflateEnd(cli->zout);
+		free(cli->zout);
+	}
+
+	if (cli->zin) {
+		inflateEnd(cli->zin);
+		free(cli->zin);
+	}
+
+	cli->zout = cli->zin = NULL;
+}
@@ -0,0 +1,25 @@
+// === FUNCTIONS RELATED TO STREAM COMPRESSION ===
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <zlib.h>
+
+#include "server_operation.h"
+
+/* Creates the client's zlib streams: data queued to it is compressed when
+it is flushed, and data read from it is decompressed before framing.
+
+	PARAMETERS
+	Client* cli - current client
+
+	RETURN
+	int - 0 on success, -1 on allocation failure */
+int compression_start(Client* cli);
+
+/* Releases the client's zlib streams, if it has any.
+
+	PARAMETERS
+	Client* cli - current client */
+void compression_stop(Client* cli);
+
+#endif
@@ -0,0 +1,630 @@
+// === FUNCTIONS RELATED TO THE EVENT LOOP ===
+// accept4() is a GNU extension
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include "client_pool.h"
+#include "client_registry.h"
+#include "handoff.h"
+
+// Sets a file descriptor to non-blocking mode.
+int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0) return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+Worker workers[MAX_WORKERS];
+
+__thread SlowStats slowStats;
+
+__thread Worker* thisWorker = NULL;
+
+// clients_lock as held by the current thread while it handles a client's input
+#define LOCK_NONE 0
+#define LOCK_SHARED 1
+#define LOCK_EXCLUSIVE 2
+
+static __thread int lockHeld = LOCK_NONE;
+
+// Entries an inbox starts with; it doubles when full
+#define INBOX_INIT 64
+
+// Sets up a worker's inbox and its wake-up eventfd.
+int worker_init(Worker* w, int id) {
+	w->id = id;
+	w->flushList = NULL;
+	w->inbox = NULL;
+	w->nroInbox = 0;
+	w->capInbox = 0;
+	w->spare = NULL;
+	w->capSpare = 0;
+
+	if (pthread_mutex_init(&w->inboxLock, NULL) != 0) return -1;
+
+	w->wakefd = eventfd(0, EFD_NONBLOCK);
+
+	return w->wakefd < 0 ? -1 : 0;
+}
+
+// Adds a client to its worker's flushList; only its worker calls it.
+static void schedule_flush(Client* cli) {
+	Worker* w = &workers[cli->worker];
+
+	if (cli->flushPending) return;
+
+	cli->flushPending = 1;
+	cli->flushPrev = NULL;
+	cli->flushNext = w->flushList;
+	if (w->flushList) w->flushList->flushPrev = cli;
+	w->flushList = cli;
+}
+
+// Removes a client from its worker's flushList.
+void unschedule_flush(Client* cli) {
+	Worker* w = &workers[cli->worker];
+
+	if (!cli->flushPending) return;
+
+	if (cli->flushPrev) cli->flushPrev->flushNext = cli->flushNext;
+	else w->flushList = cli->flushNext;
+
+	if (cli->flushNext) cli->flushNext->flushPrev = cli->flushPrev;
+
+	cli->flushPending = 0;
+	cli->flushPrev = NULL;
+	cli->flushNext = NULL;
+}
+
+/* Writes the header of the notice frame that carries len bytes of text to
+a binary client. Returns the header size, 0 for text clients. */
+static int notice_header(Client* cli, char* head, size_t len) {
+	if (!cli->binary) return 0;
+
+	return proto_put_header(head, PROTO_OP_NOTICE, cli->idChannel, PROTO_SERVER_ID, len);
+}
+
+/* Applies the slow-consumer policy to a client whose queue cannot take len
+more bytes. Returns 0 if they fit now, -1 if the message must not be queued. */
+static int make_room(Client* cli, size_t len) {
+	if (cli->out.bytes + len <= config.maxQueueBytes) return 0;
+
+	/* A long burst handled in a single turn fills queues before they are
+	 flushed: the socket gets a chance to take it before the client is judged */
+	if (&workers[cli->worker] == thisWorker && !cli->sending) {
+		if (client_flush(cli) < 0) return -1;
+		if (cli->out.bytes + len <= config.maxQueueBytes) return 0;
+	}
+
+	if (config.dropOldest) {
+		size_t over = cli->out.bytes + len - config.maxQueueBytes;
+
+		// Slots handed to an io_uring send are still being read by the kernel
+		int keep = cli->sending ? (int) cli->sendMsg.msg_iovlen : 0;
+
+		slowStats.drops++;
+		slowStats.dropBytes += queue_drop(&cli->out, keep, over);
+
+		if (cli->out.bytes + len <= config.maxQueueBytes) return 0;
+
+		slowStats.dropBytes += len;
+		return -1;
+	}
+
+	slowStats.evictions++;
+	cli->state = CLI_CLOSING;
+
+	return -1;
+}
+
+/* Queues a message to a client of this worker: an optional header (binary
+clients) and either a copy of data or a shared payload. */
+static void queue_local(Client* cli, const char* head, int headLen, const char* data, size_t len, Payload* p) {
+	if (cli->state == CLI_CLOSING) return;
+
+	// Slow consumer: it never holds everyone else back
+	if (make_room(cli, headLen + (p ? p->len : len)) < 0) {
+		schedule_flush(cli);
+		return;
+	}
+
+	if (headLen && queue_push(&cli->out, head, headLen) < 0) cli->state = CLI_CLOSING;
+	else {
+		int first = cli->out.count;
+
+		if ((p ? queue_push_payload(&cli->out, p) : queue_push(&cli->out, data, len)) < 0)
+			cli->state = CLI_CLOSING;
+		else {
+			metrics.messagesOut++;
+
+			// The body can only be dropped together with its header
+			if (headLen) queue_join(&cli->out, first);
+		}
+	}
+
+	schedule_flush(cli);
+}
+
+/* Leaves a message for a client of another worker in that worker's inbox,
+waking the worker up if the inbox was empty. The message is lost if the
+inbox cannot grow. */
+static void inbox_push(Client* cli, const char* head, int headLen, const char* data, size_t len, Payload* p) {
+	Worker* w = &workers[cli->worker];
+
+	if (p) payload_ref(p);
+	else if (!(p = payload_create(data, len))) return;
+
+	pthread_mutex_lock(&w->inboxLock);
+
+	if (w->nroInbox == w->capInbox) {
+		int cap = w->capInbox ? w->capInbox * 2 : INBOX_INIT;
+
+		InboxEntry* tmp = (InboxEntry*) realloc(w->inbox, cap * sizeof(InboxEntry));
+		if (!tmp) {
+			pthread_mutex_unlock(&w->inboxLock);
+			payload_unref(p);
+			return;
+		}
+
+		w->inbox = tmp;
+		w->capInbox = cap;
+	}
+
+	InboxEntry* e = &w->inbox[w->nroInbox];
+
+	e->cli = cli;
+	e->payload = p;
+	e->stamp = metrics_stamp();
+	e->headLen = headLen;
+	if (headLen) memcpy(e->head, head, headLen);
+
+	int wasEmpty = w->nroInbox++ == 0;
+
+	pthread_mutex_unlock(&w->inboxLock);
+
+	// The worker only looks at its inbox after epoll_wait() returns
+	if (wasEmpty) {
+		uint64_t one = 1;
+		write(w->wakefd, &one, sizeof(one));
+	}
+}
+
+// Queues everything in a worker's inbox to its clients.
+void worker_drain_inbox(Worker* w) {
+	if (w->nroInbox == 0) return;
+
+	// The inbox is swapped for the spare array, so other threads can go on adding to it
+	pthread_mutex_lock(&w->inboxLock);
+
+	InboxEntry* entries = w->inbox;
+	int count = w->nroInbox;
+	int cap = w->capInbox;
+
+	w->inbox = w->spare;
+	w->capInbox = w->capSpare;
+	w->nroInbox = 0;
+
+	pthread_mutex_unlock(&w->inboxLock);
+
+	// Each message is timed from the read that produced it, on whatever thread
+	uint64_t stamp = metrics_stamp();
+
+	for (int i = 0; i < count; i++) {
+		InboxEntry* e = &entries[i];
+
+		metrics_input_resume(e->stamp);
+		queue_local(e->cli, e->head, e->headLen, NULL, 0, e->payload);
+		payload_unref(e->payload);
+	}
+
+	metrics_input_resume(stamp);
+
+	w->spare = entries;
+	w->capSpare = cap;
+}
+
+/* Queues a message to a client, through its worker's inbox if the client
+belongs to another worker. */
+static void client_queue(Client* cli, const char* head, int headLen, const char* data, size_t len, Payload* p) {
+	if (&workers[cli->worker] == thisWorker) queue_local(cli, head, headLen, data, len, p);
+	else inbox_push(cli, head, headLen, data, len, p);
+}
+
+// Queues data to a client.
+void client_write(Client* cli, const char* data, size_t len) {
+	char head[PROTO_HEADER_LEN];
+
+	client_queue(cli, head, notice_header(cli, head, len), data, len, NULL);
+}
+
+// Queues a shared payload to a client.
+void client_write_payload(Client* cli, Payload* p) {
+	char head[PROTO_HEADER_LEN];
+
+	// Binary clients get a header of their own; the text is still shared
+	client_queue(cli, head, notice_header(cli, head, p->len), NULL, 0, p);
+}
+
+// Queues a shared payload to a client as it is.
+void client_write_frame(Client* cli, Payload* p) {
+	client_queue(cli, NULL, 0, NULL, 0, p);
+}
+
+// Sends the client's queued data.
+int client_flush(Client* cli) {
+	// Everything queued since the last flush is compressed together
+	if (cli->zout && queue_compress(&cli->out, cli->zout) < 0) {
+		cli->state = CLI_CLOSING;
+		return -1;
+	}
+
+	int cork = cli->out.count > QUEUE_IOV;
+	int on = 1, off = 0;
+
+	// A backlog that takes several writev() calls goes out in full segments
+	if (cork) setsockopt(cli->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+	int err = queue_write(&cli->out, cli->sockfd);
+
+	if (cork) setsockopt(cli->sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+	if (err < 0) {
+		cli->state = CLI_CLOSING;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Flushes every client in the worker's flushList, after queuing what other
+workers left in its inbox; clients marked as closing are disconnected here. */
+static void flush_pending(Worker* w) {
+	worker_drain_inbox(w);
+
+	while (w->flushList) {
+		Client* cli = w->flushList;
+
+		unschedule_flush(cli);
+
+		if (cli->state != CLI_CLOSING) client_flush(cli);
+		if (cli->state == CLI_CLOSING) disconnect_client(cli);
+	}
+}
+
+// Disconnects a client of this worker.
+void disconnect_client(Client* cli) {
+	pthread_rwlock_wrlock(&clients_lock);
+	client_leaves_server(cli);
+	pthread_rwlock_unlock(&clients_lock);
+}
+
+/* Holds clients_lock in the given mode (LOCK_*), switching from the one the
+thread holds now; a run of chat lines takes it once. */
+static void hold_clients_lock(int mode) {
+	if (lockHeld == mode) return;
+
+	if (lockHeld != LOCK_NONE) pthread_rwlock_unlock(&clients_lock);
+
+	if (mode == LOCK_SHARED) pthread_rwlock_rdlock(&clients_lock);
+	else if (mode == LOCK_EXCLUSIVE) pthread_rwlock_wrlock(&clients_lock);
+
+	lockHeld = mode;
+}
+
+/* Whether a line is plain chat, which only needs clients_lock held shared:
+the client is connected and the text after "nick:" is not a command. The
+colon is found by nick_end(), as handle_message() finds it. */
+static int is_chat_line(Client* cli, const char* line) {
+	if (cli->state != CLI_CONNECTED) return 0;
+
+	const char* colon = nick_end(line);
+
+	// The line is NUL-terminated, so colon[1] and colon[2] are always there
+	return !colon || colon[1] != ' ' || colon[2] != '/';
+}
+
+// Same as is_chat_line(), for a binary client's frame.
+static int is_chat_frame(Client* cli, const char* frame, int len) {
+	return cli->state == CLI_CONNECTED && len >= PROTO_HEADER_LEN && frame[4] == PROTO_OP_CHAT;
+}
+
+// Handles every complete line in the client's framer, with clients_lock held as each one needs.
+static int handle_input(Client* cli, int receive) {
+	char buffer[BUFFER_MAX];
+	int leaveFlag = 0;
+
+	while (receive > 0 && !leaveFlag) {
+		int len;
+
+		if (cli->state == CLI_AWAITING_NICK) {
+			// The nickname comes first, as a record of NICK_LEN bytes
+			if (!(len = framer_next_record(&cli->in, buffer, NICK_LEN))) break;
+
+			hold_clients_lock(LOCK_EXCLUSIVE);
+			leaveFlag = handle_nick(cli, buffer, len);
+
+			// Whatever came after the nickname is already compressed
+			if (!leaveFlag && cli->zin && cli->in.count > 0) {
+				len = framer_next_record(&cli->in, buffer, cli->in.count);
+				return client_feed_input(cli, buffer, len);
+			}
+		} else if (cli->binary) {
+			// A frame that could never fit is a protocol error
+			if ((len = framer_next_frame(&cli->in, buffer, FRAME_MAX)) < 0) return 1;
+			if (!len) break;
+
+			metrics.messagesIn++;
+			hold_clients_lock(is_chat_frame(cli, buffer, len) ? LOCK_SHARED : LOCK_EXCLUSIVE);
+			leaveFlag = handle_frame(cli, buffer, len);
+		} else {
+			if (!(len = framer_next_line(&cli->in, buffer, NICK_LEN+MSG_LEN))) break;
+
+			metrics.messagesIn++;
+			hold_clients_lock(is_chat_line(cli, buffer) ? LOCK_SHARED : LOCK_EXCLUSIVE);
+			leaveFlag = handle_message(cli, buffer, len);
+		}
+
+		leaveFlag = leaveFlag || cli->state == CLI_CLOSING;
+	}
+
+	// The connection was closed or broken: a partial line is dropped
+	if (receive <= 0) {
+		buffer[0] = '\0';
+
+		hold_clients_lock(LOCK_EXCLUSIVE);
+
+		if (cli->state == CLI_AWAITING_NICK) leaveFlag = handle_nick(cli, buffer, receive);
+		else leaveFlag = handle_message(cli, buffer, receive);
+	}
+
+	return leaveFlag;
+}
+
+// Handles every complete line in the client's framer.
+int client_handle_input(Client* cli, int receive) {
+	int leaveFlag = handle_input(cli, receive);
+
+	hold_clients_lock(LOCK_NONE);
+
+	return leaveFlag;
+}
+
+// Moves received bytes into the client's framer and handles every complete line.
+int client_feed_input(Client* cli, const char* data, int len) {
+	char plain[FRAMER_CAP];
+	int leaveFlag = 0;
+
+	if (!cli->zin) {
+		// Whatever does not fit in the framer waits for its lines to be handled
+		for (int off = 0; off < len && !leaveFlag && cli->state != CLI_CLOSING;) {
+			int n = framer_feed(&cli->in, data + off, len - off);
+
+			off += n;
+			leaveFlag = client_handle_input(cli, n);
+		}
+
+		return leaveFlag;
+	}
+
+	cli->zin->next_in = (Bytef*) data;
+	cli->zin->avail_in = len;
+
+	// Decompresses as much as the framer takes, until the input runs out
+	while (!leaveFlag && cli->state != CLI_CLOSING) {
+		int space = FRAMER_CAP - cli->in.count;
+
+		cli->zin->next_out = (Bytef*) plain;
+		cli->zin->avail_out = space;
+
+		int ret = inflate(cli->zin, Z_SYNC_FLUSH);
+
+		// A corrupt stream, or one the client ended, drops the connection
+		if (ret != Z_OK && ret != Z_BUF_ERROR) return 1;
+
+		int n = space - cli->zin->avail_out;
+		if (n == 0) break;
+
+		framer_feed(&cli->in, plain, n);
+		leaveFlag = client_handle_input(cli, n);
+	}
+
+	return leaveFlag;
+}
+
+/* Reads everything available on the client's socket (edge-triggered mode
+only notifies once) and handles every complete line in it; a partial line
+stays in the client's framer until the rest of it arrives.
+Returns 1 if the client must be disconnected. */
+static int read_client(Client* cli) {
+	char raw[FRAMER_CAP];
+
+	while (1) {
+		// Compressed data is read aside, it only goes to the framer decompressed
+		int receive = cli->zin ? read(cli->sockfd, raw, sizeof(raw)) : framer_read(&cli->in, cli->sockfd);
+
+		if (receive < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if (receive < 0 && errno == EINTR) continue;
+
+		int leaveFlag;
+
+		metrics_input_start(receive);
+
+		if (cli->zin && receive > 0) leaveFlag = client_feed_input(cli, raw, receive);
+		else leaveFlag = client_handle_input(cli, receive);
+
+		metrics_input_end();
+
+		if (leaveFlag) return 1;
+	}
+}
+
+// Admits a new connection.
+Client* admit_client(Worker* w, int connfd, struct sockaddr_in client_addr) {
+	if (is_server_full(connfd)) return NULL;
+
+	Client* cli = client_pool_get();
+
+	if (!cli) {
+		close(connfd);
+		return NULL;
+	}
+
+	cli->worker = w->id;
+
+	if (create_client(client_addr, connfd, cli) < 0) {
+		client_pool_put(cli);
+		close(connfd);
+		return NULL;
+	}
+
+	return cli;
+}
+
+/* Accepts every pending connection (edge-triggered mode only notifies once)
+and registers the new clients in the worker's epoll instance. */
+static void accept_clients(Worker* w) {
+	struct sockaddr_in client_addr;
+	struct epoll_event ev;
+
+	while (1) {
+		socklen_t cliLen = sizeof(client_addr);
+
+		/* Responsible for extracting the first connection request on the
+		 queue of pending connections, creating a new connected socket
+		 and returning a new file descriptor referring to that socket. */
+		int connfd = accept4(w->listenfd, (struct sockaddr*) &client_addr, &cliLen, SOCK_NONBLOCK);
+
+		if (connfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+
+			// EAGAIN: there are no more pending connections
+			if (errno != EAGAIN && errno != EWOULDBLOCK) printf("\nErro: accept.\n");
+			return;
+		}
+
+		// -------------------- Client Management --------------------
+		// Defines client settings and adds it to the registry.
+		pthread_rwlock_wrlock(&clients_lock);
+		Client* cli = admit_client(w, connfd, client_addr);
+		pthread_rwlock_unlock(&clients_lock);
+
+		if (!cli) continue;
+
+		// The connection is watched for both directions from now on
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = cli;
+
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+			printf("\nErro: epoll_ctl.\n");
+			disconnect_client(cli);
+		}
+	}
+}
+
+/* Registers the clients handed over to this worker by the previous server
+(handoff.h); whatever they sent or were owed meanwhile shows up as their
+first events. */
+static void adopt_clients(Worker* w) {
+	struct epoll_event ev;
+
+	pthread_rwlock_wrlock(&clients_lock);
+
+	for (int i = 0; i < cliSlots; i++) {
+		Client* cli = clients[i];
+
+		if (!cli || cli->worker != w->id) continue;
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = cli;
+
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, cli->sockfd, &ev) < 0) client_leaves_server(cli);
+	}
+
+	pthread_rwlock_unlock(&clients_lock);
+}
+
+// Edge-triggered epoll loop.
+void* run_event_loop(void* arg) {
+	Worker* w = (Worker*) arg;
+	struct epoll_event ev, events[MAX_EVENTS];
+
+	thisWorker = w;
+	metrics_register();
+
+	w->epfd = epoll_create1(0);
+	if (w->epfd < 0) {
+		printf("\nErro: epoll.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	// Before the listener: every client this worker has now came from a handoff
+	adopt_clients(w);
+
+	/* The listening socket (NULL) and the wake-up eventfd (the worker
+	 itself) are the only entries without a client attached */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+
+	int err = epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev);
+
+	ev.data.ptr = w;
+	err |= epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev);
+
+	if (err < 0) {
+		printf("\nErro: epoll_ctl.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	while (1) {
+		// A new server is taking over (-R): nothing is read or written meanwhile
+		if (handoffRequested) handoff_park();
+
+		int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+
+			printf("\nErro: epoll_wait.\n");
+
+			// EXIT FAILURE
+			exit(1);
+		}
+
+		for (int i = 0; i < n; i++) {
+			Client* cli = (Client*) events[i].data.ptr;
+
+			if (!cli) {
+				accept_clients(w);
+				continue;
+			}
+
+			// Other threads left messages in the inbox, queued by flush_pending()
+			if (events[i].data.ptr == w) {
+				uint64_t count;
+				read(w->wakefd, &count, sizeof(count));
+				continue;
+			}
+
+			int leaveFlag = 0;
+
+			if (events[i].events & EPOLLOUT) client_flush(cli);
+
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				leaveFlag = read_client(cli);
+
+			// When client leaves the chat
+			if (leaveFlag || cli->state == CLI_CLOSING) disconnect_client(cli);
+		}
+
+		// Everything queued during this turn, here or by other threads, goes out now
+		flush_pending(w);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,210 @@
+// === FUNCTIONS RELATED TO THE EVENT LOOP ===
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "server_operation.h"
+#include "server_config.h"
+#include "metrics.h"
+
+// Maximum number of events handled per epoll_wait() call
+#define MAX_EVENTS 64
+
+/*  InboxEntry structure:
+a message another thread queued to one of a worker's clients: the header
+of a binary client's notice frame, if any, the payload and the time the
+read that produced it arrived (metrics_stamp()). */
+
+typedef struct {
+	Client* cli;
+	Payload* payload;
+	uint64_t stamp;
+	int headLen;
+	char head[PROTO_HEADER_LEN];
+} InboxEntry;
+
+/*  Worker structure:
+an event loop thread with its own listening socket (SO_REUSEPORT) and
+epoll instance. Clients stay with the worker that accepted them, and only
+that worker touches their connection. flushList holds the worker's clients
+that have queued output. Other threads never queue to them directly: they
+add to the worker's inbox (guarded by inboxLock) and signal wakefd (an
+eventfd) if it was empty; spare is the array the inbox is swapped with
+while the worker empties it. */
+
+typedef struct {
+	int id;
+	int listenfd;
+	int epfd;
+	int wakefd;
+	Client* flushList;
+	pthread_mutex_t inboxLock;
+	InboxEntry* inbox;
+	_Atomic int nroInbox;
+	int capInbox;
+	InboxEntry* spare;
+	int capSpare;
+	pthread_t tid;
+} Worker;
+
+extern Worker workers[MAX_WORKERS];
+
+/*  SlowStats structure:
+how often the slow-consumer policy fired: drops counts the messages that
+made a client lose queued data (-d), dropBytes how much data was lost, and
+evictions the clients disconnected for being over -q. */
+
+typedef struct {
+	unsigned long drops;
+	unsigned long dropBytes;
+	unsigned long evictions;
+} SlowStats;
+
+// Updated by each thread in its own copy (metrics_register())
+extern __thread SlowStats slowStats;
+
+// Worker running on the current thread, NULL outside of the workers
+extern __thread Worker* thisWorker;
+
+/* Sets a file descriptor to non-blocking mode.
+
+	PARAMETERS
+	int fd - file descriptor
+
+	RETURN
+	int - 0 on success, -1 on error */
+int set_nonblocking(int fd);
+
+/* Sets up a worker's inbox and its wake-up eventfd; called for every
+worker before any thread starts.
+
+	PARAMETERS
+	Worker* w - worker
+	int id 	  - worker's index in workers
+
+	RETURN
+	int - 0 on success, -1 on error */
+int worker_init(Worker* w, int id);
+
+/* Queues everything in a worker's inbox to its clients. Must be called by
+the worker itself, or while it is parked (handoff.h).
+
+	PARAMETERS
+	Worker* w - worker */
+void worker_drain_inbox(Worker* w);
+
+/* Queues data to a client (to a binary client, as a PROTO_OP_NOTICE frame);
+it is written at the end of the current event
+loop turn by the worker that owns the client, so the caller never waits for
+the recipient's socket. A client of another worker gets it through that
+worker's inbox. If the queue would go over the limit (-q), the
+client is disconnected or, with -d, loses its oldest queued messages (and
+this one, if that is not enough).
+Must be called with clients_lock held, shared or exclusively.
+
+	PARAMETERS
+	Client* cli 	 - destination client
+	const char* data - bytes to be sent
+	size_t len 		 - number of bytes */
+void client_write(Client* cli, const char* data, size_t len);
+
+/* Same as client_write(), but queues a payload shared with other clients
+instead of a copy of the message.
+Must be called with clients_lock held, shared or exclusively.
+
+	PARAMETERS
+	Client* cli - destination client
+	Payload* p  - message */
+void client_write_payload(Client* cli, Payload* p);
+
+/* Same as client_write_payload(), but the payload is queued as it is, with
+no notice header: it must already be in the client's format.
+Must be called with clients_lock held, shared or exclusively.
+
+	PARAMETERS
+	Client* cli - destination client
+	Payload* p  - message */
+void client_write_frame(Client* cli, Payload* p);
+
+/* Sends the client's queued data, as much as the socket takes; a backlog
+longer than one writev() is sent with TCP_CORK set. On a compressed
+connection, the data queued since the last flush is compressed first.
+Must be called by the client's worker; no lock is needed.
+
+	PARAMETERS
+	Client* cli - current client
+
+	RETURN
+	int - 0 on success, -1 if the connection is broken */
+int client_flush(Client* cli);
+
+/* Removes a client from its worker's flushList.
+Must be called by the client's worker; no lock is needed.
+
+	PARAMETERS
+	Client* cli - current client */
+void unschedule_flush(Client* cli);
+
+/* Takes clients_lock exclusively and disconnects a client of this worker
+(client_leaves_server()).
+
+	PARAMETERS
+	Client* cli - current client */
+void disconnect_client(Client* cli);
+
+/* Handles every complete line in the client's framer, after a read. Takes
+clients_lock for each line, shared for chat and exclusively for anything
+else, and releases it before returning.
+Must be called by the client's worker, without clients_lock.
+
+	PARAMETERS
+	Client* cli - current client
+	int receive - bytes read, or the read's return value if the connection
+				  was closed (0) or broken (-1)
+
+	RETURN
+	int - leaveFlag, 1 if the client must be disconnected */
+int client_handle_input(Client* cli, int receive);
+
+/* Moves bytes received from the client (decompressing them, on a compressed
+connection) into its framer and handles every complete line.
+Must be called by the client's worker, without clients_lock.
+
+	PARAMETERS
+	Client* cli 	 - current client
+	const char* data - received bytes
+	int len 		 - number of bytes, more than 0
+
+	RETURN
+	int - leaveFlag, 1 if the client must be disconnected */
+int client_feed_input(Client* cli, const char* data, int len);
+
+/* Gives a new connection a client from the pool and registers it, unless
+the server is full; the connection is closed if it is refused.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	Worker* w 					   - worker that accepted the connection
+	int connfd 					   - socket file descriptor
+	struct sockaddr_in client_addr - client's address
+
+	RETURN
+	Client* - new client, NULL if the connection was refused */
+Client* admit_client(Worker* w, int connfd, struct sockaddr_in client_addr);
+
+/* Edge-triggered epoll loop: accepts connections on the worker's listening
+socket and drives reads and writes of the worker's client connections.
+Reads and writes take no lock; chat is handled with clients_lock held
+shared, so workers deliver it in parallel, and commands with it held
+exclusively.
+
+	PARAMETERS
+	void* arg - worker structure */
+void* run_event_loop(void* arg);
+
+#endif
@@ -0,0 +1,803 @@
+// === FUNCTIONS RELATED TO SERVER LINKS ===
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+
+#include "federation.h"
+#include "server_config.h"
+#include "channel_table.h"
+#include "client_registry.h"
+#include "metrics.h"
+
+/*  Link structure:
+a connection to another server: its socket (-1 while down), the peer's node
+name (once its HELLO arrived), the frames being received and the ones
+waiting for the socket. Links opened by this server (-S) keep the peer's
+address and are dialed again at retryAt (metrics_now(), in nanoseconds)
+after going down. gen changes with every socket, so the link thread never
+acts on a descriptor that was closed (and maybe reused) while it was
+polling. broken is set by the workers when a link must go down; the link
+thread closes it. Workers relaying chat hold clients_lock shared only, so
+they write to the links under linkMutex. */
+
+typedef struct {
+	int fd;
+	int connecting;
+	int broken;
+	unsigned int gen;
+	char name[NODE_LEN];
+	int outgoing;
+	struct sockaddr_in addr;
+	uint64_t retryAt;
+	LineFramer in;
+	OutQueue out;
+} Link;
+
+/*  RemoteUser structure:
+a user of another server: its node and its userID there, its nickname and
+channel, the link it was learned through and its position in remotes. */
+
+typedef struct RemoteUser {
+	char node[NODE_LEN];
+	uint32_t userID;
+	char nick[NICK_LEN];
+	char chName[CHANNEL_LEN];
+	int link;
+	int slot;
+	struct RemoteUser* hashNext;
+} RemoteUser;
+
+/*  RemoteChannel structure:
+a channel with users on other servers and how many of them are behind
+each link. */
+
+typedef struct RemoteChannel {
+	char name[CHANNEL_LEN];
+	int members[MAX_LINKS];
+	int total;
+	struct RemoteChannel* hashNext;
+} RemoteChannel;
+
+static Link links[MAX_LINKS];
+static char nodeName[NODE_LEN];
+
+// Links up; while there are none, the hooks return right away
+static int nroUp = 0;
+
+static int listenfd = -1;
+static int wakefd = -1;
+
+// Guards the links' queues and broken flags against workers relaying at once
+static pthread_mutex_t linkMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Remote users, in a list (walked by bursts and links going down) and by node and userID
+static RemoteUser** remotes = NULL;
+static int nroRemotes = 0;
+static int capRemotes = 0;
+static RemoteUser** userBuckets = NULL;
+static int nroUserBuckets = 0;
+
+// Channels with remote users, by name
+static RemoteChannel** chanBuckets = NULL;
+static int nroChanBuckets = 0;
+static int nroRemoteChannels = 0;
+
+// Hash of a remote user's key.
+static uint32_t hash_user(const char* node, uint32_t userID) {
+	return fnv1a(node, -1) ^ (userID * 2654435761u);
+}
+
+// Finds a remote user by its node and its userID there.
+static RemoteUser* find_user(const char* node, uint32_t userID) {
+	if (!nroUserBuckets) return NULL;
+
+	RemoteUser* u = userBuckets[hash_user(node, userID) & (nroUserBuckets - 1)];
+
+	for (; u; u = u->hashNext)
+		if (u->userID == userID && strcmp(u->node, node) == 0) return u;
+
+	return NULL;
+}
+
+// Doubles the remote user index, rehashing every user.
+static int grow_user_buckets() {
+	int size = nroUserBuckets ? nroUserBuckets * 2 : TABLE_INIT_BUCKETS;
+
+	RemoteUser** tmp = (RemoteUser**) calloc(size, sizeof(RemoteUser*));
+	if (!tmp) return -1;
+
+	free(userBuckets);
+	userBuckets = tmp;
+	nroUserBuckets = size;
+
+	for (int i = 0; i < nroRemotes; i++) {
+		RemoteUser** b = &userBuckets[hash_user(remotes[i]->node, remotes[i]->userID) & (size - 1)];
+
+		remotes[i]->hashNext = *b;
+		*b = remotes[i];
+	}
+
+	return 0;
+}
+
+// Adds a remote user, with no nickname or channel yet.
+static RemoteUser* add_user(const char* node, uint32_t userID) {
+	if (nroRemotes == capRemotes) {
+		int cap = capRemotes ? capRemotes * 2 : TABLE_INIT_BUCKETS;
+
+		RemoteUser** tmp = (RemoteUser**) realloc(remotes, cap * sizeof(RemoteUser*));
+		if (!tmp) return NULL;
+
+		remotes = tmp;
+		capRemotes = cap;
+	}
+
+	if (nroRemotes >= nroUserBuckets && grow_user_buckets() < 0) return NULL;
+
+	RemoteUser* u = (RemoteUser*) calloc(1, sizeof(RemoteUser));
+	if (!u) return NULL;
+
+	strcpy(u->node, node);
+	u->userID = userID;
+	u->slot = nroRemotes;
+	remotes[nroRemotes++] = u;
+
+	RemoteUser** b = &userBuckets[hash_user(node, userID) & (nroUserBuckets - 1)];
+
+	u->hashNext = *b;
+	*b = u;
+
+	return u;
+}
+
+// Removes a remote user; the last one in the list takes its place.
+static void drop_user(RemoteUser* u) {
+	RemoteUser** p = &userBuckets[hash_user(u->node, u->userID) & (nroUserBuckets - 1)];
+
+	while (*p != u) p = &(*p)->hashNext;
+	*p = u->hashNext;
+
+	remotes[u->slot] = remotes[--nroRemotes];
+	remotes[u->slot]->slot = u->slot;
+
+	free(u);
+}
+
+// Finds a channel with remote users by name.
+static RemoteChannel* find_remote_channel(const char* name) {
+	if (!nroChanBuckets) return NULL;
+
+	RemoteChannel* c = chanBuckets[fnv1a(name, -1) & (nroChanBuckets - 1)];
+
+	for (; c; c = c->hashNext)
+		if (strcmp(c->name, name) == 0) return c;
+
+	return NULL;
+}
+
+// Doubles the remote channel index, moving every channel to its new chain.
+static int grow_chan_buckets() {
+	int size = nroChanBuckets ? nroChanBuckets * 2 : TABLE_INIT_BUCKETS;
+
+	RemoteChannel** tmp = (RemoteChannel**) calloc(size, sizeof(RemoteChannel*));
+	if (!tmp) return -1;
+
+	for (int i = 0; i < nroChanBuckets; i++) {
+		RemoteChannel* c = chanBuckets[i];
+
+		while (c) {
+			RemoteChannel* next = c->hashNext;
+			RemoteChannel** b = &tmp[fnv1a(c->name, -1) & (size - 1)];
+
+			c->hashNext = *b;
+			*b = c;
+			c = next;
+		}
+	}
+
+	free(chanBuckets);
+	chanBuckets = tmp;
+	nroChanBuckets = size;
+
+	return 0;
+}
+
+// Counts a remote user joining (delta 1) or leaving (delta -1) a channel through a link.
+static void count_member(const char* name, int link, int delta) {
+	RemoteChannel* c = find_remote_channel(name);
+
+	if (!c) {
+		if (delta < 0) return;
+		if (nroRemoteChannels >= nroChanBuckets && grow_chan_buckets() < 0) return;
+		if (!(c = (RemoteChannel*) calloc(1, sizeof(RemoteChannel)))) return;
+
+		strcpy(c->name, name);
+
+		RemoteChannel** b = &chanBuckets[fnv1a(name, -1) & (nroChanBuckets - 1)];
+
+		c->hashNext = *b;
+		*b = c;
+		nroRemoteChannels++;
+	}
+
+	c->members[link] += delta;
+	c->total += delta;
+
+	if (c->total > 0) return;
+
+	// No remote user is left in the channel
+	RemoteChannel** p = &chanBuckets[fnv1a(name, -1) & (nroChanBuckets - 1)];
+
+	while (*p != c) p = &(*p)->hashNext;
+	*p = c->hashNext;
+
+	free(c);
+	nroRemoteChannels--;
+}
+
+// Writes a string prefixed by its length (one byte).
+static int put_str(char* out, const char* s) {
+	int len = strlen(s);
+
+	out[0] = (char) len;
+	memcpy(out + 1, s, len);
+
+	return len + 1;
+}
+
+// Takes a string prefixed by its length (one byte) from a frame body.
+static int get_str(const char** p, const char* end, char* out, int max) {
+	if (*p >= end) return -1;
+
+	int len = (unsigned char) **p;
+
+	if (len >= max || *p + 1 + len > end) return -1;
+
+	memcpy(out, *p + 1, len);
+	out[len] = '\0';
+	*p += len + 1;
+
+	return len;
+}
+
+// Builds a LINK_OP_MEMBER frame; an empty channel means the user left.
+static int member_frame(char* out, const char* node, uint32_t userID, const char* nick, const char* chName) {
+	int n = PROTO_HEADER_LEN;
+
+	n += put_str(out + n, node);
+	n += put_str(out + n, nick);
+	n += put_str(out + n, chName);
+
+	proto_put_header(out, LINK_OP_MEMBER, 0, userID, n - PROTO_HEADER_LEN);
+
+	return n;
+}
+
+// Wakes the link thread up, so it polls the links again.
+static void wake_links() {
+	uint64_t one = 1;
+
+	if (write(wakefd, &one, sizeof(one)) < 0) return;
+}
+
+/* Checks whether frames can be sent over a link; a broken one is only
+skipped by link_send(). */
+static int link_is_up(Link* l) {
+	return l->fd >= 0 && !l->connecting;
+}
+
+/* Queues a frame to a link and writes it right away if nothing was waiting;
+what the socket does not take is left to the link thread. */
+static void link_send(Link* l, const char* frame, size_t len) {
+	pthread_mutex_lock(&linkMutex);
+
+	if (l->broken) {
+		pthread_mutex_unlock(&linkMutex);
+		return;
+	}
+
+	int idle = l->out.count == 0;
+
+	if (l->out.bytes + len > LINK_QUEUE_MAX || queue_push(&l->out, frame, len) < 0) {
+		l->broken = 1;
+	} else if (idle && queue_write(&l->out, l->fd) < 0) {
+		l->broken = 1;
+	}
+
+	int wake = l->broken || (idle && l->out.count > 0);
+
+	pthread_mutex_unlock(&linkMutex);
+
+	if (wake) wake_links();
+}
+
+// Sends a frame over every link up but one (-1 for none).
+static void send_all(int except, const char* frame, size_t len) {
+	for (int i = 0; i < MAX_LINKS; i++)
+		if (i != except && link_is_up(&links[i])) link_send(&links[i], frame, len);
+}
+
+// Sends a frame over every link but one with users in the channel.
+static void send_members(RemoteChannel* c, int except, const char* frame, size_t len) {
+	for (int i = 0; i < MAX_LINKS; i++)
+		if (i != except && c->members[i] > 0 && link_is_up(&links[i])) link_send(&links[i], frame, len);
+}
+
+// Records where a remote user is now; returns 1 if anything changed.
+static int update_user(int li, const char* node, uint32_t userID, const char* nick, const char* chName) {
+	// Our own users, back through a cycle
+	if (strcmp(node, nodeName) == 0) return 0;
+
+	RemoteUser* u = find_user(node, userID);
+
+	if (!u) {
+		if (chName[0] == '\0' || !(u = add_user(node, userID))) return 0;
+	} else {
+		if (u->link == li && strcmp(u->nick, nick) == 0 && strcmp(u->chName, chName) == 0) return 0;
+
+		count_member(u->chName, u->link, -1);
+
+		if (chName[0] == '\0') {
+			drop_user(u);
+			return 1;
+		}
+	}
+
+	strcpy(u->nick, nick);
+	strcpy(u->chName, chName);
+	u->link = li;
+
+	count_member(chName, li, 1);
+
+	return 1;
+}
+
+// Starts a link: HELLO, then every user this server knows about, except the ones behind the link.
+static void link_up(int li) {
+	Link* l = &links[li];
+	char frame[FRAMER_CAP];
+
+	l->connecting = 0;
+	nroUp++;
+
+	int n = strlen(nodeName);
+
+	proto_put_header(frame, LINK_OP_HELLO, 0, PROTO_SERVER_ID, n);
+	memcpy(frame + PROTO_HEADER_LEN, nodeName, n);
+	link_send(l, frame, PROTO_HEADER_LEN + n);
+
+	for (int i = 0; i < cliSlots; i++) {
+		Client* cli = clients[i];
+
+		if (!cli || cli->nick[0] == '\0' || cli->idChannel < 0) continue;
+
+		n = member_frame(frame, nodeName, cli->userID, cli->nick, channel_list[cli->idChannel].chName);
+		link_send(l, frame, n);
+	}
+
+	for (int i = 0; i < nroRemotes; i++) {
+		RemoteUser* u = remotes[i];
+
+		if (u->link == li) continue;
+
+		n = member_frame(frame, u->node, u->userID, u->nick, u->chName);
+		link_send(l, frame, n);
+	}
+}
+
+// Closes a link; the users behind it leave for every other server too.
+static void link_down(int li) {
+	Link* l = &links[li];
+	char frame[FRAMER_CAP];
+
+	if (l->fd < 0) return;
+
+	if (!l->connecting) {
+		nroUp--;
+
+		if (l->name[0]) printf("Ligação com o servidor %s perdida.\n", l->name);
+	}
+
+	close(l->fd);
+
+	l->fd = -1;
+	l->connecting = 0;
+	l->broken = 0;
+	l->gen++;
+	l->name[0] = '\0';
+	l->retryAt = metrics_now() + LINK_RETRY_MS * 1000000ull;
+
+	framer_init(&l->in);
+	queue_reset(&l->out);
+
+	for (int i = 0; i < nroRemotes;) {
+		RemoteUser* u = remotes[i];
+
+		if (u->link != li) {
+			i++;
+			continue;
+		}
+
+		int n = member_frame(frame, u->node, u->userID, u->nick, "");
+
+		// The last user takes slot i
+		count_member(u->chName, li, -1);
+		drop_user(u);
+
+		send_all(li, frame, n);
+	}
+}
+
+// Turns off Nagle's algorithm: frames are already batched by the queue.
+static void set_nodelay(int fd) {
+	int option = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*) &option, sizeof(option));
+}
+
+// Dials the peer of a link opened by this server (-S), without waiting for the connection.
+static void link_connect(int li) {
+	Link* l = &links[li];
+
+	l->retryAt = metrics_now() + LINK_RETRY_MS * 1000000ull;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return;
+
+	if (connect(fd, (struct sockaddr*) &l->addr, sizeof(l->addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		return;
+	}
+
+	set_nodelay(fd);
+
+	l->fd = fd;
+	l->gen++;
+	l->connecting = 1;
+}
+
+// Accepts a link from another server (-l).
+static void accept_link() {
+	int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) return;
+
+	set_nodelay(fd);
+
+	pthread_rwlock_wrlock(&clients_lock);
+
+	int li = 0;
+
+	while (li < MAX_LINKS && (links[li].fd >= 0 || links[li].outgoing)) li++;
+
+	if (li == MAX_LINKS) {
+		close(fd);
+	} else {
+		links[li].fd = fd;
+		links[li].gen++;
+		link_up(li);
+	}
+
+	pthread_rwlock_unlock(&clients_lock);
+}
+
+// Handles a frame received from a link; returns -1 if the link must go down.
+static int handle_link_frame(int li, const char* frame, int len) {
+	ProtoHeader h;
+	char node[NODE_LEN];
+	char nick[NICK_LEN];
+	char chName[CHANNEL_LEN];
+
+	if (proto_get_header(frame, &h) < 0) return -1;
+
+	const char* p = frame + PROTO_HEADER_LEN;
+	const char* end = frame + len;
+	RemoteChannel* c;
+	int nickLen, idChannel;
+
+	switch (h.opcode) {
+		case LINK_OP_HELLO:
+			if (end - p < 1 || end - p >= NODE_LEN) return -1;
+
+			memcpy(node, p, end - p);
+			node[end - p] = '\0';
+
+			// A second link to a server would bring every message twice
+			if (strcmp(node, nodeName) == 0) return -1;
+
+			for (int i = 0; i < MAX_LINKS; i++)
+				if (i != li && links[i].fd >= 0 && strcmp(links[i].name, node) == 0) return -1;
+
+			strcpy(links[li].name, node);
+			printf("Ligado ao servidor %s.\n", node);
+
+			return 0;
+		case LINK_OP_MEMBER:
+			if (get_str(&p, end, node, NODE_LEN) < 0 || get_str(&p, end, nick, NICK_LEN) < 0 ||
+			    get_str(&p, end, chName, CHANNEL_LEN) < 0) return -1;
+
+			if (update_user(li, node, h.sender, nick, chName)) send_all(li, frame, len);
+
+			return 0;
+		case LINK_OP_CHAT:
+			if (get_str(&p, end, node, NODE_LEN) < 0 || (nickLen = get_str(&p, end, nick, NICK_LEN)) < 0 ||
+			    get_str(&p, end, chName, CHANNEL_LEN) < 0) return -1;
+
+			if (strcmp(node, nodeName) == 0) return 0;
+
+			if ((idChannel = channel_lookup(chName)) >= 0) {
+				lock_channel(idChannel);
+				deliver_chat(idChannel, -1, h.sender, usrColors[h.sender % 7], nick, nickLen, p, end - p);
+				unlock_channel(idChannel);
+			}
+
+			if ((c = find_remote_channel(chName))) send_members(c, li, frame, len);
+
+			return 0;
+		case LINK_OP_NOTICE:
+			if (get_str(&p, end, chName, CHANNEL_LEN) < 0) return -1;
+
+			if ((idChannel = channel_lookup(chName)) >= 0) {
+				lock_channel(idChannel);
+				deliver_notice(p, end - p, -1, idChannel);
+				unlock_channel(idChannel);
+			}
+
+			if ((c = find_remote_channel(chName))) send_members(c, li, frame, len);
+
+			return 0;
+		default:
+			// Opcodes from newer servers are skipped
+			return 0;
+	}
+}
+
+// Reads, handles and writes what a link is ready for.
+static void link_io(int li, short revents) {
+	Link* l = &links[li];
+	char frame[FRAMER_CAP];
+
+	if (l->connecting) {
+		int err = 0;
+		socklen_t errLen = sizeof(err);
+
+		if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err) {
+			link_down(li);
+			return;
+		}
+
+		link_up(li);
+	}
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		int n = framer_read(&l->in, l->fd);
+
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			link_down(li);
+			return;
+		}
+
+		while ((n = framer_next_frame(&l->in, frame, FRAMER_CAP)) > 0 && handle_link_frame(li, frame, n) == 0);
+
+		if (n != 0) {
+			link_down(li);
+			return;
+		}
+	}
+
+	if (l->out.count > 0 && queue_write(&l->out, l->fd) < 0) link_down(li);
+}
+
+/* Link thread: dials the peers (-S), accepts links (-l) and moves the frames
+of every link. Frames are handled with clients_lock held exclusively, like
+a worker handles a command, so no worker is relaying meanwhile; workers
+write to the links themselves and only wake this thread up for what the
+sockets did not take. */
+static void* run_links(void* arg) {
+	struct pollfd fds[MAX_LINKS + 2];
+	int owner[MAX_LINKS + 2];
+	unsigned int gens[MAX_LINKS + 2];
+	uint64_t count;
+
+	// Chat from other servers is counted in the fan-out
+	metrics_register();
+
+	while (1) {
+		int n = 0;
+
+		pthread_rwlock_wrlock(&clients_lock);
+
+		uint64_t now = metrics_now();
+
+		for (int i = 0; i < MAX_LINKS; i++) {
+			Link* l = &links[i];
+
+			if (l->broken) link_down(i);
+			if (l->fd < 0 && l->outgoing && now >= l->retryAt) link_connect(i);
+			if (l->fd < 0) continue;
+
+			fds[n].fd = l->fd;
+			fds[n].events = POLLIN | (l->connecting || l->out.count > 0 ? POLLOUT : 0);
+			owner[n] = i;
+			gens[n++] = l->gen;
+		}
+
+		pthread_rwlock_unlock(&clients_lock);
+
+		fds[n].fd = wakefd;
+		fds[n].events = POLLIN;
+		owner[n++] = -1;
+
+		if (listenfd >= 0) {
+			fds[n].fd = listenfd;
+			fds[n].events = POLLIN;
+			owner[n++] = -2;
+		}
+
+		if (poll(fds, n, LINK_RETRY_MS) <= 0) continue;
+
+		for (int k = 0; k < n; k++) {
+			if (!fds[k].revents) continue;
+
+			if (owner[k] == -1) {
+				if (read(wakefd, &count, sizeof(count)) < 0) continue;
+			} else if (owner[k] == -2) {
+				accept_link();
+			} else {
+				pthread_rwlock_wrlock(&clients_lock);
+
+				// The link may have gone down (and its descriptor been reused) meanwhile
+				Link* l = &links[owner[k]];
+				if (l->fd == fds[k].fd && l->gen == gens[k]) link_io(owner[k], fds[k].revents);
+
+				pthread_rwlock_unlock(&clients_lock);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// Reads a peer address (-S), ip:port.
+static int parse_peer(const char* peer, struct sockaddr_in* addr) {
+	char ip[INET_ADDRSTRLEN];
+	const char* colon = strrchr(peer, ':');
+
+	if (!colon || colon - peer >= INET_ADDRSTRLEN || atoi(colon + 1) <= 0) return -1;
+
+	memcpy(ip, peer, colon - peer);
+	ip[colon - peer] = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(atoi(colon + 1));
+
+	return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+// Creates the socket where other servers link to this one (-l).
+static int create_link_listener() {
+	int option = 1;
+	struct sockaddr_in addr;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(config.IP);
+	addr.sin_port = htons(config.linkPort);
+
+	// SO_REUSEPORT lets a server replacing this one (-R) bind it too
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*) &option, sizeof(option)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*) &option, sizeof(option)) < 0 ||
+	    bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, MAX_LINKS) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Starts the thread that keeps the links.
+int federation_start() {
+	pthread_t tid;
+
+	if (!config.linkPort && !config.nroPeers) return 0;
+
+	if (config.nodeName)
+		snprintf(nodeName, NODE_LEN, "%s", config.nodeName);
+	else
+		snprintf(nodeName, NODE_LEN, "irc-%d", config.port);
+
+	for (int i = 0; i < MAX_LINKS; i++) {
+		links[i].fd = -1;
+		framer_init(&links[i].in);
+		queue_init(&links[i].out);
+		links[i].out.link = 1;
+	}
+
+	// Links opened by this server take the first slots; the others are for accepted ones
+	for (int i = 0; i < config.nroPeers; i++) {
+		if (parse_peer(config.peers[i], &links[i].addr) < 0) return -1;
+
+		links[i].outgoing = 1;
+	}
+
+	if (config.linkPort && (listenfd = create_link_listener()) < 0) return -1;
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) return -1;
+
+	if (pthread_create(&tid, NULL, run_links, NULL) != 0) return -1;
+
+	pthread_detach(tid);
+
+	return 0;
+}
+
+// Tells the linked servers where a client is now.
+void federation_announce(Client* cli) {
+	char frame[FRAMER_CAP];
+
+	if (!nroUp || cli->nick[0] == '\0' || cli->idChannel < 0) return;
+
+	int n = member_frame(frame, nodeName, cli->userID, cli->nick, channel_list[cli->idChannel].chName);
+
+	send_all(-1, frame, n);
+}
+
+// Tells the linked servers that a client left.
+void federation_quit(Client* cli) {
+	char frame[FRAMER_CAP];
+
+	if (!nroUp || cli->nick[0] == '\0') return;
+
+	int n = member_frame(frame, nodeName, cli->userID, cli->nick, "");
+
+	send_all(-1, frame, n);
+}
+
+// Relays a chat message to the linked servers with members in the sender's channel.
+void federation_relay_chat(Client* cli, const char* text, size_t len) {
+	char frame[FRAMER_CAP];
+
+	if (!nroUp) return;
+
+	RemoteChannel* c = find_remote_channel(channel_list[cli->idChannel].chName);
+	if (!c) return;
+
+	if (len > LINK_TEXT_MAX) len = LINK_TEXT_MAX;
+
+	int n = PROTO_HEADER_LEN;
+
+	n += put_str(frame + n, nodeName);
+	n += put_str(frame + n, cli->nick);
+	n += put_str(frame + n, c->name);
+
+	memcpy(frame + n, text, len);
+	n += len;
+
+	proto_put_header(frame, LINK_OP_CHAT, 0, cli->userID, n - PROTO_HEADER_LEN);
+	send_members(c, -1, frame, n);
+}
+
+// Relays a server notice to the linked servers with members in the channel.
+void federation_relay_notice(int idChannel, const char* msg, size_t len) {
+	char frame[FRAMER_CAP];
+
+	if (!nroUp) return;
+
+	RemoteChannel* c = find_remote_channel(channel_list[idChannel].chName);
+	if (!c) return;
+
+	if (len > LINK_TEXT_MAX) len = LINK_TEXT_MAX;
+
+	int n = PROTO_HEADER_LEN + put_str(frame + PROTO_HEADER_LEN, c->name);
+
+	memcpy(frame + n, msg, len);
+	n += len;
+
+	proto_put_header(frame, LINK_OP_NOTICE, 0, PROTO_SERVER_ID, n - PROTO_HEADER_LEN);
+	send_members(c, -1, frame, n);
+}
@@ -0,0 +1,94 @@
+// === FUNCTIONS RELATED TO SERVER LINKS ===
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "server_operation.h"
+
+/* Servers started with -l accept links from other servers, and -S links a
+server to another one; together they must form a tree. Cycles are not
+detected: only a second link to the same node (-N) is refused. Every event
+a server learns is passed on to its other links, never back to the one it
+came from, so each server hears it once.
+
+A link is a TCP connection carrying frames with the wire_protocol.h header
+(str8 is a uint8 length and the bytes):
+	LINK_OP_HELLO  - body: the node name; sent first by both ends
+	LINK_OP_MEMBER - sender: userID at its node; body: str8 node, str8 nick
+	                 and str8 channel, empty once the user left the server.
+	                 States where a user is now, so it covers joins, parts,
+	                 nickname changes and quits, and repeating it is harmless
+	LINK_OP_CHAT   - sender: userID at its node; body: str8 node, str8 nick,
+	                 str8 channel and the text
+	LINK_OP_NOTICE - body: str8 channel and the text (a line from a server)
+When a link comes up, each end sends the members it knows about, except the
+ones learned through that link. For each channel, a server counts the users
+behind each link: a chat line or notice goes once over each link with
+members in the channel, however many users are behind it. When a link goes
+down, the users behind it are gone for every other server too.
+Channel modes, invites and admins stay local to each server. */
+#define LINK_OP_HELLO 16
+#define LINK_OP_MEMBER 17
+#define LINK_OP_CHAT 18
+#define LINK_OP_NOTICE 19
+
+// Links accepted (-l) plus the ones this server opens (-S)
+#define MAX_LINKS (2 * MAX_PEERS)
+
+#define NODE_LEN 32
+
+// A link whose peer does not take this much queued data is dropped
+#define LINK_QUEUE_MAX (16 << 20)
+
+// How long a server waits before linking again to a peer (-S) that went down
+#define LINK_RETRY_MS 1000
+
+// Text relayed in a single frame; anything longer is cut
+#define LINK_TEXT_MAX (FRAMER_CAP - PROTO_HEADER_LEN - 3 - NODE_LEN - NICK_LEN - CHANNEL_LEN)
+
+/* Starts the thread that keeps the links (-l and -S), if there are any.
+Must be called once the channels and clients (handoff.h) are in place,
+before the workers start.
+
+	RETURN
+	int - 0 on success, -1 on error */
+int federation_start();
+
+/* Tells the linked servers where a client is now: its nickname and its
+channel. Nothing is sent before the client has a nickname.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	Client* cli - client */
+void federation_announce(Client* cli);
+
+/* Tells the linked servers that a client left.
+Must be called with clients_lock held exclusively.
+
+	PARAMETERS
+	Client* cli - client */
+void federation_quit(Client* cli);
+
+/* Relays a chat message to the linked servers with members in the sender's
+channel.
+Must be called with the channel locked (lock_channel()), so linked servers
+get the channel's messages in the same order as its members here;
+clients_lock held shared is enough.
+
+	PARAMETERS
+	Client* cli 	 - sender
+	const char* text - message, without the nickname and the final '\n'
+	size_t len 		 - message length */
+void federation_relay_chat(Client* cli, const char* text, size_t len);
+
+/* Relays a server notice to the linked servers with members in the channel.
+Must be called with the channel locked (lock_channel()), so linked servers
+get the channel's messages in the same order as its members here;
+clients_lock held shared is enough.
+
+	PARAMETERS
+	int idChannel 	- channel id
+	const char* msg - notice
+	size_t len 		- notice length */
+void federation_relay_notice(int idChannel, const char* msg, size_t len);
+
+#endif
@@ -0,0 +1,622 @@
+// === FUNCTIONS RELATED TO HOT UPGRADES ===
+// accept4() is a GNU extension
+#define _GNU_SOURCE
+
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "event_loop.h"
+#include "client_registry.h"
+#include "client_pool.h"
+#include "channel_table.h"
+#include "channel_log.h"
+
+_Atomic int handoffRequested = 0;
+
+// Workers parked; both conditions go with parkMutex
+static int parked = 0;
+static pthread_mutex_t parkMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parkedCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resumeCond = PTHREAD_COND_INITIALIZER;
+
+/*  Snapshot structure:
+a snapshot being written (len grows up to cap) or read (from off on).
+err is set by the first write that could not grow it or the first read
+past its end; every call after that does nothing. */
+
+typedef struct {
+	char* data;
+	size_t len;
+	size_t cap;
+	size_t off;
+	int err;
+} Snapshot;
+
+// Appends bytes to a snapshot.
+static void put(Snapshot* s, const void* data, size_t len) {
+	if (s->err) return;
+
+	if (s->len + len > s->cap) {
+		size_t size = s->cap ? s->cap : 65536;
+
+		while (size < s->len + len) size *= 2;
+
+		char* tmp = (char*) realloc(s->data, size);
+		if (!tmp) {
+			s->err = 1;
+			return;
+		}
+
+		s->data = tmp;
+		s->cap = size;
+	}
+
+	memcpy(s->data + s->len, data, len);
+	s->len += len;
+}
+
+static void put_u32(Snapshot* s, uint32_t v) {
+	put(s, &v, sizeof(v));
+}
+
+static void put_str(Snapshot* s, const char* str, size_t len) {
+	put_u32(s, len);
+	put(s, str, len);
+}
+
+// Takes bytes from a snapshot; past its end, they read as zeros.
+static void get(Snapshot* s, void* data, size_t len) {
+	if (s->err || s->len - s->off < len) {
+		s->err = 1;
+		memset(data, 0, len);
+		return;
+	}
+
+	memcpy(data, s->data + s->off, len);
+	s->off += len;
+}
+
+static uint32_t get_u32(Snapshot* s) {
+	uint32_t v;
+
+	get(s, &v, sizeof(v));
+
+	return v;
+}
+
+/* Takes a str from a snapshot; it is left in place, so it is not
+terminated. Longer than max, it is an error. */
+static const char* get_str(Snapshot* s, uint32_t* len, uint32_t max) {
+	*len = get_u32(s);
+
+	if (s->err || *len > max || s->len - s->off < *len) {
+		s->err = 1;
+		*len = 0;
+		return "";
+	}
+
+	s->off += *len;
+
+	return s->data + s->off - *len;
+}
+
+// Writes the whole buffer to a blocking socket.
+static int write_all(int fd, const char* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Reads exactly len bytes from a blocking socket.
+static int read_all(int fd, char* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = read(fd, data, len);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Makes reads and writes on the socket give up after HANDOFF_TIMEOUT.
+static void set_timeouts(int fd) {
+	struct timeval tv = {HANDOFF_TIMEOUT, 0};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Sends descriptors, HANDOFF_FDS_PER_MSG at a time, each batch after its size.
+static int send_fds(int sock, int* fds, int n) {
+	char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+
+	for (int off = 0; off < n; off += HANDOFF_FDS_PER_MSG) {
+		uint32_t batch = n - off < HANDOFF_FDS_PER_MSG ? n - off : HANDOFF_FDS_PER_MSG;
+		struct iovec iov = {&batch, sizeof(batch)};
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+		struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(batch * sizeof(int));
+		memcpy(CMSG_DATA(c), fds + off, batch * sizeof(int));
+
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(batch)) return -1;
+	}
+
+	return 0;
+}
+
+// Receives the n descriptors sent by send_fds().
+static int recv_fds(int sock, int* fds, int n) {
+	char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+	int got = 0;
+
+	while (got < n) {
+		uint32_t batch;
+		struct iovec iov = {&batch, sizeof(batch)};
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(batch)) break;
+
+		struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+		if (!c || c->cmsg_type != SCM_RIGHTS) break;
+
+		int k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int take = k < n - got ? k : n - got;
+
+		memcpy(fds + got, CMSG_DATA(c), take * sizeof(int));
+		got += take;
+
+		// More than announced: not ours to keep
+		for (int i = take; i < k; i++) close(((int*) CMSG_DATA(c))[i]);
+
+		if (k != (int) batch || (msg.msg_flags & MSG_CTRUNC)) break;
+	}
+
+	if (got == n) return 0;
+
+	for (int i = 0; i < got; i++) close(fds[i]);
+
+	return -1;
+}
+
+// Whether a client goes to the new server.
+static int handed_over(Client* cli) {
+	return cli && cli->state != CLI_CLOSING && !cli->zin && !cli->zout;
+}
+
+// Writes the channels and the clients to a snapshot; fds gets the clients' sockets.
+static void write_state(Snapshot* s, int* fds) {
+	int nroLive = 0, nroClients = 0;
+
+	for (int i = 0; i < nroChannels; i++)
+		if (channel_list[i].chName[0] != '\0') nroLive++;
+
+	for (int i = 0; i < cliSlots; i++)
+		if (handed_over(clients[i])) nroClients++;
+
+	put(s, HANDOFF_MAGIC, strlen(HANDOFF_MAGIC));
+	put(s, &(uint8_t) {HANDOFF_VERSION}, 1);
+	put_u32(s, config.workers);
+	put_u32(s, nroLive);
+	put_u32(s, nroClients);
+
+	for (int i = 0; i < nroChannels; i++) {
+		Channel* ch = &channel_list[i];
+
+		if (ch->chName[0] == '\0') continue;
+
+		put_u32(s, i);
+		put_str(s, ch->chName, strlen(ch->chName));
+		put_str(s, ch->chMode, strlen(ch->chMode));
+
+		put_u32(s, ch->nroInvUser);
+		for (int j = 0; j < ch->nroInvUser; j++) put_str(s, ch->inviteUser[j], strlen(ch->inviteUser[j]));
+
+		put_u32(s, ch->history.count);
+		for (int j = 0; j < ch->history.count; j++) {
+			const char* data;
+			const HistEntry* e = history_get(&ch->history, j, &data);
+
+			put_u32(s, e->sender);
+			put_str(s, data, e->nickLen);
+			put_str(s, data + e->nickLen, e->len - e->nickLen);
+		}
+	}
+
+	for (int i = 0, k = 0; i < cliSlots; i++) {
+		Client* cli = clients[i];
+
+		if (!handed_over(cli)) continue;
+
+		put_u32(s, cli->userID);
+		put_u32(s, cli->idChannel);
+		put_u32(s, cli->state);
+		put_u32(s, cli->isAdmin);
+		put_u32(s, cli->isMuted);
+		put_u32(s, cli->binary);
+		put_str(s, (char*) &cli->address, sizeof(cli->address));
+		put_str(s, cli->color, strlen(cli->color));
+		put_str(s, cli->nick, strlen(cli->nick));
+
+		// A line not finished yet, straight from the ring
+		LineFramer* in = &cli->in;
+
+		put_u32(s, in->count);
+		for (int j = 0; j < in->count; j++) put(s, &in->data[(in->head + j) & (FRAMER_CAP - 1)], 1);
+
+		// Everything the socket did not take yet, as one string
+		OutQueue* out = &cli->out;
+
+		put_u32(s, out->bytes);
+		for (int j = 0; j < out->count; j++) {
+			OutSlot* slot = &out->slots[(out->head + j) % out->cap];
+
+			put(s, slot->payload->data + slot->off, slot->payload->len - slot->off);
+		}
+
+		fds[k++] = cli->sockfd;
+	}
+}
+
+/* Hands this server over to the process connected to sock. The workers are
+parked; with clients_lock held exclusively. Returns 0 once the new server
+took it. */
+static int hand_over(int sock) {
+	Snapshot s = {};
+	int n = config.workers;
+
+	int* fds = (int*) malloc((config.workers + cliSlots) * sizeof(int));
+	if (!fds) return -1;
+
+	for (int i = 0; i < config.workers; i++) fds[i] = workers[i].listenfd;
+
+	for (int i = 0; i < cliSlots; i++)
+		if (handed_over(clients[i])) n++;
+
+	write_state(&s, fds + config.workers);
+
+	uint64_t len = s.len;
+	char ack = 0;
+
+	int err = s.err || write_all(sock, (char*) &len, sizeof(len)) < 0 || write_all(sock, s.data, s.len) < 0 ||
+	          send_fds(sock, fds, n) < 0 || read_all(sock, &ack, 1) < 0 || ack != HANDOFF_ACK;
+
+	free(s.data);
+	free(fds);
+
+	return err ? -1 : 0;
+}
+
+// Waits for every worker to park.
+static void park_workers() {
+	pthread_mutex_lock(&parkMutex);
+
+	handoffRequested = 1;
+
+	// A worker waiting for events sees the flag once it wakes up
+	for (int i = 0; i < config.workers; i++) {
+		uint64_t one = 1;
+		write(workers[i].wakefd, &one, sizeof(one));
+	}
+
+	while (parked < config.workers) pthread_cond_wait(&parkedCond, &parkMutex);
+
+	pthread_mutex_unlock(&parkMutex);
+}
+
+// Lets the parked workers go back to their loops.
+static void resume_workers() {
+	pthread_mutex_lock(&parkMutex);
+
+	handoffRequested = 0;
+	pthread_cond_broadcast(&resumeCond);
+
+	pthread_mutex_unlock(&parkMutex);
+}
+
+// Serves the connections of the servers that come to take over.
+static void* serve_handoff(void* arg) {
+	int listenfd = (int) (long) arg;
+
+	while (1) {
+		int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) continue;
+
+		set_timeouts(fd);
+
+		park_workers();
+		pthread_rwlock_wrlock(&clients_lock);
+
+		// What the workers had not taken from their inboxes goes with their clients' queues
+		for (int i = 0; i < config.workers; i++) worker_drain_inbox(&workers[i]);
+
+		if (hand_over(fd) == 0) {
+			// Messages logged inside the -D window are synced before leaving
+			channel_log_flush();
+
+			printf("\nServidor entregue ao novo processo.\n");
+
+			// EXIT SUCCESS
+			exit(0);
+		}
+
+		printf("\nErro: handoff; o servidor continua.\n");
+
+		pthread_rwlock_unlock(&clients_lock);
+		resume_workers();
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+// Waits on a Unix socket for the server that will replace this one.
+int handoff_listen(const char* path) {
+	struct sockaddr_un addr;
+	pthread_t tid;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	// The socket of the server this one replaced, or a stale one
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0 ||
+	    pthread_create(&tid, NULL, serve_handoff, (void*) (long) fd) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_detach(tid);
+
+	return 0;
+}
+
+// Waits until the handoff fails.
+void handoff_park() {
+	pthread_mutex_lock(&parkMutex);
+
+	parked++;
+	pthread_cond_signal(&parkedCond);
+
+	while (handoffRequested) pthread_cond_wait(&resumeCond, &parkMutex);
+
+	parked--;
+
+	pthread_mutex_unlock(&parkMutex);
+}
+
+/* Rebuilds the channels of a snapshot; map gets, for each old channel id
+(up to nroMap), the new one. */
+static int read_channels(Snapshot* s, uint32_t nroLive, int** map, uint32_t* nroMap) {
+	for (uint32_t i = 0; i < nroLive && !s->err; i++) {
+		char name[CHANNEL_LEN] = {}, mode[3] = {};
+		uint32_t id = get_u32(s), len, nroInv;
+		const char* str;
+
+		str = get_str(s, &len, CHANNEL_LEN - 1);
+		memcpy(name, str, len);
+		str = get_str(s, &len, sizeof(mode) - 1);
+		memcpy(mode, str, len);
+
+		if (s->err || id > (uint32_t) config.maxChannels * 2) return -1;
+
+		// #all already exists; the others are created as they come
+		int newId = strcmp(name, "#all") == 0 ? ALL_CHANNEL : channel_create(name);
+		if (newId < 0) return -1;
+
+		if (id >= *nroMap) {
+			int* tmp = (int*) realloc(*map, (id + 1) * sizeof(int));
+			if (!tmp) return -1;
+
+			for (uint32_t j = *nroMap; j <= id; j++) tmp[j] = -1;
+
+			*map = tmp;
+			*nroMap = id + 1;
+		}
+
+		(*map)[id] = newId;
+
+		Channel* ch = &channel_list[newId];
+
+		if (mode[0]) channel_set_mode(newId, mode);
+
+		nroInv = get_u32(s);
+		if (nroInv > MAX_INVITE) return -1;
+
+		for (uint32_t j = 0; j < nroInv; j++) {
+			str = get_str(s, &len, NICK_LEN - 1);
+			memcpy(ch->inviteUser[j], str, len);
+		}
+
+		ch->nroInvUser = nroInv;
+
+		// The snapshot has the history as it was, whatever the log brought back
+		history_clear(&ch->history);
+
+		uint32_t nroHist = get_u32(s);
+
+		for (uint32_t j = 0; j < nroHist && !s->err; j++) {
+			uint32_t sender = get_u32(s), nickLen, textLen;
+			const char* nick = get_str(s, &nickLen, NICK_LEN);
+			const char* text = get_str(s, &textLen, UINT16_MAX);
+
+			history_append(&ch->history, sender, nick, nickLen, text, textLen);
+		}
+	}
+
+	return s->err ? -1 : 0;
+}
+
+// Rebuilds the clients of a snapshot around the sockets received.
+static int read_clients(Snapshot* s, uint32_t nroClients, int* fds, int* map, uint32_t nroMap) {
+	for (uint32_t i = 0; i < nroClients; i++) {
+		uint32_t userID = get_u32(s), idChannel = get_u32(s), state = get_u32(s);
+		uint32_t isAdmin = get_u32(s), isMuted = get_u32(s), binary = get_u32(s);
+		uint32_t addrLen, colorLen, nickLen, inLen, outLen;
+
+		const char* addr = get_str(s, &addrLen, sizeof(struct sockaddr_in));
+		const char* color = get_str(s, &colorLen, sizeof(((Client*) 0)->color) - 1);
+		const char* nick = get_str(s, &nickLen, NICK_LEN - 1);
+		const char* in = get_str(s, &inLen, FRAMER_CAP);
+		const char* out = get_str(s, &outLen, UINT32_MAX);
+
+		if (s->err || addrLen != sizeof(struct sockaddr_in) || idChannel >= nroMap || map[idChannel] < 0 ||
+		    state == CLI_CLOSING || state > CLI_AWAITING_ADMIN)
+			return -1;
+
+		Client* cli = client_pool_get();
+		if (!cli) return -1;
+
+		memcpy(&cli->address, addr, addrLen);
+		cli->sockfd = fds[i];
+		cli->worker = i % config.workers;
+		cli->state = state;
+		cli->isAdmin = isAdmin;
+		cli->isMuted = isMuted;
+		cli->binary = binary;
+		cli->zin = NULL;
+		cli->zout = NULL;
+
+		memset(cli->color, '\0', sizeof(cli->color));
+		memcpy(cli->color, color, colorLen);
+		memset(cli->nick, '\0', NICK_LEN);
+		memcpy(cli->nick, nick, nickLen);
+
+		framer_init(&cli->in);
+		framer_feed(&cli->in, in, inLen);
+
+		cli->flushPending = 0;
+		cli->flushPrev = NULL;
+		cli->flushNext = NULL;
+		cli->idChannel = -1;
+
+		// Sent once the client's worker registers it (adopt_clients())
+		if ((outLen && queue_push(&cli->out, out, outLen) < 0) || registry_add_at(cli, userID) < 0) {
+			queue_reset(&cli->out);
+			client_pool_put(cli);
+			return -1;
+		}
+
+		channel_add_member(map[idChannel], cli);
+		cliCount++;
+
+		// From now on the socket belongs to the client
+		fds[i] = -1;
+	}
+
+	return 0;
+}
+
+// Takes over from the server waiting at path.
+int handoff_take(const char* path) {
+	struct sockaddr_un addr;
+	Snapshot s = {};
+	uint64_t len;
+	char magic[sizeof(HANDOFF_MAGIC)] = {};
+	uint8_t version;
+	int* fds = NULL;
+	int* map = NULL;
+	uint32_t nroMap = 0, nroFds = 0;
+	int taken = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) return -1;
+
+	// Nobody is listening: this is the first server
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		close(sock);
+		return 0;
+	}
+
+	set_timeouts(sock);
+
+	if (read_all(sock, (char*) &len, sizeof(len)) < 0 || !(s.data = (char*) malloc(len ? len : 1)) ||
+	    read_all(sock, s.data, len) < 0)
+		goto done;
+
+	s.len = len;
+
+	get(&s, magic, strlen(HANDOFF_MAGIC));
+	get(&s, &version, 1);
+
+	uint32_t nroListeners = get_u32(&s), nroLive = get_u32(&s), nroClients = get_u32(&s);
+
+	if (s.err || strcmp(magic, HANDOFF_MAGIC) != 0 || version != HANDOFF_VERSION || nroListeners == 0 ||
+	    nroClients > (uint32_t) config.maxClients)
+		goto done;
+
+	nroFds = nroListeners + nroClients;
+
+	if (!(fds = (int*) malloc(nroFds * sizeof(int))) || recv_fds(sock, fds, nroFds) < 0) {
+		nroFds = 0;
+		goto done;
+	}
+
+	if (read_channels(&s, nroLive, &map, &nroMap) < 0 ||
+	    read_clients(&s, nroClients, fds + nroListeners, map, nroMap) < 0)
+		goto done;
+
+	// The old server leaves as soon as it reads this
+	if (write(sock, &(char) {HANDOFF_ACK}, 1) != 1) goto done;
+
+	taken = nroListeners < (uint32_t) config.workers ? nroListeners : config.workers;
+
+	for (int i = 0; i < taken; i++) {
+		workers[i].listenfd = fds[i];
+		fds[i] = -1;
+	}
+
+	printf("\n%u clientes e %u canais recebidos do servidor anterior.\n", nroClients, nroLive);
+
+done:
+	// Sockets nobody took: listeners beyond -w, or everything if it failed
+	for (uint32_t i = 0; i < nroFds; i++)
+		if (fds[i] >= 0) close(fds[i]);
+
+	free(fds);
+	free(map);
+	free(s.data);
+	close(sock);
+
+	return taken;
+}
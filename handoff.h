@@ -0,0 +1,70 @@
+// === FUNCTIONS RELATED TO HOT UPGRADES ===
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+/* With -R <path>, a running server waits on the Unix socket at path for
+the process that replaces it. A new server started with the same -R
+connects to it first and takes over:
+	- the old server parks its workers at the end of their turn, so no
+	  client is being read or written;
+	- it sends a snapshot of its state (below), then its listeners and the
+	  sockets of its clients, HANDOFF_FDS_PER_MSG at a time (SCM_RIGHTS);
+	- the new server rebuilds channels and clients, answers HANDOFF_ACK and
+	  the old one exits. Without the answer, the old server carries on.
+Clients keep their connection, userID, nickname, channel, admin and mute
+flags, the bytes of a line they did not finish and the output the old
+server had not sent yet. Compressed connections (zlib streams cannot be
+carried over) are closed. Only epoll servers hand over: with -u, receives
+in flight could take data the snapshot would miss.
+
+Snapshot layout, native byte order; str is a uint32 length and the bytes:
+	"IRCSNAP" and uint8 HANDOFF_VERSION
+	uint32 listeners, channels and clients
+	per channel: uint32 id, str name, str mode, uint32 invites, str each
+	             invite, uint32 history messages, uint32 sender, str nick
+	             and str text for each one
+	per client:  uint32 userID, idChannel, state, isAdmin, isMuted and
+	             binary, str address (a sockaddr_in), str color, str nick,
+	             str input and str output */
+#define HANDOFF_MAGIC "IRCSNAP"
+#define HANDOFF_VERSION 1
+
+#define HANDOFF_ACK 'K'
+
+// Descriptors sent by each sendmsg() (the kernel takes up to 253)
+#define HANDOFF_FDS_PER_MSG 128
+
+// Seconds either side waits for the other before giving up
+#define HANDOFF_TIMEOUT 10
+
+// Set while a new server is taking over; workers park at the end of their turn
+extern _Atomic int handoffRequested;
+
+/* Takes over from the server waiting at path (-R), if there is one: its
+channels and clients are rebuilt here and its listeners become the
+listenfd of the first workers (extra ones are closed).
+Must be called before the workers start.
+
+	PARAMETERS
+	const char* path - Unix socket of the running server
+
+	RETURN
+	int - number of listeners taken, 0 if no server was running, -1 on error */
+int handoff_take(const char* path);
+
+/* Waits on a Unix socket for the server that will replace this one.
+
+	PARAMETERS
+	const char* path - Unix socket path (a stale one is replaced)
+
+	RETURN
+	int - 0 on success, -1 on error */
+int handoff_listen(const char* path);
+
+/* Called by a worker when handoffRequested is set: waits, without any lock,
+until the handoff fails (or the process exits). */
+void handoff_park();
+
+#endif
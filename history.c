@@ -0,0 +1,107 @@
+// === FUNCTIONS RELATED TO CHANNEL HISTORY ===
+#include "history.h"
+#include "server_config.h"
+
+// Initializes an empty history.
+void history_init(History* h) {
+	h->entries = NULL;
+	h->data = NULL;
+	h->head = 0;
+	h->count = 0;
+	h->tail = 0;
+	h->bytes = 0;
+	h->replay[0] = NULL;
+	h->replay[1] = NULL;
+}
+
+// Releases the rendered replays; they no longer hold every message.
+static void history_invalidate(History* h) {
+	for (int i = 0; i < 2; i++) {
+		if (h->replay[i]) payload_unref(h->replay[i]);
+		h->replay[i] = NULL;
+	}
+}
+
+// Drops the oldest message.
+static void history_drop(History* h) {
+	h->bytes -= h->entries[h->head].len;
+	h->head = (h->head + 1) % config.historyLines;
+	h->count--;
+
+	if (h->count == 0) h->tail = 0;
+}
+
+/* Offset where n more bytes can be written without touching any message,
+dropping the oldest ones until there is one. */
+static uint32_t history_room(History* h, uint32_t n) {
+	while (1) {
+		if (h->count == 0) return 0;
+
+		uint32_t start = h->entries[h->head].off;
+
+		if (h->count < config.historyLines) {
+			// Free space is after tail and, if nothing wrapped yet, before start
+			if (h->tail > start) {
+				if (config.historyBytes - h->tail >= n) return h->tail;
+				if (start >= n) return 0;
+			} else if (h->tail < start && start - h->tail >= n) {
+				return h->tail;
+			}
+		}
+
+		history_drop(h);
+	}
+}
+
+// Adds a chat message to the history.
+int history_append(History* h, uint32_t sender, const char* nick, int nickLen, const char* text, int len) {
+	uint32_t n = nickLen + len;
+
+	if (config.historyLines <= 0 || n > (uint32_t) config.historyBytes || n > UINT16_MAX) return -1;
+
+	if (!h->entries) {
+		// Both rings in a single block
+		char* block = (char*) malloc(config.historyLines * sizeof(HistEntry) + config.historyBytes);
+		if (!block) return -1;
+
+		h->entries = (HistEntry*) block;
+		h->data = block + config.historyLines * sizeof(HistEntry);
+	}
+
+	history_invalidate(h);
+
+	uint32_t off = history_room(h, n);
+	HistEntry* e = &h->entries[(h->head + h->count) % config.historyLines];
+
+	e->off = off;
+	e->sender = sender;
+	e->len = n;
+	e->nickLen = nickLen;
+
+	memcpy(h->data + off, nick, nickLen);
+	memcpy(h->data + off + nickLen, text, len);
+
+	h->tail = off + n;
+	h->bytes += n;
+	h->count++;
+
+	return 0;
+}
+
+// Gives the i-th message of the history.
+const HistEntry* history_get(History* h, int i, const char** data) {
+	const HistEntry* e = &h->entries[(h->head + i) % config.historyLines];
+
+	*data = h->data + e->off;
+
+	return e;
+}
+
+// Drops every message and releases the history's memory.
+void history_clear(History* h) {
+	history_invalidate(h);
+
+	// entries and data are a single block
+	free(h->entries);
+	history_init(h);
+}
@@ -0,0 +1,80 @@
+// === FUNCTIONS RELATED TO CHANNEL HISTORY ===
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "out_queue.h"
+
+/*  HistEntry structure:
+a chat message kept in a channel's history: the userID of its sender and
+where its nickname (nickLen bytes) and text (the rest of len) are in the
+history's data. */
+
+typedef struct {
+	uint32_t off;
+	uint32_t sender;
+	uint16_t len;
+	uint8_t nickLen;
+} HistEntry;
+
+/*  History structure:
+the last chat messages of a channel, up to config.historyLines (-H)
+messages and config.historyBytes (-B) bytes of nicknames and text. Both
+rings are allocated, together, on the first message. Messages are stored
+back to back in data, from the oldest one (at entries[head].off) to tail,
+wrapping to the start of data when one does not fit at the end; the
+oldest ones are dropped to make room. replay holds the messages already
+rendered for a joiner, as text lines ([0]) or chat frames ([1]), until a
+new message comes in. */
+
+typedef struct {
+	HistEntry* entries;
+	char* data;
+	int head;
+	int count;
+	uint32_t tail;
+	uint32_t bytes;
+	Payload* replay[2];
+} History;
+
+/* Initializes an empty history; nothing is allocated.
+
+	PARAMETERS
+	History* h - history */
+void history_init(History* h);
+
+/* Adds a chat message to the history, dropping the oldest ones if there is
+no room for it. A message larger than the whole history is not kept.
+
+	PARAMETERS
+	History* h 		 - history
+	uint32_t sender  - userID of the sender
+	const char* nick - sender's nickname
+	int nickLen 	 - nickname length
+	const char* text - message
+	int len 		 - message length
+
+	RETURN
+	int - 0 on success, -1 if the message was not kept */
+int history_append(History* h, uint32_t sender, const char* nick, int nickLen, const char* text, int len);
+
+/* Gives the i-th message of the history, the oldest one being 0.
+
+	PARAMETERS
+	History* h 		  - history
+	int i 			  - index, from 0 to h->count - 1
+	const char** data - set to the nickname, followed by the text
+
+	RETURN
+	const HistEntry* - message */
+const HistEntry* history_get(History* h, int i, const char** data);
+
+/* Drops every message and releases the history's memory.
+
+	PARAMETERS
+	History* h - history */
+void history_clear(History* h);
+
+#endif
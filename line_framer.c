@@ -0,0 +1,123 @@
+// === FUNCTIONS RELATED TO INBOUND FRAMING ===
+#include "line_framer.h"
+
+// Initializes an empty framer.
+void framer_init(LineFramer* f) {
+	f->head = 0;
+	f->count = 0;
+	f->scanned = 0;
+}
+
+// Reads as much as fits in the ring from a non-blocking socket.
+int framer_read(LineFramer* f, int fd) {
+	struct iovec iov[2];
+	int n = 0;
+
+	int tail = (f->head + f->count) & (FRAMER_CAP - 1);
+	int space = FRAMER_CAP - f->count;
+
+	if (space == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	// The free space wraps around the end of the ring in up to two pieces
+	int first = FRAMER_CAP - tail < space ? FRAMER_CAP - tail : space;
+
+	iov[n].iov_base = f->data + tail;
+	iov[n++].iov_len = first;
+
+	if (space > first) {
+		iov[n].iov_base = f->data;
+		iov[n++].iov_len = space - first;
+	}
+
+	ssize_t got = readv(fd, iov, n);
+
+	if (got > 0) f->count += got;
+
+	return got;
+}
+
+// Copies bytes that were already read into the ring.
+int framer_feed(LineFramer* f, const char* data, int len) {
+	int tail = (f->head + f->count) & (FRAMER_CAP - 1);
+	int space = FRAMER_CAP - f->count;
+
+	if (len > space) len = space;
+
+	int first = FRAMER_CAP - tail < len ? FRAMER_CAP - tail : len;
+
+	memcpy(f->data + tail, data, first);
+	memcpy(f->data, data + first, len - first);
+
+	f->count += len;
+
+	return len;
+}
+
+// Copies len bytes from the start of the ring and releases them.
+static void framer_take(LineFramer* f, char* out, int len) {
+	int first = FRAMER_CAP - f->head < len ? FRAMER_CAP - f->head : len;
+
+	memcpy(out, f->data + f->head, first);
+	memcpy(out + first, f->data, len - first);
+	out[len] = '\0';
+
+	f->head = (f->head + len) & (FRAMER_CAP - 1);
+	f->count -= len;
+	f->scanned = 0;
+}
+
+// Takes a fixed-size record from the ring.
+int framer_next_record(LineFramer* f, char* out, int len) {
+	if (f->count < len) return 0;
+
+	framer_take(f, out, len);
+
+	return len;
+}
+
+// Takes the next complete line from the ring.
+int framer_next_line(LineFramer* f, char* out, int maxLen) {
+	int limit = f->count < maxLen ? f->count : maxLen;
+
+	for (; f->scanned < limit; f->scanned++) {
+		if (f->data[(f->head + f->scanned) & (FRAMER_CAP - 1)] == '\n') {
+			int len = f->scanned + 1;
+
+			framer_take(f, out, len);
+
+			return len;
+		}
+	}
+
+	// No newline within maxLen bytes: the line is cut there
+	if (f->count >= maxLen) {
+		framer_take(f, out, maxLen);
+
+		return maxLen;
+	}
+
+	return 0;
+}
+
+// Takes the next complete length-prefixed frame from the ring.
+int framer_next_frame(LineFramer* f, char* out, int maxLen) {
+	unsigned char prefix[4];
+
+	if (f->count < 4) return 0;
+
+	for (int i = 0; i < 4; i++)
+		prefix[i] = f->data[(f->head + i) & (FRAMER_CAP - 1)];
+
+	// Big-endian length of what follows the prefix
+	uint32_t len = ((uint32_t) prefix[0] << 24) | ((uint32_t) prefix[1] << 16) | ((uint32_t) prefix[2] << 8) | prefix[3];
+
+	if (len > (uint32_t) maxLen - 4) return -1;
+	if (f->count < 4 + (int) len) return 0;
+
+	framer_take(f, out, 4 + len);
+
+	return 4 + len;
+}
@@ -0,0 +1,95 @@
+// === FUNCTIONS RELATED TO INBOUND FRAMING ===
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Capacity of a connection's ring buffer; must be a power of two
+#define FRAMER_CAP 4096
+
+/*  LineFramer structure:
+ring buffer holding the bytes read from a connection that were not handled
+yet. head is where the oldest byte is, count how many bytes are stored and
+scanned how many of them (from head) are already known to hold no '\n', so
+a partial line is never searched twice. */
+
+typedef struct {
+	char data[FRAMER_CAP];
+	int head;
+	int count;
+	int scanned;
+} LineFramer;
+
+/* Initializes an empty framer.
+
+	PARAMETERS
+	LineFramer* f - framer */
+void framer_init(LineFramer* f);
+
+/* Reads as much as fits in the ring from a non-blocking socket, with a
+single readv() call.
+
+	PARAMETERS
+	LineFramer* f - framer
+	int fd 		  - socket file descriptor
+
+	RETURN
+	int - number of bytes read, 0 if the peer closed the connection,
+	-1 on error (errno is kept) */
+int framer_read(LineFramer* f, int fd);
+
+/* Copies bytes received by other means (such as io_uring) into the ring,
+as much as fits.
+
+	PARAMETERS
+	LineFramer* f 	 - framer
+	const char* data - received bytes
+	int len 		 - number of bytes
+
+	RETURN
+	int - number of bytes copied */
+int framer_feed(LineFramer* f, const char* data, int len);
+
+/* Takes a fixed-size record (such as the nickname sent when connecting)
+from the ring.
+
+	PARAMETERS
+	LineFramer* f - framer
+	char* out 	  - buffer with room for len + 1 bytes
+	int len 	  - record size
+
+	RETURN
+	int - len, or 0 if the record is not complete yet */
+int framer_next_record(LineFramer* f, char* out, int len);
+
+/* Takes the next complete line (newline included) from the ring. A line
+longer than maxLen is cut at maxLen bytes and the rest comes out as the
+next line.
+
+	PARAMETERS
+	LineFramer* f - framer
+	char* out 	  - buffer with room for maxLen + 1 bytes
+	int maxLen 	  - maximum line length, less than FRAMER_CAP
+
+	RETURN
+	int - line length, or 0 if there is no complete line yet */
+int framer_next_line(LineFramer* f, char* out, int maxLen);
+
+/* Takes the next complete frame from the ring: a 4-byte big-endian length
+followed by that many bytes (see wire_protocol.h).
+
+	PARAMETERS
+	LineFramer* f - framer
+	char* out 	  - buffer with room for maxLen + 1 bytes
+	int maxLen 	  - maximum frame size, prefix included, up to FRAMER_CAP
+
+	RETURN
+	int - frame size, 0 if there is no complete frame yet, -1 if the
+	frame is larger than maxLen */
+int framer_next_frame(LineFramer* f, char* out, int maxLen);
+
+#endif
@@ -0,0 +1,427 @@
+/*
+	Load generator - Major Steps:
+	- Open N connections to the server, send each nickname and /join one of M channels;
+	- Send chat messages at a fixed total rate, each one carrying the time it was sent;
+	- Read every message delivered to the connections and time it;
+	- Report throughput and delivery latency percentiles.
+
+	Sender and server run on the same host, so the monotonic clock written
+	in a message can be compared with the one read when it is delivered.
+*/
+
+// memmem() is a GNU extension
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "wire_protocol.h"
+
+#define NICK_LEN 50
+#define MSG_MAX 2048
+
+// Bytes read but not handled yet, and bytes the socket did not take yet, per connection
+#define IN_CAP 16384
+#define OUT_CAP 8192
+
+// Marks the timestamp inside a message
+#define STAMP_MARK "~lg~"
+
+// Latency histogram: 16 linear buckets per power of two, in microseconds
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+/*  Conn structure:
+a simulated client: its socket, channel, the bytes of a partial line or
+frame (in) and the bytes waiting for the socket (out); waitOut is set
+while epoll also reports when the socket has room. */
+
+typedef struct {
+	int fd;
+	int channel;
+	int open;
+	int waitOut;
+	char in[IN_CAP];
+	int inLen;
+	char out[OUT_CAP];
+	int outLen;
+} Conn;
+
+// Settings, from the command line
+char* IP = "127.0.0.1";
+int port = 8192;
+int nroConns = 100;
+int nroChannels = 10;
+int rate = 1000;
+int seconds = 10;
+int msgSize = 64;
+int binary = 0;
+
+Conn* conns;
+int* members;
+int epfd;
+
+// Totals of the run, and of the current second
+unsigned long sent = 0, expected = 0, delivered = 0, skipped = 0, closed = 0;
+unsigned long secSent = 0, secDelivered = 0;
+
+unsigned long hist[HIST_BUCKETS];
+
+// Current time of the monotonic clock, in nanoseconds
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Histogram bucket of a latency in microseconds
+int hist_index(uint64_t us) {
+	if (us < HIST_SUB) return us;
+
+	int e = 63 - __builtin_clzll(us);
+
+	return (e - 3) * HIST_SUB + ((us >> (e - 4)) & (HIST_SUB - 1));
+}
+
+// Smallest latency (in microseconds) that falls in a bucket
+uint64_t hist_value(int i) {
+	if (i < HIST_SUB) return i;
+
+	return (uint64_t) (HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+// Latency below which the fraction q of the deliveries fell, in microseconds
+uint64_t percentile(double q) {
+	unsigned long rank = (unsigned long) (q * delivered), seen = 0;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > rank) return hist_value(i);
+	}
+
+	return 0;
+}
+
+void usage(char* name) {
+	printf("Uso: %s [IP] [-p porta] [-n conexões] [-m canais] [-r msgs/s] [-t segundos] [-s bytes] [-b]\n", name);
+}
+
+// Connection closed by the server (or broken)
+void conn_close(Conn* c) {
+	if (!c->open) return;
+
+	close(c->fd);
+	c->open = 0;
+	closed++;
+}
+
+// Writes what the socket takes from the connection's out buffer
+void conn_flush(Conn* c) {
+	int off = 0;
+
+	while (off < c->outLen) {
+		int n = send(c->fd, c->out + off, c->outLen - off, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n <= 0) {
+			conn_close(c);
+			return;
+		}
+
+		off += n;
+	}
+
+	memmove(c->out, c->out + off, c->outLen - off);
+	c->outLen -= off;
+
+	// Told when there is room again, only while something is waiting
+	if (c->waitOut != (c->outLen > 0)) {
+		struct epoll_event ev = {.events = EPOLLIN | (c->outLen ? EPOLLOUT : 0), .data.ptr = c};
+
+		c->waitOut = c->outLen > 0;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+}
+
+// Queues bytes to a connection; returns 0 if they did not fit
+int conn_send(Conn* c, const char* data, int len) {
+	if (!c->open || c->outLen + len > OUT_CAP) return 0;
+
+	memcpy(c->out + c->outLen, data, len);
+	c->outLen += len;
+
+	return 1;
+}
+
+// Times the message in a delivered text (if it is one of ours)
+void record(const char* text, int len) {
+	char* mark = memmem(text, len, STAMP_MARK, strlen(STAMP_MARK));
+	if (!mark) return;
+
+	uint64_t stamp = strtoull(mark + strlen(STAMP_MARK), NULL, 10);
+	uint64_t t = now_ns();
+
+	hist[hist_index(t > stamp ? (t - stamp) / 1000 : 0)]++;
+	delivered++;
+	secDelivered++;
+}
+
+// Handles every complete line or frame in the connection's in buffer
+void conn_parse(Conn* c) {
+	int off = 0;
+
+	while (off < c->inLen) {
+		int len;
+
+		if (binary) {
+			ProtoHeader h;
+
+			if (c->inLen - off < PROTO_HEADER_LEN) break;
+			if (proto_get_header(c->in + off, &h) < 0 || h.bodyLen > IN_CAP - PROTO_HEADER_LEN) {
+				conn_close(c);
+				return;
+			}
+
+			len = PROTO_HEADER_LEN + h.bodyLen;
+			if (c->inLen - off < len) break;
+
+			if (h.opcode == PROTO_OP_CHAT) record(c->in + off + PROTO_HEADER_LEN, h.bodyLen);
+		} else {
+			char* end = memchr(c->in + off, '\n', c->inLen - off);
+
+			if (!end) {
+				// A line longer than the buffer is not ours
+				if (off == 0 && c->inLen == IN_CAP) c->inLen = 0;
+				break;
+			}
+
+			len = end - (c->in + off) + 1;
+			record(c->in + off, len);
+		}
+
+		off += len;
+	}
+
+	memmove(c->in, c->in + off, c->inLen - off);
+	c->inLen -= off;
+}
+
+// Reads everything available on a connection
+void conn_read(Conn* c) {
+	while (c->open) {
+		int n = recv(c->fd, c->in + c->inLen, IN_CAP - c->inLen, 0);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if (n <= 0) {
+			conn_close(c);
+			return;
+		}
+
+		c->inLen += n;
+		conn_parse(c);
+	}
+}
+
+// Sends a chat message from connection i, padded to msgSize bytes of text
+void send_chat(int i) {
+	char text[MSG_MAX], msg[MSG_MAX + NICK_LEN + PROTO_HEADER_LEN];
+	Conn* c = &conns[i];
+
+	int len = snprintf(text, sizeof(text), "%s%llu ", STAMP_MARK, (unsigned long long) now_ns());
+
+	while (len < msgSize) text[len++] = 'x';
+	text[len] = '\0';
+
+	if (binary) {
+		int n = proto_put_header(msg, PROTO_OP_CHAT, 0, 0, len);
+
+		memcpy(msg + n, text, len);
+		len += n;
+	} else {
+		len = snprintf(msg, sizeof(msg), "lg%d: %s\n", i, text);
+	}
+
+	// A connection whose socket is full skips its turn
+	if (!conn_send(c, msg, len)) {
+		skipped++;
+		return;
+	}
+
+	sent++;
+	secSent++;
+	expected += members[c->channel] - 1;
+}
+
+// Waits for events up to a deadline, handling them
+void poll_events(uint64_t until) {
+	struct epoll_event events[256];
+
+	while (1) {
+		uint64_t t = now_ns();
+		if (t >= until) return;
+
+		int n = epoll_wait(epfd, events, 256, (until - t) / 1000000);
+
+		for (int i = 0; i < n; i++) {
+			Conn* c = (Conn*) events[i].data.ptr;
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) conn_read(c);
+			if (c->open && (events[i].events & EPOLLOUT)) conn_flush(c);
+		}
+	}
+}
+
+// Opens the connections, sends the nicknames and joins the channels
+void open_conns() {
+	struct sockaddr_in server_addr;
+	int one = 1;
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = inet_addr(IP);
+	server_addr.sin_port = htons(port);
+
+	for (int i = 0; i < nroConns; i++) {
+		Conn* c = &conns[i];
+		char record[NICK_LEN] = {}, line[64];
+
+		c->fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		if (c->fd < 0 || connect(c->fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
+			printf("\nErro: connect (conexão %d).\n", i);
+			// EXIT FAILURE
+			exit(1);
+		}
+
+		// Messages are small and paced: they must not wait for each other
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c->open = 1;
+		c->channel = i % nroChannels;
+		members[c->channel]++;
+
+		record[0] = binary ? PROTO_OPT_BINARY : 0;
+		sprintf(record + binary, "lg%d", i);
+		send(c->fd, record, NICK_LEN, 0);
+
+		if (binary) {
+			int n = sprintf(line + PROTO_HEADER_LEN, "/join #lg%d", c->channel);
+			n += proto_put_header(line, PROTO_OP_COMMAND, 0, 0, n);
+			send(c->fd, line, n, 0);
+		} else {
+			send(c->fd, line, sprintf(line, "lg%d: /join #lg%d\n", i, c->channel), 0);
+		}
+
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+		epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	}
+}
+
+int main(int argc, char* const argv[]) {
+	int opt;
+
+	if (argc > 1 && argv[1][0] != '-') {
+		IP = argv[1];
+		argv++;
+		argc--;
+	}
+
+	while ((opt = getopt(argc, argv, "p:n:m:r:t:s:bh")) != -1) {
+		switch (opt) {
+			case 'p': port = atoi(optarg); break;
+			case 'n': nroConns = atoi(optarg); break;
+			case 'm': nroChannels = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': msgSize = atoi(optarg); break;
+			case 'b': binary = 1; break;
+			default:
+				usage(argv[0]);
+				// EXIT FAILURE
+				return 1;
+		}
+	}
+
+	if (nroConns < 1 || nroChannels < 1 || nroChannels > nroConns || rate < 1 || seconds < 1 ||
+	    msgSize < 32 || msgSize > MSG_MAX - 64) {
+		usage(argv[0]);
+		// EXIT FAILURE
+		return 1;
+	}
+
+	// Thousands of connections need more descriptors than the usual soft limit
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	conns = (Conn*) calloc(nroConns, sizeof(Conn));
+	members = (int*) calloc(nroChannels, sizeof(int));
+	epfd = epoll_create1(0);
+
+	if (!conns || !members || epfd < 0) {
+		printf("\nErro: malloc.\n");
+		// EXIT FAILURE
+		return 1;
+	}
+
+	open_conns();
+
+	// Welcome menus and join notices are read and left aside
+	poll_events(now_ns() + 500000000u);
+
+	printf("%d conexões, %d canais, %d msgs/s por %ds, %d bytes por mensagem\n\n", nroConns, nroChannels, rate, seconds, msgSize);
+
+	uint64_t start = now_ns(), next = start + 1000000000u;
+	int turn = 0;
+
+	// Every millisecond, the messages due since the start go out
+	for (int second = 1; second <= seconds;) {
+		uint64_t t = now_ns();
+		unsigned long due = (unsigned long) ((double) (t - start) * rate / 1e9);
+
+		for (; sent + skipped < due; turn = (turn + 1) % nroConns) send_chat(turn);
+
+		for (int i = 0; i < nroConns; i++)
+			if (conns[i].open && conns[i].outLen) conn_flush(&conns[i]);
+
+		poll_events(t + 1000000);
+
+		if (now_ns() >= next) {
+			printf("t=%2ds  enviadas %lu/s  entregues %lu/s  p99 até agora %lu us\n", second, secSent, secDelivered, percentile(0.99));
+			secSent = secDelivered = 0;
+			next += 1000000000u;
+			second++;
+		}
+	}
+
+	double elapsed = (now_ns() - start) / 1e9;
+
+	// Messages still on the way
+	poll_events(now_ns() + 1000000000u);
+
+	printf("\nenviadas:   %lu (%.0f/s), %lu puladas por socket cheio\n", sent, sent / elapsed, skipped);
+	printf("entregues:  %lu de %lu esperadas (%.0f/s)\n", delivered, expected, delivered / elapsed);
+	printf("conexões fechadas pelo servidor: %lu\n", closed);
+	printf("latência:   p50 %lu us  p99 %lu us  p999 %lu us\n", percentile(0.5), percentile(0.99), percentile(0.999));
+
+	return 0;
+}
@@ -0,0 +1,265 @@
+// === FUNCTIONS RELATED TO SERVER METRICS ===
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "event_loop.h"
+#include "command_table.h"
+
+// Recipients of a channel message
+static const uint64_t fanoutBounds[] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+
+// Nanoseconds, from 50 us to 1 s
+static const uint64_t latencyBounds[] = {
+	50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+	25000000, 50000000, 100000000, 250000000, 500000000, 1000000000
+};
+
+__thread Metrics metrics = {
+	.fanout = {.bounds = fanoutBounds, .nroBounds = sizeof(fanoutBounds) / sizeof(fanoutBounds[0])},
+	.latency = {.bounds = latencyBounds, .nroBounds = sizeof(latencyBounds) / sizeof(latencyBounds[0])},
+};
+
+// Time the read being handled by this thread arrived, 0 if there is none
+static __thread uint64_t inputStamp = 0;
+
+/*  Counted structure:
+the metrics of a registered thread. Threads never exit, so their copies
+stay valid; each one is linked into counted by its own thread. */
+
+typedef struct Counted {
+	Metrics* metrics;
+	SlowStats* slowStats;
+	struct Counted* next;
+} Counted;
+
+static Counted* counted = NULL;
+static pthread_mutex_t countedMutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread Counted thisCounted;
+
+// Adds the current thread's metrics to the rendered ones.
+void metrics_register() {
+	// A thread is only added once
+	if (thisCounted.metrics) return;
+
+	thisCounted.metrics = &metrics;
+	thisCounted.slowStats = &slowStats;
+
+	pthread_mutex_lock(&countedMutex);
+	thisCounted.next = counted;
+	counted = &thisCounted;
+	pthread_mutex_unlock(&countedMutex);
+}
+
+// Counts bytes read from a client and marks the time they arrived.
+void metrics_input_start(int bytes) {
+	if (bytes > 0) metrics.bytesIn += bytes;
+
+	inputStamp = metrics_now();
+}
+
+// Ends the handling of a read.
+void metrics_input_end() {
+	inputStamp = 0;
+}
+
+// Times the messages queued from now on from a read handled by another thread.
+void metrics_input_resume(uint64_t stamp) {
+	inputStamp = stamp;
+}
+
+// Time the read being handled by the current thread arrived.
+uint64_t metrics_stamp() {
+	return inputStamp;
+}
+
+// Adds an observation to a histogram.
+void metrics_observe(Histogram* h, uint64_t value) {
+	int i = 0;
+
+	while (i < h->nroBounds && value > h->bounds[i]) i++;
+
+	h->buckets[i]++;
+	h->count++;
+	h->sum += value;
+}
+
+/*  Render structure:
+a buffer being filled by metrics_render(). */
+
+typedef struct {
+	char* out;
+	size_t cap;
+	size_t len;
+} Render;
+
+// Appends formatted text to the buffer; whatever does not fit is cut.
+static void emit(Render* r, const char* fmt, ...) {
+	va_list args;
+
+	if (r->len + 1 >= r->cap) return;
+
+	va_start(args, fmt);
+	int n = vsnprintf(r->out + r->len, r->cap - r->len, fmt, args);
+	va_end(args);
+
+	if (n > 0) r->len += (size_t) n < r->cap - r->len ? (size_t) n : r->cap - r->len - 1;
+}
+
+// Writes a histogram; scale divides its values (1e9 turns ns into seconds).
+static void emit_histogram(Render* r, const char* name, const char* help, Histogram* h, double scale) {
+	unsigned long cumulative = 0;
+
+	emit(r, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+	for (int i = 0; i < h->nroBounds; i++) {
+		cumulative += h->buckets[i];
+		emit(r, "%s_bucket{le=\"%g\"} %lu\n", name, h->bounds[i] / scale, cumulative);
+	}
+
+	emit(r, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+	emit(r, "%s_sum %g\n%s_count %lu\n", name, h->sum / scale, name, h->count);
+}
+
+// Writes a counter or a gauge.
+static void emit_value(Render* r, const char* name, const char* type, const char* help, unsigned long value) {
+	emit(r, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+// Writes the number of calls of a command (called by command_foreach()).
+static void emit_command(const char* name, unsigned long calls, void* arg) {
+	emit((Render*) arg, "irc_commands_total{command=\"%s\"} %lu\n", name, calls);
+}
+
+// Adds a histogram to another one with the same bounds.
+static void add_histogram(Histogram* sum, const Histogram* h) {
+	for (int i = 0; i <= h->nroBounds; i++) sum->buckets[i] += h->buckets[i];
+
+	sum->count += h->count;
+	sum->sum += h->sum;
+}
+
+// Writes every metric in the Prometheus text format.
+size_t metrics_render(char* out, size_t cap) {
+	Render r = {out, cap, 0};
+	Metrics total = {
+		.fanout = {.bounds = fanoutBounds, .nroBounds = sizeof(fanoutBounds) / sizeof(fanoutBounds[0])},
+		.latency = {.bounds = latencyBounds, .nroBounds = sizeof(latencyBounds) / sizeof(latencyBounds[0])},
+	};
+	SlowStats slow = {0, 0, 0};
+
+	pthread_mutex_lock(&countedMutex);
+
+	for (Counted* c = counted; c; c = c->next) {
+		total.messagesIn += c->metrics->messagesIn;
+		total.messagesOut += c->metrics->messagesOut;
+		total.bytesIn += c->metrics->bytesIn;
+		total.bytesOut += c->metrics->bytesOut;
+		total.linkBytesOut += c->metrics->linkBytesOut;
+		add_histogram(&total.fanout, &c->metrics->fanout);
+		add_histogram(&total.latency, &c->metrics->latency);
+
+		slow.drops += c->slowStats->drops;
+		slow.dropBytes += c->slowStats->dropBytes;
+		slow.evictions += c->slowStats->evictions;
+	}
+
+	pthread_mutex_unlock(&countedMutex);
+
+	emit_value(&r, "irc_clients", "gauge", "Connected clients.", cliCount);
+	emit_value(&r, "irc_messages_received_total", "counter", "Lines and frames read from clients.", total.messagesIn);
+	emit_value(&r, "irc_messages_sent_total", "counter", "Messages queued to clients.", total.messagesOut);
+	emit_value(&r, "irc_received_bytes_total", "counter", "Bytes read from clients.", total.bytesIn);
+	emit_value(&r, "irc_sent_bytes_total", "counter", "Bytes written to clients.", total.bytesOut);
+	emit_value(&r, "irc_link_sent_bytes_total", "counter", "Bytes written to other servers.", total.linkBytesOut);
+
+	emit(&r, "# HELP irc_commands_total Commands run, by name.\n# TYPE irc_commands_total counter\n");
+	command_foreach(emit_command, &r);
+
+	emit_histogram(&r, "irc_fanout", "Recipients of each channel message.", &total.fanout, 1);
+	emit_histogram(&r, "irc_delivery_latency_seconds", "Time from reading a message to writing it to a client.",
+	               &total.latency, 1e9);
+
+	emit_value(&r, "irc_slow_drops_total", "counter", "Times a slow client lost queued messages (-d).", slow.drops);
+	emit_value(&r, "irc_slow_dropped_bytes_total", "counter", "Bytes slow clients lost (-d).", slow.dropBytes);
+	emit_value(&r, "irc_slow_evictions_total", "counter", "Clients disconnected for going over -q.", slow.evictions);
+
+	return r.len;
+}
+
+// Writes the whole buffer to a blocking socket.
+static void write_all(int fd, const char* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+
+		data += n;
+		len -= n;
+	}
+}
+
+/* Answers every connection to the metrics socket. The request, if any, is
+only looked at to tell HTTP from a bare connection. */
+static void* serve_metrics(void* arg) {
+	int listenfd = (int) (long) arg;
+	static char out[METRICS_OUT_MAX];
+	char request[512];
+	char head[128];
+
+	while (1) {
+		int fd = accept(listenfd, NULL, NULL);
+
+		if (fd < 0) continue;
+
+		// A bare connection (e.g. nc -U) sends nothing
+		struct pollfd pfd = {fd, POLLIN, 0};
+		ssize_t n = poll(&pfd, 1, 100) > 0 ? read(fd, request, sizeof(request)) : 0;
+		int http = n >= 4 && strncmp(request, "GET ", 4) == 0;
+
+		pthread_rwlock_rdlock(&clients_lock);
+		size_t len = metrics_render(out, sizeof(out));
+		pthread_rwlock_unlock(&clients_lock);
+
+		if (http) {
+			int headLen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			                       "Content-Length: %zu\r\n\r\n", len);
+			write_all(fd, head, headLen);
+		}
+
+		write_all(fd, out, len);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+// Serves the metrics on a Unix socket.
+int metrics_start(const char* path) {
+	struct sockaddr_un addr;
+	pthread_t tid;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+
+	// A socket left by a previous run is replaced
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+	    pthread_create(&tid, NULL, serve_metrics, (void*) (long) fd) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_detach(tid);
+
+	return 0;
+}
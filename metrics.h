@@ -0,0 +1,121 @@
+// === FUNCTIONS RELATED TO SERVER METRICS ===
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Most buckets a histogram may have, not counting +Inf
+#define METRICS_MAX_BUCKETS 16
+
+// Size of the buffer the metrics are written to when they are scraped
+#define METRICS_OUT_MAX 16384
+
+/*  Histogram structure:
+number of observations up to each of its nroBounds bounds (buckets, not
+cumulative; the last one is above every bound), how many there were in
+total (count) and their sum. */
+
+typedef struct {
+	const uint64_t* bounds;
+	int nroBounds;
+	unsigned long buckets[METRICS_MAX_BUCKETS + 1];
+	unsigned long count;
+	uint64_t sum;
+} Histogram;
+
+/*  Metrics structure:
+the server's counters. Messages in are the lines and frames read from
+clients; messages out are the ones queued to clients, and bytes out the
+ones the sockets took (linkBytesOut, the ones written to other servers).
+fanout is the number of recipients of each channel message; latency is the
+time from the read that produced a message to the write that finished
+sending it to a client, in nanoseconds (messages that share a queue slot
+are timed once, from the oldest one). */
+
+typedef struct {
+	unsigned long messagesIn;
+	unsigned long messagesOut;
+	unsigned long bytesIn;
+	unsigned long bytesOut;
+	unsigned long linkBytesOut;
+	Histogram fanout;
+	Histogram latency;
+} Metrics;
+
+/* Each thread counts in its own copy, so workers never write to the same
+counters; metrics_render() adds up the copies of the registered threads. */
+extern __thread Metrics metrics;
+
+/* Current time of the monotonic clock.
+
+	RETURN
+	uint64_t - nanoseconds */
+static inline uint64_t metrics_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Adds the current thread's metrics (and slow-consumer counters) to the
+ones metrics_render() writes; called once by every thread that counts.
+Calling it again does nothing. */
+void metrics_register();
+
+/* Counts bytes read from a client and marks the time they arrived: every
+message queued until metrics_input_end() is timed from it.
+
+	PARAMETERS
+	int bytes - number of bytes read */
+void metrics_input_start(int bytes);
+
+/* Ends the handling of a read: messages queued after it are not timed. */
+void metrics_input_end();
+
+/* Times the messages queued from now on from a read handled by another
+thread, e.g. for messages left in a worker's inbox.
+
+	PARAMETERS
+	uint64_t stamp - that thread's metrics_stamp(), 0 for none */
+void metrics_input_resume(uint64_t stamp);
+
+/* Time the read being handled by the current thread arrived.
+
+	RETURN
+	uint64_t - nanoseconds, 0 outside of metrics_input_start()/end() */
+uint64_t metrics_stamp();
+
+/* Adds an observation to a histogram of the current thread.
+
+	PARAMETERS
+	Histogram* h   - metrics.fanout or metrics.latency
+	uint64_t value - observed value */
+void metrics_observe(Histogram* h, uint64_t value);
+
+/* Writes every metric in the Prometheus text format. The other threads'
+counters are read as they go, so a counter may be a few messages behind.
+Must be called with clients_lock held, shared or exclusively (for the
+command counts).
+
+	PARAMETERS
+	char* out  - buffer
+	size_t cap - size of the buffer
+
+	RETURN
+	size_t - number of bytes written */
+size_t metrics_render(char* out, size_t cap);
+
+/* Serves the metrics on a Unix socket: each connection gets them once and
+is closed. An HTTP GET is answered as HTTP, so Prometheus (or curl
+--unix-socket) can scrape it; anything else gets the bare text.
+
+	PARAMETERS
+	const char* path - path of the socket
+
+	RETURN
+	int - 0 on success, -1 on error */
+int metrics_start(const char* path);
+
+#endif
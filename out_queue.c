@@ -0,0 +1,307 @@
+// === FUNCTIONS RELATED TO OUTBOUND QUEUES ===
+#include "out_queue.h"
+#include "metrics.h"
+
+// Creates a payload with room for cap bytes, holding a copy of data (if any).
+static Payload* payload_alloc(const char* data, size_t len, size_t cap) {
+	Payload* p = (Payload*) malloc(sizeof(Payload) + cap);
+	if (!p) return NULL;
+
+	if (len) memcpy(p->data, data, len);
+	p->len = len;
+	p->cap = cap;
+	p->refs = 1;
+
+	return p;
+}
+
+// Creates a payload holding a copy of data, with one reference.
+Payload* payload_create(const char* data, size_t len) {
+	return payload_alloc(data, len, len);
+}
+
+// Takes one more reference to a payload.
+void payload_ref(Payload* p) {
+	p->refs++;
+}
+
+// Releases one reference to a payload.
+void payload_unref(Payload* p) {
+	if (--p->refs == 0) free(p);
+}
+
+// Initializes an empty queue.
+void queue_init(OutQueue* q) {
+	q->slots = NULL;
+	q->cap = 0;
+	q->head = 0;
+	q->count = 0;
+	q->compressed = 0;
+	q->link = 0;
+	q->bytes = 0;
+}
+
+// Doubles the ring, unrolling it so that head goes back to 0.
+static int queue_grow(OutQueue* q) {
+	int cap = q->cap ? q->cap * 2 : QUEUE_INIT_SLOTS;
+
+	OutSlot* slots = (OutSlot*) malloc(cap * sizeof(OutSlot));
+	if (!slots) return -1;
+
+	for (int i = 0; i < q->count; i++)
+		slots[i] = q->slots[(q->head + i) % q->cap];
+
+	free(q->slots);
+	q->slots = slots;
+	q->cap = cap;
+	q->head = 0;
+
+	return 0;
+}
+
+// Adds a payload to the end of the queue.
+int queue_push_payload(OutQueue* q, Payload* p) {
+	if (q->count == q->cap && queue_grow(q) < 0) return -1;
+
+	OutSlot* slot = &q->slots[(q->head + q->count) % q->cap];
+
+	payload_ref(p);
+	slot->payload = p;
+	slot->off = 0;
+	slot->cont = 0;
+	slot->stamp = q->link ? 0 : metrics_stamp();
+
+	q->count++;
+	q->bytes += p->len;
+
+	return 0;
+}
+
+// Copies data to the end of the queue.
+int queue_push(OutQueue* q, const char* data, size_t len) {
+	// Compressed data cannot take plain text after it
+	if (q->count > q->compressed) {
+		Payload* last = q->slots[(q->head + q->count - 1) % q->cap].payload;
+
+		/* Nobody else can see the last payload, and a send in flight only
+		 covers the bytes it had when it started */
+		if (last->refs == 1 && last->cap - last->len >= len) {
+			memcpy(last->data + last->len, data, len);
+			last->len += len;
+			q->bytes += len;
+
+			return 0;
+		}
+	}
+
+	Payload* p = payload_alloc(data, len, len < QUEUE_COALESCE_BYTES ? QUEUE_COALESCE_BYTES : len);
+	if (!p) return -1;
+
+	int err = queue_push_payload(q, p);
+	payload_unref(p);
+
+	return err;
+}
+
+// Releases the first slot of the queue.
+static void queue_pop(OutQueue* q) {
+	payload_unref(q->slots[q->head].payload);
+
+	q->head = (q->head + 1) % q->cap;
+	q->count--;
+
+	if (q->compressed > 0) q->compressed--;
+}
+
+// Marks the slots from first to the end of the queue as the rest of a message.
+void queue_join(OutQueue* q, int first) {
+	for (int i = first; i < q->count; i++)
+		q->slots[(q->head + i) % q->cap].cont = 1;
+}
+
+// Drops the oldest whole messages until at least need bytes were freed.
+size_t queue_drop(OutQueue* q, int keep, size_t need) {
+	size_t freed = 0;
+
+	if (keep < q->compressed) keep = q->compressed;
+	if (keep == 0 && q->count > 0 && q->slots[q->head].off > 0) keep = 1;
+
+	// The rest of a message that stays must stay as well
+	int first = keep;
+	while (first < q->count && q->slots[(q->head + first) % q->cap].cont) first++;
+
+	int last = first;
+	while (last < q->count && freed < need) {
+		do {
+			OutSlot* slot = &q->slots[(q->head + last) % q->cap];
+
+			freed += slot->payload->len;
+			payload_unref(slot->payload);
+			last++;
+		} while (last < q->count && q->slots[(q->head + last) % q->cap].cont);
+	}
+
+	// The newer slots move up to fill the gap
+	for (int i = last; i < q->count; i++)
+		q->slots[(q->head + first + i - last) % q->cap] = q->slots[(q->head + i) % q->cap];
+
+	q->count -= last - first;
+	q->bytes -= freed;
+
+	return freed;
+}
+
+// Compresses every slot added since the last call into a single payload.
+int queue_compress(OutQueue* q, z_stream* z) {
+	size_t in = 0;
+	uint64_t stamp = 0;
+
+	if (q->count == q->compressed) return 0;
+
+	for (int i = q->compressed; i < q->count; i++) {
+		OutSlot* slot = &q->slots[(q->head + i) % q->cap];
+
+		in += slot->payload->len;
+		if (slot->stamp && (!stamp || slot->stamp < stamp)) stamp = slot->stamp;
+	}
+
+	// A sync flush adds a few bytes to what a whole stream could take
+	size_t cap = deflateBound(z, in) + 16;
+
+	Payload* p = payload_alloc(NULL, 0, cap);
+	if (!p) return -1;
+
+	z->next_out = (Bytef*) p->data;
+	z->avail_out = cap;
+
+	for (int i = q->compressed; i < q->count; i++) {
+		Payload* slot = q->slots[(q->head + i) % q->cap].payload;
+
+		z->next_in = (Bytef*) slot->data;
+		z->avail_in = slot->len;
+
+		if (deflate(z, Z_NO_FLUSH) != Z_OK || z->avail_in != 0) {
+			payload_unref(p);
+			return -1;
+		}
+	}
+
+	if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_out == 0) {
+		payload_unref(p);
+		return -1;
+	}
+
+	p->len = cap - z->avail_out;
+
+	// The plain slots (never written yet) are replaced by the compressed one
+	while (q->count > q->compressed) {
+		q->count--;
+		payload_unref(q->slots[(q->head + q->count) % q->cap].payload);
+	}
+
+	q->bytes -= in;
+
+	int err = queue_push_payload(q, p);
+	payload_unref(p);
+
+	// Timed from the oldest message that went into it
+	if (!err) q->slots[(q->head + q->count - 1) % q->cap].stamp = stamp;
+
+	q->compressed = q->count;
+
+	return err;
+}
+
+// Points iov at the data waiting in the first slots of the queue.
+int queue_iov(OutQueue* q, struct iovec* iov, int max) {
+	int n = q->count < max ? q->count : max;
+
+	for (int i = 0; i < n; i++) {
+		OutSlot* slot = &q->slots[(q->head + i) % q->cap];
+
+		iov[i].iov_base = slot->payload->data + slot->off;
+		iov[i].iov_len = slot->payload->len - slot->off;
+	}
+
+	return n;
+}
+
+// Takes data already written from the front of the queue.
+void queue_consume(OutQueue* q, size_t sent) {
+	uint64_t now = 0;
+
+	q->bytes -= sent;
+
+	if (q->link) metrics.linkBytesOut += sent;
+	else metrics.bytesOut += sent;
+
+	// Releases every payload written completely
+	while (sent > 0) {
+		OutSlot* slot = &q->slots[q->head];
+		size_t rest = slot->payload->len - slot->off;
+
+		if (sent < rest) {
+			slot->off += sent;
+			break;
+		}
+
+		sent -= rest;
+
+		if (slot->stamp) {
+			if (!now) now = metrics_now();
+			metrics_observe(&metrics.latency, now - slot->stamp);
+		}
+
+		queue_pop(q);
+	}
+}
+
+// Writes queued data to a non-blocking socket with writev().
+int queue_write(OutQueue* q, int fd) {
+	struct iovec iov[QUEUE_IOV];
+
+	while (q->count > 0) {
+		int n = queue_iov(q, iov, QUEUE_IOV);
+
+		ssize_t sent = writev(fd, iov, n);
+
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+
+			// The socket is full: the rest goes out on the next EPOLLOUT
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+			return -1;
+		}
+
+		queue_consume(q, sent);
+	}
+
+	return 0;
+}
+
+// Drops everything still queued and releases the slots.
+void queue_clear(OutQueue* q) {
+	int link = q->link;
+
+	while (q->count > 0) queue_pop(q);
+
+	free(q->slots);
+	queue_init(q);
+
+	q->link = link;
+}
+
+// Drops everything still queued but keeps the slots.
+void queue_reset(OutQueue* q) {
+	if (q->cap > QUEUE_KEEP_SLOTS) {
+		queue_clear(q);
+		return;
+	}
+
+	while (q->count > 0) queue_pop(q);
+
+	q->head = 0;
+	q->compressed = 0;
+	q->bytes = 0;
+}
@@ -0,0 +1,197 @@
+// === FUNCTIONS RELATED TO OUTBOUND QUEUES ===
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+// Initial number of slots of a queue; it doubles when it fills up
+#define QUEUE_INIT_SLOTS 8
+
+// A queue that grew past this many slots gives them back on queue_reset()
+#define QUEUE_KEEP_SLOTS 64
+
+/* Small messages queued with queue_push() go into a payload with room for
+at least this many bytes, so the next ones can be appended to it */
+#define QUEUE_COALESCE_BYTES 1024
+
+// Maximum number of slots written by a single writev() call
+#define QUEUE_IOV 64
+
+/*  Payload structure:
+a message shared by every queue it was pushed to. It is freed when the
+last queue releases it. Only a payload held by a single queue may grow,
+by appending to it up to cap bytes. */
+
+typedef struct {
+	_Atomic int refs;
+	size_t len;
+	size_t cap;
+	char data[];
+} Payload;
+
+/*  OutSlot structure:
+a payload waiting in a queue; off is how much of it was already written
+to this queue's socket. cont is set when the slot carries the rest of the
+message that starts in the slot before it. stamp is the time the read that
+produced its first message arrived (metrics_stamp()), 0 if not timed. */
+
+typedef struct {
+	Payload* payload;
+	size_t off;
+	int cont;
+	uint64_t stamp;
+} OutSlot;
+
+/*  OutQueue structure:
+ring of slots waiting for the socket to become writable; bytes is the
+amount not written yet. On a compressed connection, the first compressed
+slots already went through queue_compress(). link is set on a queue to
+another server (federation.c): its slots are not timed and its bytes are
+counted apart from the clients' ones. */
+
+typedef struct {
+	OutSlot* slots;
+	int cap;
+	int head;
+	int count;
+	int compressed;
+	int link;
+	size_t bytes;
+} OutQueue;
+
+/* Creates a payload holding a copy of data, with one reference.
+
+	PARAMETERS
+	const char* data - message
+	size_t len 		 - message length
+
+	RETURN
+	Payload* - new payload, NULL on allocation failure */
+Payload* payload_create(const char* data, size_t len);
+
+/* Takes one more reference to a payload.
+
+	PARAMETERS
+	Payload* p - payload */
+void payload_ref(Payload* p);
+
+/* Releases one reference to a payload, freeing it after the last one.
+
+	PARAMETERS
+	Payload* p - payload */
+void payload_unref(Payload* p);
+
+/* Initializes an empty queue.
+
+	PARAMETERS
+	OutQueue* q - queue */
+void queue_init(OutQueue* q);
+
+/* Adds a payload to the end of the queue, taking a reference to it.
+
+	PARAMETERS
+	OutQueue* q - queue
+	Payload* p  - payload
+
+	RETURN
+	int - 0 on success, -1 on allocation failure */
+int queue_push_payload(OutQueue* q, Payload* p);
+
+/* Copies data to the end of the queue. If the last payload belongs to this
+queue alone and has room for it, data is appended to that payload, so a
+burst of small replies takes a single slot.
+
+	PARAMETERS
+	OutQueue* q 	 - queue
+	const char* data - bytes to be queued
+	size_t len 		 - number of bytes
+
+	RETURN
+	int - 0 on success, -1 on allocation failure */
+int queue_push(OutQueue* q, const char* data, size_t len);
+
+/* Marks the slots from first to the end of the queue as the rest of the
+message that starts before them, so queue_drop() never splits it.
+
+	PARAMETERS
+	OutQueue* q - queue
+	int first 	- index (from the front of the queue) of the first slot */
+void queue_join(OutQueue* q, int first);
+
+/* Drops the oldest whole messages until at least need bytes were freed.
+The first keep slots stay, and so do a slot already partly written and the
+slots already compressed: taking them out would corrupt the stream.
+
+	PARAMETERS
+	OutQueue* q - queue
+	int keep 	- number of slots at the front that must stay
+	size_t need - number of bytes to free
+
+	RETURN
+	size_t - bytes freed, less than need if not enough could be dropped */
+size_t queue_drop(OutQueue* q, int keep, size_t need);
+
+/* Compresses every slot added since the last call into a single payload,
+ending it with a sync flush so the peer can decompress all of it at once.
+The slots already compressed (and maybe being written) are not touched.
+
+	PARAMETERS
+	OutQueue* q - queue
+	z_stream* z - the connection's deflate stream
+
+	RETURN
+	int - 0 on success, -1 on error */
+int queue_compress(OutQueue* q, z_stream* z);
+
+/* Points iov at the data waiting in the first slots of the queue, without
+taking it out; the payloads stay valid until queue_consume() releases them.
+
+	PARAMETERS
+	OutQueue* q 	  - queue
+	struct iovec* iov - array with room for max entries
+	int max 		  - maximum number of slots
+
+	RETURN
+	int - number of entries filled */
+int queue_iov(OutQueue* q, struct iovec* iov, int max);
+
+/* Takes data already written from the front of the queue, releasing every
+payload written completely; it counts them in the server metrics.
+
+	PARAMETERS
+	OutQueue* q - queue
+	size_t sent - number of bytes written */
+void queue_consume(OutQueue* q, size_t sent);
+
+/* Writes queued data to a non-blocking socket with writev() until the
+queue is empty or the socket is full.
+
+	PARAMETERS
+	OutQueue* q - queue
+	int fd 		- socket file descriptor
+
+	RETURN
+	int - 0 on success, -1 if the connection is broken */
+int queue_write(OutQueue* q, int fd);
+
+/* Drops everything still queued and releases the slots.
+
+	PARAMETERS
+	OutQueue* q - queue */
+void queue_clear(OutQueue* q);
+
+/* Drops everything still queued but keeps the slots, so the queue can be
+reused without allocating; only a queue larger than QUEUE_KEEP_SLOTS
+releases them.
+
+	PARAMETERS
+	OutQueue* q - queue */
+void queue_reset(OutQueue* q);
+
+#endif
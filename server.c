@@ -3,10 +3,21 @@
 	- Bind the socket to an address using bind();
 	- Listen for connections with listen();
 	- Accept a connection with accept();
-	- Send and receive data, using read() and write() system calls. */
+	- Send and receive data, using read() and write() system calls.
+
+	Connections are served by epoll event loops (event_loop.c), or io_uring
+	loops (uring_loop.c) with -u, instead of a thread per client; each
+	worker owns one loop and one listener. */
 
 #include "string_manipulation.h"
 #include "server_operation.h"
+#include "event_loop.h"
+#include "server_config.h"
+#include "client_pool.h"
+#include "uring_loop.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "federation.h"
 
 // /* Atomic objects are the only objects that are free from data races,
 //  that is, they may be modified by two threads concurrently or
@@ -14,17 +25,12 @@
 // static _Atomic unsigned int cliCount = 0;
 // static int userID = 0;
 
-int main(int argc, char* const argv[]) {
-
-	char* IP = "0.0.0.0";
-	int port = 8192;
-
+/* Creates a listening socket. Every worker has its own one: with
+ SO_REUSEPORT the kernel spreads incoming connections among them. */
+static int create_listener() {
 	int option = 1;
-	int listenfd = 0, connfd = 0;
-	struct sockaddr_in server_addr, client_addr;
-	pthread_t tid;
-
-	initialize_channel_list();
+	int listenfd = 0;
+	struct sockaddr_in server_addr;
 
 	/* -------------------------- Socket settings --------------------------
 
@@ -36,22 +42,19 @@ int main(int argc, char* const argv[]) {
 
 	// IP and port are binded and a connection will be opened based on both.
 	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr.s_addr = inet_addr(IP);
-	server_addr.sin_port = htons(port);
-
-	/* Pipe signals are software generated interrupts.
-	  SIGPIPE is sent to a process when it attempts to write to a pipe
-	 whose read end is closed; SIG_IGN sets SIGPIPE signal to be ignored. */
-	signal(SIGPIPE, SIG_IGN);
+	server_addr.sin_addr.s_addr = inet_addr(config.IP);
+	server_addr.sin_port = htons(config.port);
 
 	/* This helps manipulating options for the socket referred by the
-	 descriptor sockfd; it also prevents errors. */
-   if (setsockopt(listenfd, SOL_SOCKET, (SO_REUSEPORT | SO_REUSEADDR), (char*) &option, sizeof(option)) < 0) {
-       printf("\nErro: setsockopt.\n");
+	 descriptor sockfd; it also prevents errors. Each option has to be
+	 set on its own: OR-ing the names would set a single, different one. */
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (char*) &option, sizeof(option)) < 0 ||
+	    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (char*) &option, sizeof(option)) < 0) {
+		printf("\nErro: setsockopt.\n");
 
-       // EXIT FAILURE;
-       exit(1);
-   }
+		// EXIT FAILURE;
+		exit(1);
+	}
 
 	/* After creating the socket, the bind() function binds the
 	 socket to the address and the port number specified in addr. */
@@ -64,13 +67,97 @@ int main(int argc, char* const argv[]) {
 
 	/* The listen() function puts the server socket in a passsive mode,
 	 where it waits for a client's approach to make a connection. */
-	if (listen(listenfd, 10) < 0){
+	if (listen(listenfd, SOMAXCONN) < 0){
 		printf("\nErro: listen.\n");
 
 		// EXIT FAILURE
 		exit(1);
 	}
 
+	// The event loop must never block on accept()
+	if (set_nonblocking(listenfd) < 0) {
+		printf("\nErro: fcntl.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	return listenfd;
+}
+
+int main(int argc, char* const argv[]) {
+
+	parse_config(argc, argv);
+
+	// Clients are preallocated, so accepting a connection does not allocate
+	if (client_pool_init() < 0) {
+		printf("\nErro: malloc.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	// Before #all is created, which opens its log
+	if (config.logDir && channel_log_start() < 0) {
+		printf("\nErro: diretório de logs.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	initialize_channel_list();
+	initialize_commands();
+
+	if (config.metricsPath && metrics_start(config.metricsPath) < 0) {
+		printf("\nErro: socket de métricas.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	/* Pipe signals are software generated interrupts.
+	  SIGPIPE is sent to a process when it attempts to write to a pipe
+	 whose read end is closed; SIG_IGN sets SIGPIPE signal to be ignored. */
+	signal(SIGPIPE, SIG_IGN);
+
+	// A server already running (-R) hands over its clients, channels and listeners
+	int taken = config.handoffPath ? handoff_take(config.handoffPath) : 0;
+
+	if (taken < 0) {
+		printf("\nErro: handoff.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	// Every listener is bound before any worker starts, so errors show up early
+	for (int i = 0; i < config.workers; i++) {
+		if (worker_init(&workers[i], i) < 0) {
+			printf("\nErro: eventfd.\n");
+
+			// EXIT FAILURE
+			exit(1);
+		}
+
+		if (i >= taken) workers[i].listenfd = create_listener();
+	}
+
+	// ... and this one waits for the server that will replace it
+	if (config.handoffPath && handoff_listen(config.handoffPath) < 0) {
+		printf("\nErro: socket de handoff.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	// Links to other servers (-l, -S) start with the clients already in place
+	if (federation_start() < 0) {
+		printf("\nErro: ligação entre servidores.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
 	// --------------------------------------- The Chatroom ----------------------------------
 	// If there has been no errors so far, the chat server will be available.
 
@@ -92,32 +179,22 @@ int main(int argc, char* const argv[]) {
 	printf("\n ______________________________________________________________________________ \n\n\n");
 	printf("\033[0m");
 
-	/*  "Infinite loop": responsible for communicating, receiving messages
-	 from a client and sending them to everyone else. */
-	while (1) {
-
-		socklen_t cliLen = sizeof(client_addr);
+	// Workers run epoll loops unless io_uring was asked for (-u)
+	void* (*run_loop)(void*) = config.useUring ? &run_uring_loop : &run_event_loop;
 
-		/* Responsible for extracting the first connection request on the
-		 queue of pending connections, creating a new connected socket
-		 and returning a new file descriptor referring to that socket. */
-		connfd = accept(listenfd, (struct sockaddr*) &client_addr, &cliLen);
+	/*  "Infinite loop": each worker accepts clients, receives messages
+	 from them and sends them to everyone else. The main thread is worker 0. */
+	for (int i = 1; i < config.workers; i++) {
+		if (pthread_create(&workers[i].tid, NULL, run_loop, (void*) &workers[i]) != 0) {
+			printf("\nErro: pthread.\n");
 
-		is_server_full(connfd);
-
-		// -------------------- Client Management --------------------
-		/* Defines client settings, adds it to the queue,
-		creates a thread and a new function to handle client. */
-		Client* cli = (Client*) malloc(sizeof(Client));
-		create_client(client_addr, connfd, cli);
-
-		// Starts a new thread in the calling process
-		pthread_create(&tid, NULL, &handle_client, (void*) cli);
-
-		// Reducing CPU usage
-		sleep(1);
+			// EXIT FAILURE
+			exit(1);
+		}
 	}
 
+	run_loop(&workers[0]);
+
 	// EXIT SUCCESS
 	return 0;
 }
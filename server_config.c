@@ -0,0 +1,124 @@
+// === SERVER SETTINGS ===
+#include "server_config.h"
+
+ServerConfig config = {
+	.IP = "0.0.0.0",
+	.port = DEFAULT_PORT,
+	.workers = DEFAULT_WORKERS,
+	.maxClients = DEFAULT_MAX_CLIENTS,
+	.maxChannels = DEFAULT_MAX_CHANNELS,
+	.maxQueueBytes = DEFAULT_QUEUE_BYTES,
+	.poolClients = DEFAULT_POOL_CLIENTS,
+	.historyLines = DEFAULT_HISTORY_LINES,
+	.historyBytes = DEFAULT_HISTORY_BYTES,
+	.logSyncMs = DEFAULT_LOG_SYNC_MS,
+};
+
+// Shows how to run the server.
+static void usage(char* name) {
+	printf("Uso: %s [-p porta] [-w workers] [-c clientes] [-C canais] [-q bytes] [-P clientes] [-u] [-d] [-m socket] [-H linhas] [-B bytes] [-L diretório] [-D ms] [-R socket] [-N nome] [-l porta] [-S ip:porta]... [-v]\n", name);
+	printf("\t-w 0 inicia um worker por núcleo (máximo %d).\n", MAX_WORKERS);
+	printf("\t-u usa io_uring em vez de epoll, se o kernel permitir.\n");
+	printf("\t-d descarta as mensagens mais antigas de um cliente lento, em vez de desconectá-lo.\n");
+	printf("\t-H e -B limitam o histórico de cada canal, mostrado a quem entra nele (-H 0 desativa).\n");
+	printf("\t-L grava as mensagens de cada canal no diretório indicado; -D é o tempo máximo, em ms, até\n\t   elas irem para o disco (padrão %d; -D 0 grava cada mensagem antes de seguir).\n", DEFAULT_LOG_SYNC_MS);
+	printf("\t-R assume os clientes do servidor que espera no socket Unix indicado, se houver, e espera nele\n\t   pelo próximo (atualização sem desconectar ninguém; não funciona com -u).\n");
+	printf("\t-N dá nome a este servidor; -l aceita ligações de outros servidores na porta indicada e -S\n\t   liga este ao servidor em ip:porta (até %d vezes). As ligações devem formar uma árvore.\n", MAX_PEERS);
+	printf("\t-v mostra no terminal cada mensagem e aviso (só para depuração: deixa o servidor mais lento).\n");
+	printf("\t-m publica as métricas (formato do Prometheus) no socket Unix indicado.\n");
+}
+
+// Reads the server settings from the command line.
+void parse_config(int argc, char* const argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:w:c:C:q:P:udm:H:B:L:D:R:N:l:S:vh")) != -1) {
+		switch (opt) {
+			case 'p':
+				config.port = atoi(optarg);
+				break;
+			case 'w':
+				config.workers = atoi(optarg);
+				break;
+			case 'c':
+				config.maxClients = atoi(optarg);
+				break;
+			case 'C':
+				config.maxChannels = atoi(optarg);
+				break;
+			case 'q':
+				config.maxQueueBytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+				config.poolClients = atoi(optarg);
+				break;
+			case 'u':
+				config.useUring = 1;
+				break;
+			case 'd':
+				config.dropOldest = 1;
+				break;
+			case 'm':
+				config.metricsPath = optarg;
+				break;
+			case 'H':
+				config.historyLines = atoi(optarg);
+				break;
+			case 'B':
+				config.historyBytes = atoi(optarg);
+				break;
+			case 'L':
+				config.logDir = optarg;
+				break;
+			case 'D':
+				config.logSyncMs = atoi(optarg);
+				break;
+			case 'R':
+				config.handoffPath = optarg;
+				break;
+			case 'N':
+				config.nodeName = optarg;
+				break;
+			case 'l':
+				config.linkPort = atoi(optarg);
+				break;
+			case 'v':
+				config.verbose = 1;
+				break;
+			case 'S':
+				if (config.nroPeers == MAX_PEERS) {
+					usage(argv[0]);
+
+					// EXIT FAILURE
+					exit(1);
+				}
+
+				config.peers[config.nroPeers++] = optarg;
+				break;
+			default:
+				usage(argv[0]);
+
+				// EXIT FAILURE
+				exit(1);
+		}
+	}
+
+	if (config.workers == 0)
+		config.workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	// There is no point in preallocating more clients than can connect
+	if (config.poolClients > config.maxClients)
+		config.poolClients = config.maxClients;
+
+	if (config.workers < 1 || config.workers > MAX_WORKERS ||
+	    config.port <= 0 || config.maxClients < 1 || config.maxChannels < 1 ||
+	    config.maxQueueBytes < MIN_QUEUE_BYTES || config.poolClients < 1 ||
+	    config.historyLines < 0 || config.historyBytes < 0 || config.logSyncMs < 0 ||
+	    config.linkPort < 0 ||
+	    (config.handoffPath && config.useUring)) {
+		usage(argv[0]);
+
+		// EXIT FAILURE
+		exit(1);
+	}
+}
@@ -0,0 +1,77 @@
+// === SERVER SETTINGS ===
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 8192
+#define DEFAULT_WORKERS 1
+#define MAX_WORKERS 64
+#define DEFAULT_MAX_CLIENTS 1024
+#define DEFAULT_MAX_CHANNELS 4096
+#define DEFAULT_QUEUE_BYTES (256 * 1024)
+#define MIN_QUEUE_BYTES 8192
+#define DEFAULT_POOL_CLIENTS 256
+#define DEFAULT_HISTORY_LINES 50
+#define DEFAULT_HISTORY_BYTES 8192
+#define DEFAULT_LOG_SYNC_MS 100
+#define MAX_PEERS 16
+
+/*  ServerConfig structure:
+stores the settings given on the command line. */
+
+typedef struct {
+	char* IP;
+	int port;
+	int workers;
+	int maxClients;
+	int maxChannels;
+	size_t maxQueueBytes;
+	int poolClients;
+	int useUring;
+	int dropOldest;
+	char* metricsPath;
+	int historyLines;
+	int historyBytes;
+	char* logDir;
+	int logSyncMs;
+	char* handoffPath;
+	char* nodeName;
+	int linkPort;
+	char* peers[MAX_PEERS];
+	int nroPeers;
+	int verbose;
+} ServerConfig;
+
+extern ServerConfig config;
+
+/* Reads the server settings from the command line.
+	-p <port>    - listening port
+	-w <workers> - number of event loop workers (0 = one per core)
+	-c <clients> - maximum number of connected clients
+	-C <channels> - maximum number of channels
+	-q <bytes>   - maximum bytes queued to a client before it is dropped
+	-P <clients> - clients preallocated at startup (and per extra slab)
+	-u 			 - serve clients with io_uring instead of epoll
+	-d 			 - a client over -q loses its oldest queued messages
+				   instead of being disconnected
+	-m <path>    - serve the metrics (metrics.h) on a Unix socket
+	-H <lines>   - chat messages kept per channel and shown on /join (0 = none)
+	-B <bytes>   - bytes of chat kept per channel
+	-L <dir>     - keep every channel's chat in a log (channel_log.h) under dir
+	-D <ms> 	 - longest time a logged message may wait to be synced (0 = none)
+	-R <path>    - take over from the server waiting on this Unix socket, if
+				   any, and wait on it for the next one (handoff.h); not with -u
+	-N <name>    - name of this server among the linked ones (federation.h)
+	-l <port>    - port where other servers link to this one
+	-S <ip:port> - link to the server at ip:port (up to MAX_PEERS times)
+	-v 			 - echo every chat line and notice to stdout (slow, for debugging)
+
+	PARAMETERS
+	int argc 	 - number of arguments
+	char* argv[] - arguments */
+void parse_config(int argc, char* const argv[]);
+
+#endif
@@ -1,10 +1,20 @@
+// PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP is a GNU extension
+#define _GNU_SOURCE
+
 #include "server_operation.h"
+#include "event_loop.h"
+#include "server_config.h"
+#include "client_registry.h"
+#include "channel_table.h"
+#include "command_table.h"
+#include "client_pool.h"
+#include "compression.h"
+#include "federation.h"
 
 /* Atomic objects are the only objects that are free from data races,
  that is, they may be modified by two threads concurrently or
  modified by one and read by another. */
-static _Atomic unsigned int cliCount = 0;
-static int userID = 0;
+_Atomic unsigned int cliCount = 0;
 
 // Colors used in users nicknames: red, green, yellow, blue, magenta and cyan.
 char usrColors[7][11] = {"\033[1;31m", "\033[1;32m", "\033[01;33m", "\033[1;34m", "\033[1;35m", "\033[1;36m"};
@@ -13,76 +23,152 @@ char usrColors[7][11] = {"\033[1;31m", "\033[1;32m", "\033[01;33m", "\033[1;34m"
 const char defltColor[7] = "\033[0m";
 const char serverMsgColor[10] = "\033[1;32m";
 
-Client* clients[MAX_CLI];
-
-Channel channel_list[CHANNEL_NUM];
+/* Chat is delivered with it held shared, by every worker at once; a command
+waiting for it exclusively goes ahead of later chat, so it is never starved. */
+pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
 
-// Necessary to send messages between the clients
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Channel locks, picked by channel id
+static pthread_mutex_t channelLocks[CHANNEL_LOCKS] = {[0 ... CHANNEL_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
 
 // === FUNCTIONS RELATED TO SERVER OPERATION ===
 
-/* If the maximum number of clients has not yet been reached,
+/* If the maximum number of clients (-c) has not yet been reached,
 the connection is made; otherwise, the client will be disconnected. */
-void is_server_full(int connfd) {
-	if(MAX_CLI < (cliCount + 1)) {
+int is_server_full(int connfd) {
+	if(config.maxClients < (cliCount + 1)) {
 		char tmp[70] = {"Opa, sala cheia! Quem sabe na próxima...\nPressione ENTER para sair.\n"};
 		write(connfd, tmp, strlen(tmp));
 		close(connfd);
 
-		return;
+		return 1;
 	}
-}
 
-// Adds clients to the array of clients.
-void add_client(Client* cli) {
-	pthread_mutex_lock(&clients_mutex);
+	return 0;
+}
 
-	for(int i = 0; i < MAX_CLI; i++) {
-		if (!clients[i]) {
-			clients[i] = cli;
-			strcpy(clients[i]->color, usrColors[i%7]);
+// Adds clients to the registry of clients.
+int add_client(Client* cli) {
+	if (registry_add(cli) < 0) return -1;
 
-			break;
-		}
-	}
+	strcpy(cli->color, usrColors[cli->userID%7]);
 
-	pthread_mutex_unlock(&clients_mutex);
+	return 0;
 }
 
 // Creates client structure.
-void create_client(struct sockaddr_in client_addr, int connfd, Client* cli) {
+int create_client(struct sockaddr_in client_addr, int connfd, Client* cli) {
 
 	cli->address = client_addr;
 	cli->sockfd = connfd;
-	cli->userID = userID++;
-	strcpy(cli->channel, channel_list[0].chName);
+	memset(cli->nick, '\0', NICK_LEN);
+	cli->idChannel = -1;
+	cli->chPrev = NULL;
+	cli->chNext = NULL;
+	change_channel(cli, ALL_CHANNEL);
+	cli->isAdmin = 0;
 	cli->isMuted = 0;
+	cli->state = CLI_AWAITING_NICK;
+	cli->binary = 0;
+	cli->zin = NULL;
+	cli->zout = NULL;
+
+	framer_init(&cli->in);
+	cli->flushPending = 0;
+	cli->flushPrev = NULL;
+	cli->flushNext = NULL;
+
+	if (add_client(cli) < 0) {
+		channel_remove_member(cli);
+		return -1;
+	}
 
-	add_client(cli);
-
+	cliCount++;
 
+	return 0;
 }
 
-// Removes clients from the array of clients
+// Removes clients from the registry of clients
 void remove_client(int userID) {
-	pthread_mutex_lock(&clients_mutex);
+	if (userID >= 0 && userID < cliSlots && clients[userID]) {
+		channel_remove_member(clients[userID]);
+		registry_remove(clients[userID]);
+	}
+}
 
-	for(int i = 0; i < MAX_CLI; i++) {
-		if(clients[i]) {
-			if(clients[i]->userID == userID) {
-				clients[i] = NULL;
-				break;
-			}
+// Adds a client to a channel's member list.
+void channel_add_member(int idChannel, Client* cli) {
+	Channel* ch = &channel_list[idChannel];
+
+	cli->idChannel = idChannel;
+	cli->chPrev = NULL;
+	cli->chNext = ch->members;
+
+	if (ch->members) ch->members->chPrev = cli;
+	ch->members = cli;
+	ch->nroMembers++;
+}
+
+// Removes a client from the member list of its channel.
+void channel_remove_member(Client* cli) {
+	if (cli->idChannel < 0) return;
+
+	Channel* ch = &channel_list[cli->idChannel];
+
+	if (cli->chPrev) cli->chPrev->chNext = cli->chNext;
+	else ch->members = cli->chNext;
+
+	if (cli->chNext) cli->chNext->chPrev = cli->chPrev;
+
+	ch->nroMembers--;
+
+	cli->idChannel = -1;
+	cli->chPrev = NULL;
+	cli->chNext = NULL;
+}
+
+// Moves a client to another channel.
+void change_channel(Client* cli, int idChannel) {
+	channel_remove_member(cli);
+	channel_add_member(idChannel, cli);
+	federation_announce(cli);
+}
+
+// Locks a channel's history, log and deliveries.
+void lock_channel(int idChannel) {
+	pthread_mutex_lock(&channelLocks[idChannel & (CHANNEL_LOCKS - 1)]);
+
+	// Messages other workers delivered to the channel before this one go first
+	if (thisWorker) worker_drain_inbox(thisWorker);
+}
+
+// Unlocks a channel.
+void unlock_channel(int idChannel) {
+	pthread_mutex_unlock(&channelLocks[idChannel & (CHANNEL_LOCKS - 1)]);
+}
+
+// Delivers a message to the members of a channel on this server, except the sender itself.
+void deliver_notice(const char* msg, size_t len, int userID, int idChannel) {
+	// One copy of the message is shared by every recipient's queue
+	Payload* p = payload_create(msg, len);
+	if (!p) return;
+
+	int recipients = 0;
+
+	// Only the channel's members are visited
+	for (Client* member = channel_list[idChannel].members; member; member = member->chNext) {
+		if (member->userID != userID) {
+			// Never blocks: the message waits in the member's queue
+			client_write_payload(member, p);
+			recipients++;
 		}
 	}
 
-	pthread_mutex_unlock(&clients_mutex);
+	metrics_observe(&metrics.fanout, recipients);
+	payload_unref(p);
 }
 
-// Sends messages to all the clients, except the sender itself
-void send_message_to_channel(char* msg, int userID, char* channel, int leaveFlag) {
-	pthread_mutex_lock(&clients_mutex);
+// Sends messages to all the members of a channel, except the sender itself, here and on linked servers.
+void send_message_to_channel(char* msg, int userID, int idChannel, int leaveFlag) {
 
 	//Connection failure test
 	int teste = 0;
@@ -93,33 +179,13 @@ void send_message_to_channel(char* msg, int userID, char* channel, int leaveFlag
 		clients[1] = cli;
 	}
 
-	for (int i = 0; i < MAX_CLI; i++) {
-
-		if (clients[i]) {
-			if (clients[i]->userID != userID && strcmp(clients[i]->channel, channel) == 0) {
-				sleep(0.7);
-
-				int counter = 0;
-				while (write(clients[i]->sockfd, msg, strlen(msg)) < 0) {
-					printf("mandando\n");
-
-					if (counter == 4) {
-						printf("Erro: a mensagem não pode ser enviada.\n");
-
-						pthread_mutex_unlock(&clients_mutex);
-						remove_client(i);
-						pthread_mutex_lock(&clients_mutex);
-
-						break;
-					}
-
-					counter++;
-				}
-			}
-		}
-	}
+	size_t len = strlen(msg);
 
-	pthread_mutex_unlock(&clients_mutex);
+	// Linked servers get the channel's messages in the same order as its members here
+	lock_channel(idChannel);
+	deliver_notice(msg, len, userID, idChannel);
+	federation_relay_notice(idChannel, msg, len);
+	unlock_channel(idChannel);
 }
 
 // Checks whether the channel name is valid.
@@ -133,91 +199,114 @@ int check_channel(char *channel) {
 }
 
 // Checks if there is already a user with the specified nickname on the specified channel.
-int check_nick(char* nick, char* channel) {
+int check_nick(char* nick, int idChannel) {
 
-	for (int i = 0; i < MAX_CLI; i++)
-		if (clients[i] && strcmp(channel, clients[i]->channel) == 0 && strcmp(nick, clients[i]->nick) == 0)
-			return 0;
+	if (idChannel >= 0 && registry_find_nick(nick, idChannel))
+		return 0;
 
 	return 1;
 }
 
 // Creates initial channel list.
 void initialize_channel_list() {
-	for (int i = 0; i < CHANNEL_NUM; i++) {
-			memset(channel_list[i].chName, '\0', CHANNEL_LEN);
-			strcpy(channel_list[i].chMode, "-i");
+	channel_create("#all");
+}
 
-			clear_invite_list(i);
+// Commands list, at the top of the welcome menu.
+static const char commandsMenu[] = "Comandos gerais:\t\tComandos de administrador:\n- /join <nomeCanal>\t\t- /kick <nomeUsuario>\n- /nickname <novoNick>\t\t- /mute <nomeUsuario>\n- /ping\t\t\t\t- /unmute <nomeUsuario>\n- /quit\t\t\t\t- /whois <nomeUsuario>\n- /quitchannel\t\t\t- /mode <+i|-i>\n \t\t\t\t- /invite <nomeUsuario>\n\n";
 
-			channel_list[i].nroInvUser = 0;
-		}
+// Header of the channel menu.
+static const char channelsHeader[] = "Para entrar em um canal basta digitar \"/join nome_do_canal\"!\n\n> Você pode entrar em um dos canais já existentes ou criar o seu próprio crinal (lembrando que que o nome do canal deve começar com '#'ou '&'e não pode conter ',' ou ' ' ou ASCII7)\n\nLista de canais:\n";
 
-	strcpy(channel_list[0].chName, "#all");
-}
+/* Rendered menus, shared by every client they are sent to. They are only
+rendered again when channelVersion moves past menuVersion. */
+static Payload* channelMenuCache = NULL;
+static Payload* welcomeMenuCache = NULL;
+static unsigned int menuVersion = 0;
 
-// Shows channel menu.
-void channel_menu(Client* cli) {
-	char buffer[BUFFER_MAX] = {};
-	char menuChannel[BUFFER_MAX] = {};
+// Renders both menus, unless the cached ones are still up to date.
+static int render_menus() {
+	if (channelMenuCache && menuVersion == channelVersion) return 0;
 
-	int channel_id = 0;
+	// Each line holds an id, a name and, at most, " (invite-only)"
+	size_t cap = sizeof(commandsMenu) + sizeof(channelsHeader) + (size_t) nroChannels * (CHANNEL_LEN + 32);
 
-	memset(buffer, '\0', BUFFER_MAX);
-	strcpy(buffer, "Para entrar em um canal basta digitar \"/join nome_do_canal\"!\n\n> Você pode entrar em um dos canais já existentes ou criar o seu próprio crinal (lembrando que que o nome do canal deve começar com '#'ou '&'e não pode conter ',' ou ' ' ou ASCII7)\n\n");
-	write(cli->sockfd, buffer, strlen(buffer));
+	char* text = (char*) malloc(cap);
+	if (!text) return -1;
 
-	strcpy(menuChannel, "Lista de canais:\n");
+	// The welcome menu is the commands list followed by the channel menu
+	size_t skip = strlen(commandsMenu);
+	size_t len = skip;
 
-	for(int i = 0; i < CHANNEL_NUM; i++) {
+	memcpy(text, commandsMenu, skip);
+	len += sprintf(text + len, "%s", channelsHeader);
 
-		memset(buffer, '\0', BUFFER_MAX);
+	int channel_id = 0;
+
+	for(int i = 0; i < nroChannels; i++) {
 
 		if(channel_list[i].chName[0] != '\0') {
 
 			if(strcmp(channel_list[i].chMode,"+i") != 0)
-				sprintf(buffer, "\t%d - %s\n", channel_id, channel_list[i].chName);
+				len += sprintf(text + len, "\t%d - %s\n", channel_id, channel_list[i].chName);
 			else
-				sprintf(buffer, "\t%d - %s (invite-only)\n", channel_id, channel_list[i].chName);
+				len += sprintf(text + len, "\t%d - %s (invite-only)\n", channel_id, channel_list[i].chName);
 
-			strcat(menuChannel, buffer);
 			channel_id++;
 		}
 	}
 
-	write(cli->sockfd, menuChannel, strlen(menuChannel));
+	Payload* channels = payload_create(text + skip, len - skip);
+	Payload* welcome = payload_create(text, len);
+	free(text);
 
+	if (!channels || !welcome) {
+		if (channels) payload_unref(channels);
+		if (welcome) payload_unref(welcome);
+		return -1;
+	}
+
+	if (channelMenuCache) payload_unref(channelMenuCache);
+	if (welcomeMenuCache) payload_unref(welcomeMenuCache);
+
+	channelMenuCache = channels;
+	welcomeMenuCache = welcome;
+	menuVersion = channelVersion;
+
+	return 0;
 }
 
-// Shows welcome menu
-void welcome_menu(Client* cli) {
+// Shows channel menu.
+void channel_menu(Client* cli) {
+	if (render_menus() < 0) return;
 
-	char buffer[BUFFER_MAX] = {};
+	client_write_payload(cli, channelMenuCache);
+}
 
-	memset(buffer, '\0', BUFFER_MAX);
-	strcpy(buffer, "Comandos gerais:\t\tComandos de administrador:\n- /join <nomeCanal>\t\t- /kick <nomeUsuario>\n- /nickname <novoNick>\t\t- /mute <nomeUsuario>\n- /ping\t\t\t\t- /unmute <nomeUsuario>\n- /quit\t\t\t\t- /whois <nomeUsuario>\n- /quitchannel\t\t\t- /mode <+i|-i>\n \t\t\t\t- /invite <nomeUsuario>\n\n");
-	write(cli->sockfd, buffer, strlen(buffer));
+// Shows welcome menu
+void welcome_menu(Client* cli) {
+	if (render_menus() < 0) return;
 
-	channel_menu(cli);
+	client_write_payload(cli, welcomeMenuCache);
 }
 
 // Handles client leaving channel.
 void client_leaves_channel(Client* cli) {
 	char buffer[BUFFER_MAX] = {};
 
-	if(strcmp(cli->channel, "#all") == 0){
+	if(cli->idChannel == ALL_CHANNEL){
 		sprintf(buffer, "%sNão é possível deixar o canal #all.%s\n", serverMsgColor, defltColor);
-		write(cli->sockfd, buffer, strlen(buffer));
+		client_write(cli, buffer, strlen(buffer));
 	}
 	else{
 		sprintf(buffer, "%s%s saiu do canal.%s\n", cli->color, cli->nick, defltColor);
-		printf("%s", buffer);
-		send_message_to_channel(buffer, cli->userID, cli->channel, 0);
+		if (config.verbose) printf("%s", buffer);
+		send_message_to_channel(buffer, cli->userID, cli->idChannel, 0);
 
-		strcpy(cli->channel, "#all");
+		change_channel(cli, ALL_CHANNEL);
 
 		sprintf(buffer, "%sVocê saiu do canal.%s\n", cli->color, defltColor);
-		write(cli->sockfd, buffer, strlen(buffer));
+		client_write(cli, buffer, strlen(buffer));
 
 		channel_menu(cli);
 	}
@@ -229,12 +318,14 @@ int find_other_clients(Client* cli) {
 
 	int otherClients = 0;
 
-	for (int i = 0; i < MAX_CLI; i++) {
+	int idChannel = find_channel(cli);
+
+	for (Client* member = channel_list[idChannel].members; member; member = member->chNext) {
 
-		if (clients[i] && clients[i]->userID != cli->userID && strcmp(clients[i]->channel, cli->channel) == 0) {
+		if (member->userID != cli->userID) {
 			otherClients = 1;
-			sprintf(buffer, "%s- %s%s\n", serverMsgColor, clients[i]->nick, defltColor);
-			write(cli->sockfd, buffer, strlen(buffer));
+			sprintf(buffer, "%s- %s%s\n", serverMsgColor, member->nick, defltColor);
+			client_write(cli, buffer, strlen(buffer));
 		}
 	}
 
@@ -245,48 +336,54 @@ int find_other_clients(Client* cli) {
 void delete_channel(Client* cli) {
 
 	int idChannel = find_channel(cli);
-	memset(channel_list[idChannel].chName, '\0', CHANNEL_LEN);
-	strcpy(channel_list[idChannel].chMode, "-i");
 
-	for(int j = 0; j < MAX_CLI; j++)
-		memset(channel_list[idChannel].inviteUser[j], '\0', NICK_LEN);
+	if (idChannel == ALL_CHANNEL) return;
 
-	channel_list[idChannel].nroInvUser = 0;
+	// Whoever is still here goes back to #all
+	while (channel_list[idChannel].members)
+		change_channel(channel_list[idChannel].members, ALL_CHANNEL);
 
+	channel_destroy(idChannel);
+}
+
+// Asks the admin leaving the channel who their successor will be.
+void ask_new_admin(Client* cli) {
+	char buffer[BUFFER_MAX] = {};
+
+	sprintf(buffer, "%sDados os clientes acima, quem será o novo admin do canal %s?%s\n", serverMsgColor, channel_list[cli->idChannel].chName, defltColor);
+	client_write(cli, buffer, strlen(buffer));
 }
 
 // Changes channel's admin.
-int change_admin(Client*cli) {
+int change_admin(Client* cli, char* answer) {
 
     char buffer[BUFFER_MAX] = {};
-
-    sprintf(buffer, "%sDados os clientes acima, quem será o novo admin do canal %s?%s\n", serverMsgColor, cli->channel, defltColor);
-    write(cli->sockfd, buffer, strlen(buffer));
+    char msg[BUFFER_MAX] = {};
 
     char newAdmin[NICK_LEN];
     strcpy(newAdmin, "default");
 
-    memset(buffer, '\0', strlen(buffer));
-
-    recv(cli->sockfd, buffer, NICK_LEN+MSG_LEN, 0);
-    nick_trim(buffer, newAdmin);
+    nick_trim(answer, msg);
+    if (msg[0] != '\0') {
+        strncpy(newAdmin, msg, NICK_LEN - 1);
+        newAdmin[NICK_LEN - 1] = '\0';
+    }
 
     str_trim(newAdmin, strlen(newAdmin));
-    printf("%s\n", newAdmin+1);
+    if (config.verbose) printf("%s\n", newAdmin+1);
 
     int clientFound = 0;
 
-    for (int i = 0; i < MAX_CLI; i++) {
-        if (clients[i] && strcmp(newAdmin+1, clients[i]->nick) == 0 && strcmp(cli->channel, clients[i]->channel) == 0) {
-            clients[i]->isAdmin = 1;
-            clients[i]->isMuted = 0;
+    Client* newCli = registry_find_nick(newAdmin+1, cli->idChannel);
+
+    if (newCli) {
+        newCli->isAdmin = 1;
+        newCli->isMuted = 0;
 
-            sprintf(buffer, "%sAgora você é o admin! Lembre-se: com grandes poderes vêm grandes responsabilidades!\n\n%s", serverMsgColor, defltColor);
-            write(clients[i]->sockfd, buffer, strlen(buffer));
+        sprintf(buffer, "%sAgora você é o admin! Lembre-se: com grandes poderes vêm grandes responsabilidades!\n\n%s", serverMsgColor, defltColor);
+        client_write(newCli, buffer, strlen(buffer));
 
-            clientFound = 1;
-            break;
-        }
+        clientFound = 1;
     }
 
 	cli->isAdmin = 0;
@@ -297,11 +394,10 @@ int change_admin(Client*cli) {
 // Finds clients in the same channel.
 int find_client(char* nick,Client* cli) {
 
-	for (int i = 0; i < MAX_CLI; i++) {
+	Client* found = registry_find_nick(nick, cli->idChannel);
 
-		if (clients[i] && strcmp(nick, clients[i]->nick) == 0 && strcmp(cli->channel,clients[i]->channel) == 0)
-			return i;
-	}
+	if (found)
+		return found->userID;
 	return -1;
 
 }
@@ -309,570 +405,759 @@ int find_client(char* nick,Client* cli) {
 // Finds current client's channel.
 int find_channel(Client* cli) {
 
-	for (int i = 0; i < CHANNEL_NUM; i++) {
-		if (strcmp(channel_list[i].chName, cli->channel) == 0)
-			return i;
-	}
-	return -1;
+	return cli->idChannel;
 }
 
 // Clears the list of invited users for a given chat.
 void clear_invite_list(int idChannel){
-	for(int i = 0; i < CHANNEL_NUM; i++){
+	for(int i = 0; i < MAX_INVITE; i++){
 		memset(channel_list[idChannel].inviteUser[i], '\0', NICK_LEN);
 	}
 }
 
-// Handles clients, assigns their values and joins the chat
-void* handle_client(void* arg) {
-	/* leaveFlag indicates whether the client is connected or if they wish
-	 to leave the chatroom. It also indicates if there's an error, which would
-	 indicate the client should be disconnected. */
-	int leaveFlag = 0;
-
+// Handles the nickname sent by a client right after the connection.
+int handle_nick(Client* cli, char* nick, int receive) {
 	char buffer[BUFFER_MAX] = {};
-	// char menuChannel[BUFFER_MAX] = {};
-	char nick[NICK_LEN] = {};
-	char msg[MSG_LEN] = {};
-	char channel[200] = {};
-	char mode[3] = {};
 
-	cliCount++;
+	// Protocol options come in a byte before the nickname
+	if (receive > 0 && nick[0] > 0 && nick[0] < PROTO_OPT_END) {
+		cli->binary = (nick[0] & PROTO_OPT_BINARY) != 0;
 
-	Client* cli = (Client*) arg;
+		if ((nick[0] & PROTO_OPT_DEFLATE) && compression_start(cli) < 0) return 1;
+
+		nick++;
+	}
 
 	/* Naming the client:
-	 recv() is used to receive messages from a socket;
 	 Nicknames must be at least 3 characters long
 	 and should not exceed the maximum length established above.*/
-	if(recv(cli->sockfd, nick, NICK_LEN, 0) <= 0 || strlen(nick) < 2 || strlen(nick) > NICK_LEN - 1) {
+	if(receive <= 0 || strlen(nick) < 2 || strlen(nick) > NICK_LEN - 1) {
 
 		printf("\nErro: nick inválido.\n");
-		leaveFlag = 1;
+		return 1;
+	}
 
-	} else {
-		strcpy(cli->nick, nick);
-		//  Notifies other clients that this client has joined the chatroom
-		sprintf(buffer, "%s%s entrou no servidor!\n%s", cli->color, cli->nick, defltColor);
-		printf("%s", buffer);
+	registry_set_nick(cli, nick);
+	cli->state = CLI_CONNECTED;
+	federation_announce(cli);
 
-		welcome_menu(cli);
-	}
+	//  Notifies other clients that this client has joined the chatroom
+	sprintf(buffer, "%s%s entrou no servidor!\n%s", cli->color, cli->nick, defltColor);
+	if (config.verbose) printf("%s", buffer);
 
-	memset(buffer, '\0', BUFFER_MAX);
+	welcome_menu(cli);
 
-	// Message exchange
-	while(1) {
+	return 0;
+}
 
-		if(leaveFlag) break;
+// Leaves the server.
+static int command_quit(Client* cli, char* msg, char* buffer) {
+	sprintf(buffer, "%s%s saiu do servidor.%s\n", serverMsgColor, cli->nick, defltColor);
+	if (config.verbose) printf("%s", buffer);
+	send_message_to_channel(buffer, cli->userID, cli->idChannel, 0);
 
-		int receive = recv(cli->sockfd, buffer, NICK_LEN+MSG_LEN, 0);
-		printf("%s", buffer);
+	return 1;
+}
 
-		nick_trim(buffer, msg);
+// Leaves the current channel.
+static int command_quitchannel(Client* cli, char* msg, char* buffer) {
+	if (cli->isAdmin == 0) {
 
-		// Checks if the client wants to leave the chatroom
-		if(receive == 0 || strcmp(msg, " /quit\n") == 0 || feof(stdin)) {
+		client_leaves_channel(cli);
 
-			sprintf(buffer, "%s%s saiu do servidor.%s\n", serverMsgColor, cli->nick, defltColor);
-			printf("%s", buffer);
-			send_message_to_channel(buffer, cli->userID, cli->channel, 0);
-			leaveFlag = 1;
+	} else if (cli->isAdmin) {
 
-		} else if(strcmp(msg, " /quitchannel\n") == 0) {
+		if (find_other_clients(cli)) {
+			// The successor's nickname arrives as the next message
+			ask_new_admin(cli);
+			cli->state = CLI_AWAITING_ADMIN;
+
+		} else {
+			sprintf(buffer, "%sComo você era a única pessoa aqui, seu canal já era!%s\n\n", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
 
-			if (cli->isAdmin == 0) {
+			delete_channel(cli);
 
-				client_leaves_channel(cli);
+			//client leaves the channel
+			change_channel(cli, ALL_CHANNEL);
+			cli->isAdmin = 0;
 
-			} else if (cli->isAdmin) {
+			channel_menu(cli);
+		}
+	}
 
-				if (find_other_clients(cli)) {
-					// memset(buffer, '\0', strlen(buffer));
-                    int clientFound = change_admin(cli);
+	return 0;
+}
 
-					if (clientFound) {
-						client_leaves_channel(cli);
-					} else {
-						sprintf(buffer, "%sCliente não encontrado! Tente novamente...\n\n%s", serverMsgColor, defltColor);
-						write(cli->sockfd, buffer, strlen(buffer));
-					}
-				} else {
-					sprintf(buffer, "%sComo você era a única pessoa aqui, seu canal já era!%s\n\n", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
+// Joins a channel, creating it if it does not exist.
+static int command_join(Client* cli, char* msg, char* buffer) {
+	char channel[CHANNEL_LEN] = {};
 
-                    delete_channel(cli);
+	get_command(channel, msg, 7, CHANNEL_LEN);
+	str_trim(channel, strlen(channel));
 
-					//client leaves the channel
-					strcpy(cli->channel, "#all");
-					cli->isAdmin = 0;
+	// Channel names are interned: from here on only the id is compared
+	int idChannel = channel_lookup(channel);
 
-					channel_menu(cli);
-				}
+	int publicChannel = 1;
+	int invitedUser = 0;
+
+	// Checking if it's an invite-only channel and, if so, if the client
+	//was invited to it
+	if(idChannel >= 0 && strcmp(channel_list[idChannel].chMode, "+i") == 0){
+
+		publicChannel = 0;
+
+		for(int j = 0; j < MAX_INVITE; j++){
+			if(strcmp(channel_list[idChannel].inviteUser[j], cli->nick) == 0){
+				invitedUser = 1;
+
+				break;
 			}
 
-		// Checks if the client wants to join some channel
-		} else if(strncmp(msg, " /join", 6) == 0) {
+		}
+	}
 
-			get_command(channel, msg, 7, CHANNEL_LEN);
-			str_trim(channel, strlen(channel));
+	// Dealing with the impossibility of joining the channel
+	if(!check_channel(channel) || !check_nick(cli->nick, idChannel) ||
+       (!publicChannel && !invitedUser)){
 
-			int publicChannel = 1;
-			int invitedUser = 0;
+		memset(buffer, '\0', BUFFER_MAX);
 
-			// Checking if it's an invite-only channel and, if so, if the client
-			//was invited to it
-			for(int i = 0; i < CHANNEL_NUM; i++){
-				if(strcmp(channel_list[i].chName, channel) == 0 &&
-				        strcmp(channel_list[i].chMode, "+i") == 0 ){
+		// If the channel is invalid
+		if(!check_channel(channel)){
+			sprintf(buffer, "%sInsira um nome de canal válido!\n\n%s", serverMsgColor, defltColor);
+		}
+		// If the user already participates in that channel
+		else if(cli->idChannel == idChannel){
+			sprintf(buffer, "%sVocê já está neste canal!\n\n%s", serverMsgColor, defltColor);
+		}
+		// If it is an invite-only channel and the user has not been invited
+		else if(!publicChannel && !invitedUser){
+			sprintf(buffer, "%sDesculpe... Este é um canal invite-only e você não foi convidado.\n\n%s", serverMsgColor, defltColor);
+		}
+		// If there is already an user with that nickname on the channel
+		else{
+			sprintf(buffer, "%sJá existe um usuário com nickname %s nesse chat, para entrar mude seu nick com o comando: \"/nickname novo_nick\"!\n\n%s", serverMsgColor, cli->nick, defltColor);
+		}
 
-					publicChannel = 0;
+		client_write(cli, buffer, strlen(buffer));
 
-					for(int j = 0; j < MAX_CLI; j++){
-						if(strcmp(channel_list[i].inviteUser[j], cli->nick) == 0){
-							invitedUser = 1;
+	// Dealing with the possibility of joining the channel
+	} else {
 
-							break;
-						}
+		// Design decision: the user can only participate in one channel
+		//at a time, so he cannot switch channels unless he disconnects
+		//from the current one
+		if (cli->idChannel != ALL_CHANNEL) {
+			sprintf(buffer, "%sNada de ficar mudando de sala! Sem bagunça no KalinkUOL! Saia do servidor e entre novamente para poder se juntar a um outro canal.\n\n%s", serverMsgColor, defltColor);
 
-					}
+			client_write(cli, buffer, strlen(buffer));
 
-					break;
-				}
-			}
+		// If the user is not active on any specific channel yet (that
+		//is, he is on the all channel) then he can join any
+		} else {
+			cli->isMuted=0;
 
-			// Dealing with the impossibility of joining the channel
-			if(!check_channel(channel) || !check_nick(cli->nick, channel) ||
-		       (!publicChannel && !invitedUser)){
+			// If the channel already exists, the user is inserted
+			//into it as a regular one (that is, he will not be an administrator)
+			if (idChannel >= 0) {
+				cli->isAdmin = 0;
+				change_channel(cli, idChannel);
+				memset(buffer, '\0', BUFFER_MAX);
+				sprintf(buffer, "%sBem-vindo ao canal %s, vulgo melhor canal!\n\n%s",serverMsgColor, channel, defltColor);
+				client_write(cli, buffer, strlen(buffer));
+
+				// What was said before the client joined
+				replay_history(cli);
+
+			// If channel does not exist and if there's room available for
+			//one more channel, a new channel will be created and the user
+			//will be the administrator.
+			} else if ((idChannel = channel_create(channel)) >= 0) {
+				change_channel(cli, idChannel);
+				cli->isAdmin = 1;
+				memset(buffer, '\0', BUFFER_MAX);
 
+				sprintf(buffer, "%sBem-vindo ao canal %s. Você é o admin! Lembre-se: com grandes poderes vêm grandes responsabilidades!\n\n%s",serverMsgColor, channel, defltColor);
+				client_write(cli, buffer, strlen(buffer));
+
+				// A channel created again brings back what its log kept (-L)
+				replay_history(cli);
+
+			// If there's no room available...
+			} else {
 				memset(buffer, '\0', BUFFER_MAX);
+				sprintf(buffer, "%sNão há espaço para novos canais!\n\n%s", serverMsgColor, defltColor);
+				client_write(cli, buffer, strlen(buffer));
+			}
 
-				// If the channel is invalid
-				if(!check_channel(channel)){
-					sprintf(buffer, "%sInsira um nome de canal válido!\n\n%s", serverMsgColor, defltColor);
-				}
-				// If the user already participates in that channel
-				else if(strcmp(cli->channel,channel) == 0){
-					sprintf(buffer, "%sVocê já está neste canal!\n\n%s", serverMsgColor, defltColor);
-				}
-				// If it is an invite-only channel and the user has not been invited
-				else if(!publicChannel && !invitedUser){
-					sprintf(buffer, "%sDesculpe... Este é um canal invite-only e você não foi convidado.\n\n%s", serverMsgColor, defltColor);
+			//  Notifies other clients that this client has joined the channel
+			sprintf(buffer, "%s%s entrou no canal %s!%s\n", cli->color, cli->nick, channel_list[cli->idChannel].chName, defltColor);
+			if (config.verbose) printf("%s", buffer);
+
+			send_message_to_channel(buffer, cli->userID, cli->idChannel, 0);
+		}
+	}
+
+	return 0;
+}
+
+// Answers a /ping.
+static int command_ping(Client* cli, char* msg, char* buffer) {
+	char reply[5] = "pong\n";
+	client_write(cli, reply, sizeof(reply));
+
+	return 0;
+}
+
+// Changes the nickname.
+static int command_nickname(Client* cli, char* msg, char* buffer) {
+	char nick[NICK_LEN] = {};
+
+	char oldName[NICK_LEN];
+	memset(oldName, '\0', NICK_LEN);
+	strcpy(oldName, cli->nick);
+
+	memset(nick, '\0', NICK_LEN);
+
+	// get new nickname
+	get_command(nick, msg, 11, NICK_LEN);
+  	str_trim(nick, NICK_LEN);
+
+	memset(buffer, '\0', BUFFER_MAX);
+	sprintf(buffer, "\n%s%s agora se chama %s!\n\n%s", cli->color, oldName, nick, defltColor);
+	if (config.verbose) printf("%s", buffer);
+	send_message_to_channel(buffer, cli->userID, cli->idChannel, 0);
+
+	//change the nickname
+	registry_set_nick(cli, nick);
+	federation_announce(cli);
+
+	memset(buffer, '\0', BUFFER_MAX);
+	sprintf(buffer, "%sNick alterado para %s!\n\n%s", serverMsgColor, cli->nick, defltColor);
+	client_write(cli, buffer, strlen(buffer));
+
+	return 0;
+}
+
+// Kicks a user out of the channel (admin only).
+static int command_kick(Client* cli, char* msg, char* buffer) {
+	char nick[NICK_LEN] = {};
+
+	if(cli->isAdmin) {
+		get_command(nick, msg, 7, NICK_LEN);
+		str_trim(nick, NICK_LEN);
+
+		int clientFound = find_client(nick,cli);
+
+		if(clientFound!=-1){
+
+			if(!clients[clientFound]->isAdmin){
+
+					change_channel(clients[clientFound], ALL_CHANNEL);
+
+					memset(buffer, '\0', BUFFER_MAX);
+					sprintf(buffer, "%sVocê foi eliminado do canal %s, talvez você devesse repensar suas ações.\n\n%s", serverMsgColor, channel_list[cli->idChannel].chName,defltColor);
+					client_write(clients[clientFound], buffer, strlen(buffer));
+
+					// Both replies go out together at the end of the turn
+					channel_menu(clients[clientFound]);
+
+					memset(buffer, '\0', BUFFER_MAX);
+					sprintf(buffer, "%s%s não está mais espalhando seu fedor no canal %s!\n\n%s", serverMsgColor, nick, channel_list[cli->idChannel].chName, defltColor);
+					if (config.verbose) printf("%s", buffer);
+					client_write(cli, buffer, strlen(buffer));
 				}
-				// If there is already an user with that nickname on the channel
 				else{
-					sprintf(buffer, "%sJá existe um usuário com nickname %s nesse chat, para entrar mude seu nick com o comando: \"/nickname novo_nick\"!\n\n%s", serverMsgColor, cli->nick, defltColor);
+					memset(buffer, '\0', BUFFER_MAX);
+					sprintf(buffer, "%sVocê não pode kikar a si mesmo do chat.\n\n%s", serverMsgColor, defltColor);
+					client_write(clients[clientFound], buffer, strlen(buffer));
 				}
 
-				write(cli->sockfd, buffer, strlen(buffer));
+		} else {
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
+
+	} else {
+		memset(buffer, '\0', BUFFER_MAX);
+		sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nSe quer kickar geral, cria seu próprio canal!\n\n%s", serverMsgColor, defltColor);
+		client_write(cli, buffer, strlen(buffer));
+	}
 
-			// Dealing with the possibility of joining the channel
-			} else {
+	return 0;
+}
 
-				// Design decision: the user can only participate in one channel
-				//at a time, so he cannot switch channels unless he disconnects
-				//from the current one
-				if (strcmp(cli->channel, channel_list[0].chName) != 0) {
-					sprintf(buffer, "%sNada de ficar mudando de sala! Sem bagunça no KalinkUOL! Saia do servidor e entre novamente para poder se juntar a um outro canal.\n\n%s", serverMsgColor, defltColor);
-
-					write(cli->sockfd, buffer, strlen(buffer));
-
-				// If the user is not active on any specific channel yet (that
-				//is, he is on the all channel) then he can join any
-				} else {
-					strcpy(cli->channel, channel);
-                    cli->isMuted=0;
-
-					// Checks if channel requested already exists
-					int newChannel = 1;
-					int channelAvailable = 0;
-
-					for (int i = 0; i < CHANNEL_NUM; i++) {
-						if (channel_list[i].chName[0] == '\0') {
-							channelAvailable++;
-						}
-
-						// If the channel already exists, the user is inserted
-						//into it as a regular one (that is, he will not be an administrator)
-						else if (strcmp(channel, channel_list[i].chName) == 0) {
-							newChannel = 0;
-							cli->isAdmin = 0;
-							memset(buffer, '\0', BUFFER_MAX);
-							sprintf(buffer, "%sBem-vindo ao canal %s, vulgo melhor canal!\n\n%s",serverMsgColor, channel, defltColor);
-							write(cli->sockfd, buffer, strlen(buffer));
-							break;
-						}
-					}
+// Mutes a user (admin only).
+static int command_mute(Client* cli, char* msg, char* buffer) {
+	char nick[NICK_LEN] = {};
 
-					// If channel does not exist
-					if (newChannel) {
-						// And if there's room available for one more channel, a
-						//new channel will be created and the user will be the
-						//administrator.
-						if (channelAvailable > 0) {
-							for (int i = 0; i < CHANNEL_NUM; i++) {
-								if (channel_list[i].chName[0] == '\0') {
-									strcpy(channel_list[i].chName, channel);
-									cli->isAdmin = 1;
-									memset(buffer, '\0', BUFFER_MAX);
-
-									sprintf(buffer, "%sBem-vindo ao canal %s. Você é o admin! Lembre-se: com grandes poderes vêm grandes responsabilidades!\n\n%s",serverMsgColor, channel, defltColor);
-									write(cli->sockfd, buffer, strlen(buffer));
-									break;
-								}
-							}
-
-						// If there's no room available...
-						} else if (channelAvailable == 0) {
-							memset(buffer, '\0', BUFFER_MAX);
-							sprintf(buffer, "%sNão há espaço para novos canais!\n\n%s", serverMsgColor, defltColor);
-							strcpy(cli->channel,channel_list[0].chName);
-							write(cli->sockfd, buffer, strlen(buffer));
-						}
-					}
+	//only admin cans mute people
+	if(cli->isAdmin) {
 
-					//  Notifies other clients that this client has joined the channel
-					sprintf(buffer, "%s%s entrou no canal %s!%s\n", cli->color, cli->nick, cli->channel, defltColor);
-					printf("%s", buffer);
+		//get who will be muted
+		get_command(nick, msg, 7, NICK_LEN);
+		str_trim(nick, NICK_LEN);
 
-					send_message_to_channel(buffer, cli->userID, cli->channel, 0);
-				}
-			}
-		} else if(strcmp(msg, " /ping\n") == 0) {
+		int clientFound = find_client(nick,cli);
 
-			char reply[5] = "pong\n";
-			write(cli->sockfd, reply, strlen(reply));
+		if(clientFound!=-1){
 
-		} else if(strncmp(msg, " /nickname", 10) == 0) {
-			char oldName[NICK_LEN];
-			memset(oldName, '\0', NICK_LEN);
-			strcpy(oldName, cli->nick);
+				//notify that the client is muted
+				memset(buffer, '\0', BUFFER_MAX);
+				sprintf(buffer, "%sShh, cala boquinha.\n\n%s", serverMsgColor, defltColor);
+				client_write(clients[clientFound], buffer, strlen(buffer));
 
-			memset(nick, '\0', NICK_LEN);
-			memset(cli->nick, '\0', NICK_LEN);
+				clients[clientFound]->isMuted = 1;
 
-			// get new nickname
-			get_command(nick, msg, 11, NICK_LEN);
-		  	str_trim(nick, NICK_LEN);
+				memset(buffer, '\0', BUFFER_MAX);
+				sprintf(buffer, "%s%s foi silenciadah!\n\n%s", serverMsgColor, nick, defltColor);
+				if (config.verbose) printf("%s", buffer);
+				client_write(cli, buffer, strlen(buffer));
+		}
+		else {
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
+	}
+	else {
+		memset(buffer, '\0', BUFFER_MAX);
+		sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nSe quer mutar geral, cria seu próprio canal!\n\n%s", serverMsgColor, defltColor);
+		client_write(cli, buffer, strlen(buffer));
+	}
 
+	return 0;
+}
+
+// Unmutes a user (admin only).
+static int command_unmute(Client* cli, char* msg, char* buffer) {
+	char nick[NICK_LEN] = {};
+
+	if(cli->isAdmin) {
+
+		//get who will be unmuted
+		get_command(nick, msg, 9, NICK_LEN);
+		str_trim(nick, NICK_LEN);
+
+		int clientFound = find_client(nick,cli);
+
+		if(clientFound!=-1){
 			memset(buffer, '\0', BUFFER_MAX);
-			sprintf(buffer, "\n%s%s agora se chama %s!\n\n%s", cli->color, oldName, nick, defltColor);
-			printf("%s", buffer);
-			send_message_to_channel(buffer, cli->userID, cli->channel, 0);
+			sprintf(buffer, "%sTá, pode falar.\n\n%s", serverMsgColor, defltColor);
+			client_write(clients[clientFound], buffer, strlen(buffer));
 
-			//change the nickname
-			strcpy(cli->nick, nick);
+			clients[clientFound]->isMuted = 0;
 
 			memset(buffer, '\0', BUFFER_MAX);
-			sprintf(buffer, "%sNick alterado para %s!\n\n%s", serverMsgColor, cli->nick, defltColor);
-			write(cli->sockfd, buffer, strlen(buffer));
+			sprintf(buffer, "%s%s foi liberadah!\n\n%s", serverMsgColor, nick, defltColor);
+			if (config.verbose) printf("%s", buffer);
+			client_write(cli, buffer, strlen(buffer));
 
-		} else if(strncmp(msg, " /kick", 6) == 0) {
+		} else {
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
 
-			if(cli->isAdmin) {
-				get_command(nick, msg, 7, NICK_LEN);
-				str_trim(nick, NICK_LEN);
+	} else {
+		memset(buffer, '\0', BUFFER_MAX);
+		sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nPode sair desmutando assim não!\n\n%s", serverMsgColor, defltColor);
+		client_write(cli, buffer, strlen(buffer));
+	}
 
-				int clientFound = find_client(nick,cli);
+	return 0;
+}
 
-				if(clientFound!=-1){
+// Shows the IP address of a user (admin only).
+static int command_whois(Client* cli, char* msg, char* buffer) {
+	char nick[NICK_LEN] = {};
 
-					if(!clients[clientFound]->isAdmin){
+	if(cli->isAdmin) {
+		get_command(nick, msg, 8, NICK_LEN);
+		str_trim(nick, NICK_LEN);
 
-							strcpy(clients[clientFound]->channel, channel_list[0].chName);
+		int clientFound = find_client(nick,cli);
 
-							memset(buffer, '\0', BUFFER_MAX);
-							sprintf(buffer, "%sVocê foi eliminado do canal %s, talvez você devesse repensar suas ações.\n\n%s", serverMsgColor, cli->channel,defltColor);
-							write(clients[clientFound]->sockfd, buffer, strlen(buffer));
+		if(clientFound!=-1){
 
-							sleep(0.7);
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sO endereço de IP de %s é %s\n\n%s", serverMsgColor, clients[clientFound]->nick,inet_ntoa(clients[clientFound]->address.sin_addr), defltColor);
+			client_write(cli, buffer, strlen(buffer));
 
-							channel_menu(clients[clientFound]);
+		} else {
 
-							sleep(0.7);
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
 
-							memset(buffer, '\0', BUFFER_MAX);
-							sprintf(buffer, "%s%s não está mais espalhando seu fedor no canal %s!\n\n%s", serverMsgColor, nick, cli->channel, defltColor);
-							printf("%s", buffer);
-							write(cli->sockfd, buffer, strlen(buffer));
-						}
-						else{
-							memset(buffer, '\0', BUFFER_MAX);
-							sprintf(buffer, "%sVocê não pode kikar a si mesmo do chat.\n\n%s", serverMsgColor, defltColor);
-							write(clients[clientFound]->sockfd, buffer, strlen(buffer));
-						}
+	}else {
+		memset(buffer, '\0', BUFFER_MAX);
+		sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nPode sair querendo saber os IP dos outros assim não!\n\n%s", serverMsgColor, defltColor);
+		client_write(cli, buffer, strlen(buffer));
+	}
 
-				} else {
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
+	return 0;
+}
 
-			} else {
-				memset(buffer, '\0', BUFFER_MAX);
-				sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nSe quer kickar geral, cria seu próprio canal!\n\n%s", serverMsgColor, defltColor);
-				write(cli->sockfd, buffer, strlen(buffer));
-			}
+// Changes the channel mode (admin only).
+static int command_mode(Client* cli, char* msg, char* buffer) {
+	char mode[3] = {};
 
-		} else if(strncmp(msg, " /mute", 6) == 0) {
+	if(cli->isAdmin) {
 
-			//only admin cans mute people
-			if(cli->isAdmin) {
+		get_command(mode, msg, 7, 3);
+		str_trim(mode, 3);
 
-				//get who will be muted
-				get_command(nick, msg, 7, NICK_LEN);
-				str_trim(nick, NICK_LEN);
+		// Finding the channel for which the administrator is responsible
+		int idChannel = find_channel(cli);
 
-				int clientFound = find_client(nick,cli);
+		if(strcmp(mode, "+i") == 0 && strcmp(channel_list[idChannel].chMode, "-i") == 0){
+			channel_set_mode(idChannel, mode);
 
-				if(clientFound!=-1){
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sEste canal agora é invite-only!\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
+		else if(strcmp(mode, "+i") == 0 && strcmp(channel_list[idChannel].chMode, "+i") == 0){
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sEste canal já é invite-only!\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
+		else if (strcmp(mode, "-i") == 0 && strcmp(channel_list[idChannel].chMode, "+i") == 0) {
+			channel_set_mode(idChannel, mode);
 
-						//notify that the client is muted
-						memset(buffer, '\0', BUFFER_MAX);
-						sprintf(buffer, "%sShh, cala boquinha.\n\n%s", serverMsgColor, defltColor);
-						write(clients[clientFound]->sockfd, buffer, strlen(buffer));
+			clear_invite_list(idChannel);
 
-						clients[clientFound]->isMuted = 1;
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sEste canal não é mais invite-only, qualquer um pode entrar!\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
+		else if(strcmp(mode, "-i") == 0 && strcmp(channel_list[idChannel].chMode, "-i") == 0){
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sEste canal já é aberto!\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
+		else {
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sModo inválido, únicas opções +i ou -i !\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
 
-						memset(buffer, '\0', BUFFER_MAX);
-						sprintf(buffer, "%s%s foi silenciadah!\n\n%s", serverMsgColor, nick, defltColor);
-						printf("%s", buffer);
-						write(cli->sockfd, buffer, strlen(buffer));
-				}
-				else {
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
-			}
-			else {
-				memset(buffer, '\0', BUFFER_MAX);
-				sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nSe quer mutar geral, cria seu próprio canal!\n\n%s", serverMsgColor, defltColor);
-				write(cli->sockfd, buffer, strlen(buffer));
-			}
+	}else {
+		memset(buffer, '\0', BUFFER_MAX);
+		sprintf(buffer, "%sPoxa... Somente o administrador possui o direito de mudar o mode do canal.\n\n%s", serverMsgColor, defltColor);
+		client_write(cli, buffer, strlen(buffer));
+	}
 
-		} else if(strncmp(msg, " /unmute", 8) == 0) {
+	return 0;
+}
 
-			if(cli->isAdmin) {
+// Invites a user to an invite-only channel (admin only).
+static int command_invite(Client* cli, char* msg, char* buffer) {
+	char nick[NICK_LEN] = {};
 
-				//get who will be unmuted
-				get_command(nick, msg, 9, NICK_LEN);
-				str_trim(nick, NICK_LEN);
+	if(cli->isAdmin) {
 
-				int clientFound = find_client(nick,cli);
+		//get who will be invited
+		get_command(nick, msg, 9, NICK_LEN);
+		str_trim(nick, NICK_LEN);
 
-				if(clientFound!=-1){
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sTá, pode falar.\n\n%s", serverMsgColor, defltColor);
-					write(clients[clientFound]->sockfd, buffer, strlen(buffer));
+		int clientFound = 0;
+		int clientExists = 0;
+		int idClient = -1;
 
-					clients[clientFound]->isMuted = 0;
+		// Finding the channel for which the administrator is responsible
+		int idChannel = find_channel(cli);
 
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%s%s foi liberadah!\n\n%s", serverMsgColor, nick, defltColor);
-					printf("%s", buffer);
-					write(cli->sockfd, buffer, strlen(buffer));
+		if(strcmp(channel_list[idChannel].chMode,"+i")!=0){
+			memset(buffer, '\0', BUFFER_MAX);
+			sprintf(buffer, "%sNão é possível convidar alguém para um canal que não é invite-only.\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
 
-				} else {
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
+		} else {
+			// Checking if the user exists and if isn't already invited to that channel
+			Client* invited = registry_find_nick(nick, -1);
 
-			} else {
-				memset(buffer, '\0', BUFFER_MAX);
-				sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nPode sair desmutando assim não!\n\n%s", serverMsgColor, defltColor);
-				write(cli->sockfd, buffer, strlen(buffer));
+			if (invited) {
+				clientExists = 1;
+				idClient = invited->userID;
 			}
 
-		} else if(strncmp(msg, " /whois", 7) == 0) {
+			for (int i = 0; i < MAX_INVITE; i++) {
 
-			if(cli->isAdmin) {
-				get_command(nick, msg, 8, NICK_LEN);
-				str_trim(nick, NICK_LEN);
+				if (strcmp(channel_list[idChannel].inviteUser[i], nick) == 0) {
+					memset(buffer, '\0', BUFFER_MAX);
+					sprintf(buffer, "%sO usuário %s já foi convidado a se juntar a este chat.\n\n%s", serverMsgColor, nick, defltColor);
+					client_write(cli, buffer, strlen(buffer));
+					clientFound = 1;
+					break;
+				}
+			}
 
-				int clientFound = find_client(nick,cli);
+			// If the user has not yet been invited and it is possible to
+			//invite more users to the chat, the process is done
+			if(clientExists && !clientFound && channel_list[idChannel].nroInvUser < MAX_INVITE - 1){
+				for(int i = 0; i < MAX_INVITE; i++){
+					if(channel_list[idChannel].inviteUser[i][0] == '\0'){
+						strcpy(channel_list[idChannel].inviteUser[i], nick);
 
-				if(clientFound!=-1){
+						memset(buffer, '\0', BUFFER_MAX);
+						sprintf(buffer, "%sO usuário %s foi convidado a se juntar a este chat.\n\n%s", serverMsgColor, nick, defltColor);
+						client_write(cli, buffer, strlen(buffer));
 
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sO endereço de IP de %s é %s\n\n%s", serverMsgColor, clients[clientFound]->nick,inet_ntoa(clients[clientFound]->address.sin_addr), defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
+						memset(buffer, '\0', BUFFER_MAX);
+						sprintf(buffer, "%sVocê recebeu um free pass para o canal %s, para poucos viu.\n\n%s", serverMsgColor,channel_list[cli->idChannel].chName, defltColor);
+						client_write(clients[idClient], buffer, strlen(buffer));
 
-				} else {
+						channel_list[idChannel].nroInvUser++;
 
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sCliente %s não encontrado.\n\n%s", serverMsgColor, nick, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
+						break;
+					}
 				}
 
-			}else {
+			}
+			else if(!clientExists){
 				memset(buffer, '\0', BUFFER_MAX);
-				sprintf(buffer, "%sTá achando que aqui é casa da mãe Joana?\nPode sair querendo saber os IP dos outros assim não!\n\n%s", serverMsgColor, defltColor);
-				write(cli->sockfd, buffer, strlen(buffer));
+				sprintf(buffer, "%sO usuário precisa estar conectado ao servidor para poder ser convidado a participar deste canal.%s\n\n", serverMsgColor, defltColor);
+				client_write(cli, buffer, strlen(buffer));
 			}
+			else if(channel_list[idChannel].nroInvUser >= MAX_INVITE - 1){
+				memset(buffer, '\0', BUFFER_MAX);
+				sprintf(buffer, "%sO canal já atingiu o número máximo de usuários convidados.%s\n\n", serverMsgColor, defltColor);
+				client_write(cli, buffer, strlen(buffer));
+			}
+		}
+	}
+	else {
+		memset(buffer, '\0', BUFFER_MAX);
+		sprintf(buffer, "%sPoxa... Somente o administrador pode convidar usuários para este canal.\n\n%s", serverMsgColor, defltColor);
+		client_write(cli, buffer, strlen(buffer));
+	}
 
+	return 0;
+}
 
-		} else if(strncmp(msg, " /mode", 6) == 0) {
+// Registers every command in the command table.
+void initialize_commands() {
+	command_register("quit", command_quit);
+	command_register("quitchannel", command_quitchannel);
+	command_register("join", command_join);
+	command_register("ping", command_ping);
+	command_register("nickname", command_nickname);
+	command_register("kick", command_kick);
+	command_register("mute", command_mute);
+	command_register("unmute", command_unmute);
+	command_register("whois", command_whois);
+	command_register("mode", command_mode);
+	command_register("invite", command_invite);
+}
 
-			if(cli->isAdmin) {
+// Handles a message received from a client.
+int handle_message(Client* cli, char* buffer, int receive) {
+	// A line may be up to NICK_LEN+MSG_LEN long, see read_client()
+	char msg[BUFFER_MAX] = {};
 
-				get_command(mode, msg, 7, 3);
-				str_trim(mode, 3);
+	// Echoing every line to the terminal would serialize delivery on stdio (-v only)
+	if (config.verbose) printf("%s", buffer);
 
-				// Finding the channel for which the administrator is responsible
-				int idChannel = find_channel(cli);
+	nick_trim(buffer, msg);
 
-				if(strcmp(mode, "+i") == 0 && strcmp(channel_list[idChannel].chMode, "-i") == 0){
-					strcpy(channel_list[idChannel].chMode, mode);
+	// The admin leaving a channel was asked to choose their successor
+	if (cli->state == CLI_AWAITING_ADMIN && receive > 0) {
+		cli->state = CLI_CONNECTED;
 
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sEste canal agora é invite-only!\n\n%s", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
-				else if(strcmp(mode, "+i") == 0 && strcmp(channel_list[idChannel].chMode, "+i") == 0){
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sEste canal já é invite-only!\n\n%s", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
-				else if (strcmp(mode, "-i") == 0 && strcmp(channel_list[idChannel].chMode, "+i") == 0) {
-					strcpy(channel_list[idChannel].chMode, mode);
+		int clientFound = change_admin(cli, buffer);
 
-					clear_invite_list(idChannel);
+		if (clientFound) {
+			client_leaves_channel(cli);
+		} else {
+			sprintf(buffer, "%sCliente não encontrado! Tente novamente...\n\n%s", serverMsgColor, defltColor);
+			client_write(cli, buffer, strlen(buffer));
+		}
 
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sEste canal não é mais invite-only, qualquer um pode entrar!\n\n%s", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
-				else if(strcmp(mode, "-i") == 0 && strcmp(channel_list[idChannel].chMode, "-i") == 0){
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sEste canal já é aberto!\n\n%s", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
-				else {
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sModo inválido, únicas opções +i ou -i !\n\n%s", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-				}
+		return 0;
+	}
 
-			}else {
-				memset(buffer, '\0', BUFFER_MAX);
-				sprintf(buffer, "%sPoxa... Somente o administrador possui o direito de mudar o mode do canal.\n\n%s", serverMsgColor, defltColor);
-				write(cli->sockfd, buffer, strlen(buffer));
-			}
+	/* Checks if the client left the chatroom without /quit; feof() would take
+	 stdin's lock, shared by every worker, for every line */
+	if(receive == 0 || feof_unlocked(stdin)) return command_quit(cli, msg, buffer);
 
+	if(receive < 0) {
+		printf("\nErro, conexão prejudicada.\n");
+		return 1;
+	}
 
-		} else if(strncmp(msg, " /invite", 8) == 0) {
+	// Only lines starting with '/' go through the command table
+	if(msg[0] == ' ' && msg[1] == '/') {
+		CommandHandler handler = command_lookup(msg + 2);
 
-			if(cli->isAdmin) {
+		if(handler) return handler(cli, msg, buffer);
+	}
 
-				//get who will be invited
-				get_command(nick, msg, 9, NICK_LEN);
-				str_trim(nick, NICK_LEN);
+	// Plain chat, or an unknown command, goes to the channel
+	if(strlen(buffer) > 0) {
 
-				int clientFound = 0;
-				int clientExists = 0;
-				int idClient = -1;
+		// The text after "nick: ", without the final '\n'
+		char* text = msg[0] == ' ' ? msg + 1 : msg;
+		size_t len = strlen(text);
 
-				// Finding the channel for which the administrator is responsible
-				int idChannel = find_channel(cli);
+		if (len > 0 && text[len-1] == '\n') len--;
 
-				if(strcmp(channel_list[idChannel].chMode,"+i")!=0){
-					memset(buffer, '\0', BUFFER_MAX);
-					sprintf(buffer, "%sNão é possível convidar alguém para um canal que não é invite-only.\n\n%s", serverMsgColor, defltColor);
-					write(cli->sockfd, buffer, strlen(buffer));
-
-				} else {
-					// Checking if the user exists and if isn't already invited to that channel
-					for (int i = 0; i < MAX_CLI; i++) {
-
-						if (clients[i] && strcmp(nick, clients[i]->nick) == 0){
-							clientExists = 1;
-							idClient = i;
-						}
-						if (strcmp(channel_list[idChannel].inviteUser[i], nick) == 0) {
-							memset(buffer, '\0', BUFFER_MAX);
-							sprintf(buffer, "%sO usuário %s já foi convidado a se juntar a este chat.\n\n%s", serverMsgColor, nick, defltColor);
-							write(cli->sockfd, buffer, strlen(buffer));
-							clientFound = 1;
-						}
-						if(clientExists && clientFound)
-							break;
+		if (cli->isMuted == 0)
+			broadcast_chat(cli, text, len);
 
-					}
 
-					// If the user has not yet been invited and it is possible to
-					//invite more users to the chat, the process is done
-					if(clientExists && !clientFound && channel_list[idChannel].nroInvUser < MAX_CLI - 1){
-						for(int i = 0; i < MAX_CLI; i++){
-							if(channel_list[idChannel].inviteUser[i][0] == '\0'){
-								strcpy(channel_list[idChannel].inviteUser[i], nick);
+		bzero(buffer, BUFFER_MAX);
+	}
 
-								memset(buffer, '\0', BUFFER_MAX);
-								sprintf(buffer, "%sO usuário %s foi convidado a se juntar a este chat.\n\n%s", serverMsgColor, nick, defltColor);
-								write(cli->sockfd, buffer, strlen(buffer));
+	return 0;
+}
 
-								memset(buffer, '\0', BUFFER_MAX);
-								sprintf(buffer, "%sVocê recebeu um free pass para o canal %s, para poucos viu.\n\n%s", serverMsgColor,cli->channel, defltColor);
-								write(clients[idClient]->sockfd, buffer, strlen(buffer));
+// Delivers a chat message to the members of a channel on this server.
+void deliver_chat(int idChannel, int except, uint32_t sender, const char* color, const char* nick, size_t nickLen,
+                  const char* text, size_t len) {
+	Payload* line = NULL;
+	Payload* frame = NULL;
+	char buffer[BUFFER_MAX];
 
-								channel_list[idChannel].nroInvUser++;
+	int recipients = 0;
 
-								break;
-							}
-						}
+	history_append(&channel_list[idChannel].history, sender, nick, nickLen, text, len);
+	channel_log_append(channel_list[idChannel].log, sender, nick, nickLen, text, len);
 
-					}
-					else if(!clientExists){
-						memset(buffer, '\0', BUFFER_MAX);
-						sprintf(buffer, "%sO usuário precisa estar conectado ao servidor para poder ser convidado a participar deste canal.%s\n\n", serverMsgColor, defltColor);
-						write(cli->sockfd, buffer, strlen(buffer));
-					}
-					else if(channel_list[idChannel].nroInvUser >= MAX_CLI - 1){
-						memset(buffer, '\0', BUFFER_MAX);
-						sprintf(buffer, "%sO canal já atingiu o número máximo de usuários convidados.%s\n\n", serverMsgColor, defltColor);
-						write(cli->sockfd, buffer, strlen(buffer));
-					}
-				}
+	for (Client* member = channel_list[idChannel].members; member; member = member->chNext) {
+		if (member->userID == except) continue;
+
+		recipients++;
+
+		if (member->binary) {
+			if (!frame) {
+				// Header, nickname length, nickname and text, in a single payload
+				size_t bodyLen = 1 + nickLen + len;
+				int n = proto_put_header(buffer, PROTO_OP_CHAT, idChannel, sender, bodyLen);
+
+				buffer[n++] = (char) nickLen;
+				memcpy(buffer + n, nick, nickLen);
+				memcpy(buffer + n + nickLen, text, len);
+
+				if (!(frame = payload_create(buffer, n + nickLen + len))) break;
 			}
-			else {
-				memset(buffer, '\0', BUFFER_MAX);
-				sprintf(buffer, "%sPoxa... Somente o administrador pode convidar usuários para este canal.\n\n%s", serverMsgColor, defltColor);
-				write(cli->sockfd, buffer, strlen(buffer));
+
+			client_write_frame(member, frame);
+		} else {
+			if (!line) {
+				int n = snprintf(buffer, BUFFER_MAX, "%s%.*s%s: %.*s\n", color, (int) nickLen, nick, defltColor, (int) len, text);
+
+				if (!(line = payload_create(buffer, n < BUFFER_MAX ? n : BUFFER_MAX - 1))) break;
 			}
 
-		}else if(receive > 0) {
+			client_write_frame(member, line);
+		}
+	}
 
-			if(strlen(buffer) > 0) {
+	metrics_observe(&metrics.fanout, recipients);
 
-				char n[NICK_LEN];
-				change_color(buffer, n);
-				snprintf(buffer, strlen(n)+strlen(buffer)+19, "%s%s%s:%s", cli->color, n, defltColor, msg);
+	if (line) payload_unref(line);
+	if (frame) payload_unref(frame);
+}
 
-				if (cli->isMuted == 0)
-					send_message_to_channel(buffer, cli->userID, cli->channel, 0);
+// Sends a chat message to the other members of the sender's channel, here and on linked servers.
+void broadcast_chat(Client* cli, const char* text, size_t len) {
+	lock_channel(cli->idChannel);
+	deliver_chat(cli->idChannel, cli->userID, cli->userID, cli->color, cli->nick, strlen(cli->nick), text, len);
+	federation_relay_chat(cli, text, len);
+	unlock_channel(cli->idChannel);
+}
 
+// Renders a channel's history as text lines or chat frames, in a single payload.
+static Payload* render_history(int idChannel, int binary) {
+	History* h = &channel_list[idChannel].history;
+	const char* data;
 
-				bzero(buffer, BUFFER_MAX);
-			}
+	// Per message: a frame header and the nickname length, or the colors, ": " and '\n'
+	size_t cap = h->bytes + (size_t) h->count * (binary ? PROTO_HEADER_LEN + 1 : 2 * sizeof(usrColors[0]) + 3);
+
+	char* out = (char*) malloc(cap);
+	if (!out) return NULL;
+
+	size_t len = 0;
+
+	for (int i = 0; i < h->count; i++) {
+		const HistEntry* e = history_get(h, i, &data);
+		int textLen = e->len - e->nickLen;
+
+		if (binary) {
+			len += proto_put_header(out + len, PROTO_OP_CHAT, idChannel, e->sender, e->len + 1);
+			out[len++] = (char) e->nickLen;
+			memcpy(out + len, data, e->len);
+			len += e->len;
 		} else {
-			printf("\nErro, conexão prejudicada.\n");
-			leaveFlag = 1;
+			len += sprintf(out + len, "%s%.*s%s: %.*s\n", usrColors[e->sender % 7], e->nickLen, data,
+			               defltColor, textLen, data + e->nickLen);
 		}
+	}
 
-		memset(buffer, '\0', BUFFER_MAX);
-		memset(msg, '\0', MSG_LEN);
+	Payload* p = payload_create(out, len);
+	free(out);
+
+	return p;
+}
+
+// Sends the client the history of its channel.
+void replay_history(Client* cli) {
+	History* h = &channel_list[cli->idChannel].history;
+	int binary = cli->binary != 0;
+
+	if (h->count == 0) return;
+
+	if (!h->replay[binary] && !(h->replay[binary] = render_history(cli->idChannel, binary))) return;
+
+	client_write_frame(cli, h->replay[binary]);
+}
+
+// Handles a frame received from a binary client.
+int handle_frame(Client* cli, char* frame, int len) {
+	char buffer[BUFFER_MAX];
+	ProtoHeader h;
+
+	if (proto_get_header(frame, &h) < 0) return 1;
 
-		sleep(0.7);
+	char* body = frame + PROTO_HEADER_LEN;
+
+	// Chat goes straight to the channel: no scanning, no reformatting
+	if (h.opcode == PROTO_OP_CHAT && cli->state == CLI_CONNECTED) {
+		if (cli->isMuted == 0 && h.bodyLen > 0)
+			broadcast_chat(cli, body, h.bodyLen);
+
+		return 0;
+	}
+
+	// Commands (and the answer to ask_new_admin()) are rare: they become a text line
+	if (h.opcode == PROTO_OP_COMMAND || h.opcode == PROTO_OP_CHAT) {
+		int n = snprintf(buffer, BUFFER_MAX, "%s: %.*s\n", cli->nick, (int) h.bodyLen, body);
+
+		return handle_message(cli, buffer, n < BUFFER_MAX ? n : BUFFER_MAX - 1);
 	}
 
-	// When client leaves the chat
+	// Unknown opcode
+	return 1;
+}
+
+// Handles client leaving the server.
+void client_leaves_server(Client* cli) {
+	// Whatever other workers left for it is dropped with the rest of its queue
+	cli->state = CLI_CLOSING;
+	worker_drain_inbox(&workers[cli->worker]);
+
+	federation_quit(cli);
 	close(cli->sockfd);
-	remove_client(cli->userID/*, clients, clients_mutex*/);
+	remove_client(cli->userID);
 	cliCount--;
-	free(cli);
-	// Marks the thread identified by thread as detached
-	pthread_detach(pthread_self());
-
-	return NULL;
+	unschedule_flush(cli);
+	compression_stop(cli);
+	client_pool_put(cli);
 }
@@ -1,3 +1,6 @@
+#ifndef SERVER_OPERATION_H
+#define SERVER_OPERATION_H
+
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,28 +10,74 @@
 
 
 #include "string_manipulation.h"
+#include "out_queue.h"
+#include "line_framer.h"
+#include "wire_protocol.h"
+#include "history.h"
+#include "channel_log.h"
 
 #define BUFFER_MAX 4097
-#define MAX_CLI 10
+#define MAX_INVITE 10
 #define MSG_LEN 2049
 #define CHANNEL_LEN 200
-#define CHANNEL_NUM 5
+
+// Channel locks (lock_channel()); a power of two
+#define CHANNEL_LOCKS 64
+
+// Largest frame a binary client may send
+#define FRAME_MAX (PROTO_HEADER_LEN+NICK_LEN+MSG_LEN)
+
+// Maximum number of queue slots sent by a single io_uring send
+#define URING_IOV 16
+
+// Connection states, driven by the event loop.
+#define CLI_AWAITING_NICK 0
+#define CLI_CONNECTED 1
+#define CLI_AWAITING_ADMIN 2
+#define CLI_CLOSING 3
 
 // === STRUCTURES RELATED TO SERVER OPERATION ===
 
 /*  Client structure:
 stores the address, its socket descriptor, the user ID and the nickname;
-makes client differentiation possible. */
-
-typedef struct {
+makes client differentiation possible. It also keeps the id of its channel
+(idChannel), the connection state, the bytes read but not handled yet (in),
+the messages the socket did not take yet (out) and the links of its
+worker's flushList (flushPrev, flushNext), of the nickname index (nickNext),
+of its channel's member list (chPrev, chNext) and of the client pool's free
+list (poolNext). binary is set for clients that speak the framed protocol
+(wire_protocol.h) instead of text lines; zin and zout are the zlib streams
+of a compressed connection, NULL otherwise. With the io_uring backend,
+ioRefs counts the operations in flight for the client and sendMsg/sendIov
+describe its send in flight. */
+
+typedef struct Client {
 	struct sockaddr_in address;
 	int sockfd;
 	int userID;
 	char color[10];
 	char nick[NICK_LEN];
-	char channel[200];
+	int idChannel;
 	int isAdmin;
 	int isMuted;
+	int worker;
+	int state;
+	int binary;
+	z_stream* zin;
+	z_stream* zout;
+	LineFramer in;
+	OutQueue out;
+	int flushPending;
+	struct Client* flushPrev;
+	struct Client* flushNext;
+	struct Client* nickNext;
+	struct Client* chPrev;
+	struct Client* chNext;
+	struct Client* poolNext;
+	int ioRefs;
+	int sending;
+	struct msghdr sendMsg;
+	struct iovec sendIov[URING_IOV];
 } Client;
 
 /* Channels names are strings (beginning with a '&' or '#' character) of
@@ -36,51 +85,131 @@ length up to 200 characters.  Apart from the the requirement that the
 first character being either '&' or '#'; the only restriction on a
 channel name is that it may not contain any spaces (' '), a control G
 (^G or ASCII 7), or a comma (',' which is used as a list item
-separator by the protocol). */
+separator by the protocol). history keeps the channel's last chat
+messages, replayed to whoever joins it; log, when there is one (-L),
+keeps all of them on disk. */
 
 typedef struct {
 	char chName[CHANNEL_LEN];
 	char chMode[3];
-	char inviteUser[MAX_CLI][NICK_LEN];
+	char inviteUser[MAX_INVITE][NICK_LEN];
 	int nroInvUser;
+	Client* members;
+	int nroMembers;
+	int hashNext;
+	History history;
+	ChannelLog* log;
 } Channel;
 
+/* Guards the registry, the channels and every client's nickname, channel
+and flags: held shared to deliver chat, exclusive to change any of them.
+A client's connection (its framer, queue and flushList links) is only
+touched by its worker and needs no lock. */
+extern pthread_rwlock_t clients_lock;
+
+// Number of connected clients
+extern _Atomic unsigned int cliCount;
+
+// Nickname colors, picked by userID % 7
+extern char usrColors[7][11];
+
 // === FUNCTIONS RELATED TO SERVER OPERATION ===
+/* Unless stated otherwise, these functions touch shared state and must be
+called with clients_lock held exclusively. */
 
-void is_server_full(int connfd);
+/* Refuses the connection if the server is full.
 
-/* Adds clients to the array of clients.
+	PARAMETERS
+	int connfd - socket file descriptor
+
+	RETURN
+	int - 1 if the connection was refused, 0 otherwise */
+int is_server_full(int connfd);
+
+/* Adds clients to the registry of clients.
 
 	PARAMETERS
-	Client* cli - client to be added */
-void add_client(Client* cli/*, Client** clients, pthread_mutex_t clients_mutex, char** usrColors*/);
+	Client* cli - client to be added
+
+	RETURN
+	int - 0 on success, -1 on allocation failure */
+int add_client(Client* cli);
 
-/* Creates client structure, defines client settings, adds them to the queue,
-creates a thread and a new function to handle client.
+/* Creates client structure, defines client settings and adds them to the
+registry, which gives them a userID. cli comes from the client pool, so its
+outbound queue is already empty.
 
 	PARAMETERS
 	struct sockaddr_in client_addr - client's address
-	int connfd - socket file descriptor
-	int userID - current user ID
+	int connfd  - socket file descriptor
+	Client* cli - new client
 
 	RETURN
-	Client* - new client */
-void create_client(struct sockaddr_in client_addr, int connfd, Client* cli);
+	int - 0 on success, -1 on allocation failure */
+int create_client(struct sockaddr_in client_addr, int connfd, Client* cli);
 
-/* Removes clients from the array of clients.
+/* Removes clients from the registry of clients.
 
 	PARAMETERS
 	int userID - current user ID */
 void remove_client(int userID);
 
-/* Sends messages to all the clients, except the sender itself.
+/* Adds a client to a channel's member list.
+
+	PARAMETERS
+	int idChannel - channel id
+	Client* cli   - client to be added */
+void channel_add_member(int idChannel, Client* cli);
+
+/* Removes a client from the member list of its channel.
+
+	PARAMETERS
+	Client* cli - client to be removed */
+void channel_remove_member(Client* cli);
+
+/* Moves a client to another channel, updating both member lists.
+
+	PARAMETERS
+	Client* cli   - current client
+	int idChannel - destination channel id */
+void change_channel(Client* cli, int idChannel);
+
+/* Locks a channel's history, log and deliveries; clients_lock must be held,
+shared or exclusively. Channels share CHANNEL_LOCKS locks, picked by id.
+A worker first queues what other workers left in its inbox, so every member
+gets a channel's messages in the same order, wherever the senders are.
+
+	PARAMETERS
+	int idChannel - channel id */
+void lock_channel(int idChannel);
+
+/* Unlocks a channel locked by lock_channel().
+
+	PARAMETERS
+	int idChannel - channel id */
+void unlock_channel(int idChannel);
+
+/* Delivers a message to the members of a channel on this server, except
+the sender itself; linked servers are not told.
+Must be called with the channel locked (lock_channel()); clients_lock held
+shared is enough.
+
+	PARAMETERS
+	const char* msg - message to be sent
+	size_t len 		- message length
+	int userID 		- sender's user ID (-1 sends it to every member)
+	int idChannel 	- channel id */
+void deliver_notice(const char* msg, size_t len, int userID, int idChannel);
+
+/* Sends messages to all the members of a channel, except the sender itself,
+on this server and on the linked ones.
 
 	PARAMETERS
 	char* msg 	  	- message to be sent
 	int   userID  	- current user ID
-	char* channel 	- current user's channel
+	int   idChannel - current user's channel id
 	int   leaveFlag - current user's leave flag */
-void send_message_to_channel(char* msg, int userID, char* channel, int leaveFlag);
+void send_message_to_channel(char* msg, int userID, int idChannel, int leaveFlag);
 
 /* Checks whether the channel name is valid.
 
@@ -92,22 +221,23 @@ int check_channel(char* channel);
 
 	PARAMETERS
 	char* nick 	  - user nickname
-	char* channel - channel name */
-int check_nick(char* nick, char* channel);
-
-/* Creates initial channel list.
+	int idChannel - channel id, -1 if the channel does not exist */
+int check_nick(char* nick, int idChannel);
 
-	PARAMETERS
-	Channel* channel_list - list of exisiting channels */
+/* Creates initial channel list (#all). */
 void initialize_channel_list();
 
-/* Shows channel menu.
+/* Registers the commands (/join, /kick, ...) in the command table; must
+run before the workers start. */
+void initialize_commands();
+
+/* Shows channel menu, rendered once per change of the channel list.
 
 	PARAMETERS
 	Client* cli - current client */
 void channel_menu(Client* cli);
 
-/* Shows welcome menu.
+/* Shows welcome menu (commands and channel menu) with a single write.
 
 	PARAMETERS
 	Client* cli - current client */
@@ -132,11 +262,18 @@ int find_other_clients(Client* cli);
 	Client* cli - current client */
 void delete_channel(Client* cli);
 
+/* Asks the admin leaving the channel who their successor will be.
+
+	PARAMETERS
+	Client* cli - current client */
+void ask_new_admin(Client* cli);
+
 /* Changes channel's admin.
 
 	PARAMETERS
-	Client* cli - current client*/
-int change_admin(Client*cli);
+	Client* cli  - current client
+	char* answer - message with the new admin's nickname */
+int change_admin(Client* cli, char* answer);
 
 /* Finds clients in the same channel.
 
@@ -157,8 +294,89 @@ int find_channel(Client* cli);
 	int idChannel - The channel id to be cleared */
 void clear_invite_list(int idChannel);
 
-/* Handles clients, assigns their values and joins the chat.
+/* Handles the nickname sent by a client right after the connection. A
+nickname record starting with a PROTO_OPT_* byte switches the client to
+the binary protocol and/or to compression.
+
+	PARAMETERS
+	Client* cli - current client
+	char* nick  - received nickname
+	int receive - recv() return value
+
+	RETURN
+	int - leaveFlag, 1 if the client must be disconnected */
+int handle_nick(Client* cli, char* nick, int receive);
+
+/* Delivers a chat message to the members of a channel on this server: text
+clients get the colored "nick: text" line, binary clients a PROTO_OP_CHAT
+frame. Each form is built once, if some member needs it. The message is
+also kept in the channel's history and log.
+Must be called with the channel locked (lock_channel()); clients_lock held
+shared is enough.
+
+	PARAMETERS
+	int idChannel 	 - channel id
+	int except 		 - user ID that is skipped (-1 for none)
+	uint32_t sender  - sender's user ID
+	const char* color - sender's color
+	const char* nick - sender's nickname
+	size_t nickLen 	 - nickname length
+	const char* text - message, without the nickname and the final '\n'
+	size_t len 		 - message length */
+void deliver_chat(int idChannel, int except, uint32_t sender, const char* color, const char* nick, size_t nickLen,
+                  const char* text, size_t len);
+
+/* Sends a chat message to the other members of the sender's channel, on
+this server and on the linked ones.
+clients_lock held shared is enough: the channel is locked meanwhile.
+
+	PARAMETERS
+	Client* cli 	 - sender
+	const char* text - message, without the nickname and the final '\n'
+	size_t len 		 - message length */
+void broadcast_chat(Client* cli, const char* text, size_t len);
+
+/* Sends the client the history of its channel, in a single write: text
+lines, or chat frames to a binary client. The rendered history is shared
+by everyone who joins until a new message comes in.
+
+	PARAMETERS
+	Client* cli - client that just joined the channel */
+void replay_history(Client* cli);
+
+/* Handles a frame received from a binary client. Chat is routed as is;
+commands go through handle_message() like a text line. Like there, chat
+from a connected client only needs clients_lock held shared.
 
 	PARAMETERS
-	void* arg - client structure */
-void* handle_client(void* arg);
+	Client* cli - current client
+	char* frame - received frame, header included
+	int len 	- frame size
+
+	RETURN
+	int - leaveFlag, 1 if the client must be disconnected */
+int handle_frame(Client* cli, char* frame, int len);
+
+/* Handles a message received from a client. Plain chat only needs
+clients_lock held shared; commands, the answer to ask_new_admin() and the
+end of the connection need it held exclusively.
+
+	PARAMETERS
+	Client* cli  - current client
+	char* buffer - received message
+	int receive  - line length, or the recv() return value if the
+				   connection was closed or broken
+
+	RETURN
+	int - leaveFlag, 1 if the client must be disconnected */
+int handle_message(Client* cli, char* buffer, int receive);
+
+/* Closes the client's connection and gives it back to the client pool.
+Must be called by the client's worker, which first empties its inbox, so
+nothing left there by other workers still points to the client.
+
+	PARAMETERS
+	Client* cli - current client */
+void client_leaves_server(Client* cli);
+
+#endif
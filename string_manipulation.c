@@ -17,14 +17,20 @@ void str_trim(char* arr, int len) {
 	}
 }
 
+// Finds the ':' that ends the nickname, within the line
+char* nick_end(const char* buffer) {
+	for(int j = 0; j < NICK_LEN && buffer[j] != '\0'; j++) {
+		if(buffer[j] == ':') return (char*) buffer + j;
+	}
+
+	return NULL;
+}
+
 // Separates nick and message from incoming buffer
 void nick_trim(char* buffer, char* msg) {
-	for(int j = 0; j < NICK_LEN; j++) {
-		if(buffer[j] == ':') {
-			strcpy(msg, buffer+j+1);
-			break;
-		}
-	}
+	char* colon = nick_end(buffer);
+
+	if(colon) strcpy(msg, colon+1);
 }
 
 // Changes nickname color
@@ -32,7 +38,7 @@ void change_color(char *buffer, char *n) {
 	int k;
 
 	memset(n, '\0', NICK_LEN);
-	for(k = 0; k < NICK_LEN; k++) {
+	for(k = 0; k < NICK_LEN - 1; k++) {
 		if(buffer[k] == ':') break;
 		else n[k] = buffer[k];
 	}
@@ -40,7 +46,23 @@ void change_color(char *buffer, char *n) {
 
 // Gets command from user input.
 void get_command(char* sub, char* msg, int commandLen, int maxLen) {
-	for (int i = commandLen; i <= commandLen+maxLen; i++) {
-		sub[i-commandLen] = msg[i];
+	int i;
+
+	for (i = 0; i < maxLen - 1 && msg[commandLen+i] != '\0'; i++) {
+		sub[i] = msg[commandLen+i];
 	}
+
+	sub[i] = '\0';
+}
+
+// FNV-1a hash of a string, or of its first len characters
+uint32_t fnv1a(const char* s, int len) {
+	uint32_t h = 2166136261u;
+
+	for (int i = 0; len < 0 ? s[i] != '\0' : i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+
+	return h;
 }
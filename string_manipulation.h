@@ -1,6 +1,7 @@
 // === FUNCTIONS RELATED TO STRING MANIPULATION ===
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #define NICK_LEN 50
 
@@ -14,7 +15,18 @@ void str_overwrite_stdout();
 	int   len - size of input strings */
 void str_trim(char* arr, int len);
 
-/* Separates nick and message from incoming buffer.
+/* Finds the ':' that ends the nickname at the start of a line. Only the
+first NICK_LEN characters are searched, and never past the line's '\0':
+buffers are reused, so what lies beyond it belongs to an older line.
+
+	PARAMETERS
+	const char* buffer - incoming line
+
+	RETURN
+	char* - the ':', NULL if there is none */
+char* nick_end(const char* buffer);
+
+/* Separates nick and message from incoming buffer (see nick_end()).
 
 	PARAMETERS
 	char* buffer - incoming buffer
@@ -28,7 +40,8 @@ void nick_trim(char* buffer, char* msg);
 	char* n 	 - user's nickame */
 void change_color(char* buffer, char* n);
 
-/* Gets command from user input.
+/* Gets command from user input. At most maxLen - 1 characters are copied,
+so sub always ends with '\0'.
 
 	PARAMETERS
 	char* sub - command
@@ -36,3 +49,13 @@ void change_color(char* buffer, char* n);
 	int commandLen - command length
 	int maxLen 	   - maximum length */
 void get_command(char* sub, char* msg, int commandLen, int maxLen);
+
+/* FNV-1a hash, shared by the server's hash tables.
+
+	PARAMETERS
+	const char* s - string
+	int len 	  - number of characters to hash, or -1 to stop at the '\0'
+
+	RETURN
+	uint32_t - hash */
+uint32_t fnv1a(const char* s, int len);
@@ -0,0 +1,401 @@
+// === FUNCTIONS RELATED TO THE IO_URING BACKEND ===
+#include "uring_loop.h"
+#include "client_pool.h"
+
+/* Every entry's user_data is a client pointer with the operation in its
+two low bits; without a client (NULL), it is the listener or the wake-up
+eventfd. */
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_ACCEPT 1
+#define OP_WAKE 2
+#define OP_MASK 3
+
+static Uring rings[MAX_WORKERS];
+
+// Maps the rings shared with the kernel and registers the provided buffers.
+static int uring_setup(Uring* r) {
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+
+	// Everything is released at fail, whatever step went wrong
+	char* sq = MAP_FAILED;
+	char* cq = MAP_FAILED;
+	size_t sqSize = 0;
+	size_t cqSize = 0;
+
+	r->sqes = MAP_FAILED;
+	r->bufRing = MAP_FAILED;
+	r->bufs = NULL;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+
+	r->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (r->fd < 0) return -1;
+
+	// Multishot completions must never be dropped
+	if (!(p.features & IORING_FEAT_NODROP)) goto fail;
+
+	sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels put both rings in a single mapping
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqSize > sqSize) sqSize = cqSize;
+		cqSize = sqSize;
+	}
+
+	sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) goto fail;
+	}
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail;
+
+	r->sqHead = (unsigned*) (sq + p.sq_off.head);
+	r->sqTail = (unsigned*) (sq + p.sq_off.tail);
+	r->sqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned*) (sq + p.sq_off.array);
+	r->sqEntries = p.sq_entries;
+	r->cqHead = (unsigned*) (cq + p.cq_off.head);
+	r->cqTail = (unsigned*) (cq + p.cq_off.tail);
+	r->cqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	r->pending = 0;
+
+	// Provided buffers: the kernel picks one for each chunk a receive takes
+	r->bufRing = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	r->bufs = (char*) malloc((size_t) URING_BUFS * URING_BUF_SIZE);
+	if (r->bufRing == MAP_FAILED || !r->bufs) goto fail;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) r->bufRing;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+
+	for (int i = 0; i < URING_BUFS; i++) {
+		struct io_uring_buf* b = &r->bufRing->bufs[i];
+
+		b->addr = (unsigned long) (r->bufs + (size_t) i * URING_BUF_SIZE);
+		b->len = URING_BUF_SIZE;
+		b->bid = i;
+	}
+
+	__atomic_store_n(&r->bufRing->tail, URING_BUFS, __ATOMIC_RELEASE);
+
+	return 0;
+
+fail:
+	// The worker falls back to epoll and keeps none of this
+	if (r->bufRing != MAP_FAILED) munmap(r->bufRing, URING_BUFS * sizeof(struct io_uring_buf));
+	free(r->bufs);
+
+	if (r->sqes != MAP_FAILED) munmap(r->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	if (cq != MAP_FAILED && cq != sq) munmap(cq, cqSize);
+	if (sq != MAP_FAILED) munmap(sq, sqSize);
+
+	close(r->fd);
+
+	r->fd = -1;
+	r->sqes = NULL;
+	r->bufRing = NULL;
+	r->bufs = NULL;
+
+	return -1;
+}
+
+// Gives a provided buffer back to the kernel.
+static void return_buffer(Uring* r, int bid) {
+	unsigned short tail = r->bufRing->tail;
+	struct io_uring_buf* b = &r->bufRing->bufs[tail & (URING_BUFS - 1)];
+
+	b->addr = (unsigned long) (r->bufs + (size_t) bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+
+	__atomic_store_n(&r->bufRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/* Submits the queued entries and waits for at least wait completions.
+Returns -1 on error. */
+static int uring_enter(Uring* r, unsigned wait) {
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) return -1;
+
+	r->pending -= ret;
+
+	return 0;
+}
+
+/* Takes a free submission entry, submitting the queued ones first if the
+ring is full. The entry is only read by the kernel on io_uring_enter(),
+which runs on this thread, so it may be filled after the tail moves. */
+static struct io_uring_sqe* get_sqe(Uring* r) {
+	unsigned tail = *r->sqTail;
+
+	while (tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) == r->sqEntries) {
+		if (uring_enter(r, 0) < 0) {
+			printf("\nErro: io_uring_enter.\n");
+
+			// EXIT FAILURE
+			exit(1);
+		}
+	}
+
+	unsigned idx = tail & *r->sqMask;
+	struct io_uring_sqe* sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqArray[idx] = idx;
+
+	__atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+
+	return sqe;
+}
+
+// Arms a multishot accept on the worker's listener.
+static void arm_accept(Uring* r, Worker* w) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = w->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+
+	// make_room() may write to a client outside the ring: it must not block
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = OP_ACCEPT;
+}
+
+// Arms a read of the wake-up eventfd.
+static void arm_wake(Uring* r, Worker* w) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = w->wakefd;
+	sqe->addr = (unsigned long) &r->wakeCount;
+	sqe->len = sizeof(r->wakeCount);
+	sqe->user_data = OP_WAKE;
+}
+
+// Arms a multishot receive into the provided buffers.
+static void arm_recv(Uring* r, Client* cli) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = cli->sockfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (unsigned long) cli | OP_RECV;
+
+	cli->ioRefs++;
+}
+
+/* Disconnects a client. Its operations in flight are ended by shutdown(),
+even if make_room() already marked it as closing; it only goes back to the
+pool after the last of them completes. */
+static void close_client(Client* cli) {
+	cli->state = CLI_CLOSING;
+
+	if (cli->ioRefs > 0) shutdown(cli->sockfd, SHUT_RDWR);
+	else disconnect_client(cli);
+}
+
+// Sends the first slots of the client's queue, unless a send is in flight.
+static void start_send(Uring* r, Client* cli) {
+	if (cli->sending || cli->out.count == 0) return;
+
+	// Everything queued since the last send is compressed together
+	if (cli->zout && queue_compress(&cli->out, cli->zout) < 0) {
+		close_client(cli);
+		return;
+	}
+
+	memset(&cli->sendMsg, 0, sizeof(cli->sendMsg));
+	cli->sendMsg.msg_iov = cli->sendIov;
+	cli->sendMsg.msg_iovlen = queue_iov(&cli->out, cli->sendIov, URING_IOV);
+
+	struct io_uring_sqe* sqe = get_sqe(r);
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = cli->sockfd;
+	sqe->addr = (unsigned long) &cli->sendMsg;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long) cli | OP_SEND;
+
+	cli->sending = 1;
+	cli->ioRefs++;
+}
+
+// Handles a new connection taken by the multishot accept.
+static void on_accept(Uring* r, Worker* w, int connfd) {
+	struct sockaddr_in client_addr;
+	socklen_t cliLen = sizeof(client_addr);
+
+	// The multishot accept does not give the address
+	if (getpeername(connfd, (struct sockaddr*) &client_addr, &cliLen) < 0) {
+		close(connfd);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&clients_lock);
+	Client* cli = admit_client(w, connfd, client_addr);
+	pthread_rwlock_unlock(&clients_lock);
+
+	if (!cli) return;
+
+	cli->ioRefs = 0;
+	cli->sending = 0;
+
+	arm_recv(r, cli);
+}
+
+// Handles data (or the end of the connection) taken by a receive.
+static void on_recv(Uring* r, Client* cli, struct io_uring_cqe* cqe) {
+	int leaveFlag = 0;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (cqe->res > 0 && cli->state != CLI_CLOSING) {
+			metrics_input_start(cqe->res);
+			leaveFlag = client_feed_input(cli, r->bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+			metrics_input_end();
+		}
+
+		return_buffer(r, bid);
+	} else if (cli->state != CLI_CLOSING && cqe->res != -ENOBUFS) {
+		// The connection was closed (0) or broken
+		if (cqe->res < 0) errno = -cqe->res;
+
+		client_handle_input(cli, cqe->res < 0 ? -1 : 0);
+		leaveFlag = 1;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		cli->ioRefs--;
+
+		// The receive stopped: it is armed again while the client is alive
+		if (!leaveFlag && cli->state != CLI_CLOSING) arm_recv(r, cli);
+	}
+
+	if (leaveFlag || cli->state == CLI_CLOSING) close_client(cli);
+}
+
+// Handles the end of a send.
+static void on_send(Uring* r, Client* cli, struct io_uring_cqe* cqe) {
+	cli->sending = 0;
+	cli->ioRefs--;
+
+	if (cqe->res < 0) cli->state = CLI_CLOSING;
+	else queue_consume(&cli->out, cqe->res);
+
+	if (cli->state == CLI_CLOSING) close_client(cli);
+	else start_send(r, cli);
+}
+
+// Handles every completion available.
+static void reap_completions(Uring* r, Worker* w) {
+	unsigned head = *r->cqHead;
+	unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe cqe = r->cqes[head & *r->cqMask];
+
+		Client* cli = (Client*) (unsigned long) (cqe.user_data & ~(unsigned long) OP_MASK);
+		int op = cqe.user_data & OP_MASK;
+
+		if (cli == NULL && op == OP_ACCEPT) {
+			if (cqe.res >= 0) on_accept(r, w, cqe.res);
+			else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED) printf("\nErro: accept.\n");
+
+			if (!(cqe.flags & IORING_CQE_F_MORE)) arm_accept(r, w);
+		} else if (cli == NULL) {
+			// Other threads left messages in the inbox, queued by flush_sends()
+			arm_wake(r, w);
+		} else if (op == OP_RECV) {
+			on_recv(r, cli, &cqe);
+		} else {
+			on_send(r, cli, &cqe);
+		}
+	}
+
+	__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Starts a send for every client in the worker's flushList, after queuing
+what other workers left in its inbox; clients marked as closing are
+disconnected here. */
+static void flush_sends(Uring* r, Worker* w) {
+	worker_drain_inbox(w);
+
+	while (w->flushList) {
+		Client* cli = w->flushList;
+
+		unschedule_flush(cli);
+
+		if (cli->state == CLI_CLOSING) close_client(cli);
+		else start_send(r, cli);
+	}
+}
+
+// io_uring loop.
+void* run_uring_loop(void* arg) {
+	Worker* w = (Worker*) arg;
+	Uring* r = &rings[w->id];
+
+	if (uring_setup(r) < 0) {
+		if (r->fd >= 0) close(r->fd);
+
+		printf("\nio_uring indisponível, usando epoll.\n");
+		return run_event_loop(arg);
+	}
+
+	thisWorker = w;
+	metrics_register();
+
+	/* The kernel waits for connections and messages itself, so the listener
+	 and the eventfd are left blocking; accepted sockets are not */
+	if (fcntl(w->wakefd, F_SETFL, fcntl(w->wakefd, F_GETFL, 0) & ~O_NONBLOCK) < 0 ||
+	    fcntl(w->listenfd, F_SETFL, fcntl(w->listenfd, F_GETFL, 0) & ~O_NONBLOCK) < 0) {
+		printf("\nErro: io_uring.\n");
+
+		// EXIT FAILURE
+		exit(1);
+	}
+
+	arm_accept(r, w);
+	arm_wake(r, w);
+
+	while (1) {
+		// Sends of the last turn go out with the wait for the next events
+		if (uring_enter(r, 1) < 0) {
+			printf("\nErro: io_uring_enter.\n");
+
+			// EXIT FAILURE
+			exit(1);
+		}
+
+		// Only this worker touches its clients' connections: no lock here
+		reap_completions(r, w);
+		flush_sends(r, w);
+	}
+
+	return NULL;
+}
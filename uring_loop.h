@@ -0,0 +1,56 @@
+// === FUNCTIONS RELATED TO THE IO_URING BACKEND ===
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "event_loop.h"
+
+// Submission and completion queue sizes
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+
+// Provided buffers for receives: count (a power of two) and size of each one
+#define URING_BUFS 256
+#define URING_BUF_SIZE 4096
+
+// Buffer group of the provided buffers
+#define URING_BGID 0
+
+/*  Uring structure:
+a worker's io_uring instance. The submission and completion rings are
+shared with the kernel; bufRing hands the kernel the buffers (bufs) that
+multishot receives fill. pending is the number of entries queued since
+the last io_uring_enter(). */
+
+typedef struct {
+	int fd;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned sqEntries;
+	struct io_uring_sqe* sqes;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	struct io_uring_cqe* cqes;
+	unsigned pending;
+	struct io_uring_buf_ring* bufRing;
+	char* bufs;
+	uint64_t wakeCount;
+} Uring;
+
+/* io_uring loop: the same job as run_event_loop(), but the worker's
+listener is served by a multishot accept, clients by multishot receives
+into provided buffers, and every send queued during a turn goes to the
+kernel in the same io_uring_enter() call that waits for the next events.
+If the kernel does not allow io_uring, the worker runs run_event_loop().
+
+	PARAMETERS
+	void* arg - worker structure */
+void* run_uring_loop(void* arg);
+
+#endif
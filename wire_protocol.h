@@ -0,0 +1,107 @@
+// === BINARY WIRE PROTOCOL ===
+/* Shared by the server and the client (which does not link any server
+file), so everything here lives in the header. */
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* A client asks for protocol options by sending a byte with PROTO_OPT_*
+bits right before its nickname, inside the NICK_LEN-byte nickname record.
+Option bytes are below PROTO_OPT_END, so they never show up in a nickname
+typed by a user. */
+#define PROTO_OPT_BINARY 0x01
+#define PROTO_OPT_DEFLATE 0x02
+#define PROTO_OPT_END 0x04
+
+/* With PROTO_OPT_DEFLATE, everything after the nickname record goes through
+a zlib stream in each direction, with a sync flush at the end of every
+burst of data. */
+#define PROTO_DEFLATE_LEVEL 1
+#define PROTO_DEFLATE_WINDOW 13
+#define PROTO_DEFLATE_MEMLEVEL 6
+
+/* Frame layout, every number in network byte order:
+	uint32 len 	   - number of bytes after this field (PROTO_HEADER_LEN - 4 + body)
+	uint8  opcode  - PROTO_OP_*
+	uint32 channel - channel id; set by the server, ignored when sent by clients
+	uint32 sender  - userID of the sender, PROTO_SERVER_ID for the server
+	body 		   - len - 9 bytes */
+#define PROTO_HEADER_LEN 13
+
+/* Chat message. Client to server: the body is the text. Server to client:
+the body is one byte with the nickname length, the nickname and the text. */
+#define PROTO_OP_CHAT 1
+
+// Command, client to server: the body is the command line, e.g. "/join #x"
+#define PROTO_OP_COMMAND 2
+
+// Server to client: text from the server (replies, menus, notices)
+#define PROTO_OP_NOTICE 3
+
+#define PROTO_SERVER_ID 0xFFFFFFFFu
+
+/*  ProtoHeader structure:
+a decoded frame header; bodyLen is the size of the body alone. */
+
+typedef struct {
+	uint32_t bodyLen;
+	uint8_t opcode;
+	uint32_t channel;
+	uint32_t sender;
+} ProtoHeader;
+
+/* Writes a frame header.
+
+	PARAMETERS
+	char* out 		 - buffer with room for PROTO_HEADER_LEN bytes
+	uint8_t opcode 	 - PROTO_OP_*
+	uint32_t channel - channel id
+	uint32_t sender  - sender's userID
+	uint32_t bodyLen - size of the body that follows the header
+
+	RETURN
+	int - PROTO_HEADER_LEN */
+static inline int proto_put_header(char* out, uint8_t opcode, uint32_t channel, uint32_t sender, uint32_t bodyLen) {
+	uint32_t len = htonl(PROTO_HEADER_LEN - 4 + bodyLen);
+
+	channel = htonl(channel);
+	sender = htonl(sender);
+
+	memcpy(out, &len, 4);
+	out[4] = (char) opcode;
+	memcpy(out + 5, &channel, 4);
+	memcpy(out + 9, &sender, 4);
+
+	return PROTO_HEADER_LEN;
+}
+
+/* Reads a frame header.
+
+	PARAMETERS
+	const char* in - PROTO_HEADER_LEN bytes
+	ProtoHeader* h - decoded header
+
+	RETURN
+	int - 0 on success, -1 if the length is too small for a header */
+static inline int proto_get_header(const char* in, ProtoHeader* h) {
+	uint32_t len, channel, sender;
+
+	memcpy(&len, in, 4);
+	memcpy(&channel, in + 5, 4);
+	memcpy(&sender, in + 9, 4);
+
+	len = ntohl(len);
+	if (len < PROTO_HEADER_LEN - 4) return -1;
+
+	h->bodyLen = len - (PROTO_HEADER_LEN - 4);
+	h->opcode = (uint8_t) in[4];
+	h->channel = ntohl(channel);
+	h->sender = ntohl(sender);
+
+	return 0;
+}
+
+#endif